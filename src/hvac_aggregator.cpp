@@ -0,0 +1,568 @@
+/* hvac_aggregator - one set of server connections per node
+ *
+ * hvac_aggregator
+ *
+ * Start one per node before the application, with the job's environment
+ * (SLURM_JOBID, HVAC_TRANSPORT, ...). It loads the server address table,
+ * connects to every server and listens on na+sm. Its address goes to
+ * /dev/shm/hvac_agg.<jobid> along with the run id of the address table and
+ * its pid, clients started with HVAC_AGGREGATOR=1 find it there and send
+ * their open, read and close RPCs to it instead of the servers, the inputs
+ * name the target server. The ranks of a node then share one Mercury
+ * connection per server. Clients ignore a file of another run or of an
+ * aggregator that is gone, SIGTERM and SIGINT remove it.
+ *
+ * A read of the same range of the same server handle as one already in
+ * flight joins it, the server sends the bytes once and the aggregator
+ * pushes them to every waiting rank. An upstream RPC still unanswered
+ * after HVAC_RPC_TIMEOUT_MS fails its ranks with -1, so they fall back to
+ * the PFS as they would without the aggregator.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <tuple>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <assert.h>
+
+#include "hvac_comm.h"
+#include "hvac_bootstrap.h"
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+using namespace std;
+
+/* Referenced by the logging code */
+__thread bool tl_disable_redirect = false;
+
+#define HVAC_AGG_REPORT_S 60
+
+/* Listening class the local ranks reach us on */
+static hg_class_t *agg_class = NULL;
+static hg_context_t *agg_context = NULL;
+
+/* Upstream ids, registered on the client classes */
+static hg_id_t agg_open_id;
+static hg_id_t agg_read_id;
+static hg_id_t agg_close_id;
+
+static uint64_t agg_timeout_ns = 10000000000ULL;
+
+/* Upstream RPCs awaiting an answer, when they were sent and the read
+ * behind them if they are one */
+struct hvac_agg_read;
+static pthread_mutex_t agg_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<hg_handle_t, pair<uint64_t, struct hvac_agg_read *>> agg_upstream;
+
+struct hvac_agg_key {
+    int32_t server;
+    int64_t fd;
+    int64_t offset;
+    int32_t size;
+
+    bool operator<(const hvac_agg_key &other) const
+    {
+        return tie(server, fd, offset, size) < tie(other.server, other.fd, other.offset, other.size);
+    }
+};
+
+/* One upstream read and the ranks waiting for it. The inputs hold the
+ * ranks' bulk handles until the push to them is done. An expired read has
+ * answered its ranks already, it only waits for the server to stop pushing
+ * into its buffer. */
+struct hvac_agg_read {
+    hvac_agg_key key;
+    bool expired;
+    void *buffer;
+    hg_size_t size;
+    hg_bulk_t up_bulk;
+    hg_bulk_t down_bulk;
+    vector<pair<hg_handle_t, hvac_rpc_in_t>> waiters;
+    atomic<size_t> pushes;
+    hvac_rpc_out_t out;
+};
+static map<hvac_agg_key, hvac_agg_read *> agg_reads;
+static atomic<uint64_t> agg_read_count(0);
+static atomic<uint64_t> agg_read_joined(0);
+
+/* An open or close passed through */
+struct hvac_agg_call {
+    hg_handle_t down;
+    hg_handle_t up;
+};
+
+static uint64_t hvac_agg_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Handle for an RPC to server on whichever class reaches it */
+static bool hvac_agg_create(int32_t server, hg_id_t id, hg_handle_t *handle)
+{
+    hg_context_t *context;
+    hg_addr_t addr = hvac_client_comm_lookup_addr(server, &context);
+    if (addr == HG_ADDR_NULL)
+    {
+        L4C_ERR("No address for server %d\n", server);
+        return false;
+    }
+    hvac_comm_create_handle(context, addr, id, handle);
+    hvac_comm_free_addr(context, addr);
+    return true;
+}
+
+/* tracked RPCs are cancelled by the sweep once they are overdue, reads
+ * are expired instead, see hvac_agg_sweep */
+static hg_return_t hvac_agg_forward(hg_handle_t handle, hg_cb_t cb, void *arg, void *in, bool tracked,
+                                    struct hvac_agg_read *read = NULL)
+{
+    if (tracked)
+    {
+        pthread_mutex_lock(&agg_mutex);
+        agg_upstream[handle] = make_pair(hvac_agg_now(), read);
+        pthread_mutex_unlock(&agg_mutex);
+    }
+    hg_return_t ret = HG_Forward(handle, cb, arg, in);
+    if (ret != HG_SUCCESS && tracked)
+    {
+        pthread_mutex_lock(&agg_mutex);
+        agg_upstream.erase(handle);
+        pthread_mutex_unlock(&agg_mutex);
+    }
+    return ret;
+}
+
+static void hvac_agg_answered(hg_handle_t handle)
+{
+    pthread_mutex_lock(&agg_mutex);
+    agg_upstream.erase(handle);
+    pthread_mutex_unlock(&agg_mutex);
+}
+
+static void hvac_agg_read_respond(hg_handle_t handle, hvac_rpc_in_t *in, const hvac_rpc_out_t *out);
+
+/* A cancel does not stop a push the server already started, so overdue
+ * reads are not cancelled. Their ranks get -1 and fall back, the buffer
+ * stays until the upstream read completes. */
+static void hvac_agg_sweep()
+{
+    vector<pair<hg_handle_t, hvac_rpc_in_t>> expired;
+
+    if (agg_timeout_ns == 0)
+        return;
+    uint64_t now = hvac_agg_now();
+    /* Held across HG_Cancel, the callback cannot destroy the handle meanwhile */
+    pthread_mutex_lock(&agg_mutex);
+    for (auto &it : agg_upstream)
+    {
+        if (it.second.first == UINT64_MAX || now - it.second.first <= agg_timeout_ns)
+            continue;
+        it.second.first = UINT64_MAX;
+        struct hvac_agg_read *read = it.second.second;
+        if (read == NULL)
+        {
+            L4C_ERR("Upstream RPC overdue, cancelling\n");
+            HG_Cancel(it.first);
+            continue;
+        }
+        L4C_ERR("Upstream read overdue, failing its ranks\n");
+        read->expired = true;
+        /* Later reads of the range go upstream again */
+        auto found = agg_reads.find(read->key);
+        if (found != agg_reads.end() && found->second == read)
+            agg_reads.erase(found);
+        expired.insert(expired.end(), read->waiters.begin(), read->waiters.end());
+        read->waiters.clear();
+    }
+    pthread_mutex_unlock(&agg_mutex);
+
+    hvac_rpc_out_t out;
+    out.ret = -1;
+    out.load = 0;
+    for (auto &waiter : expired)
+        hvac_agg_read_respond(waiter.first, &waiter.second, &out);
+}
+
+static void hvac_agg_open_fail(hg_handle_t handle)
+{
+    hvac_open_out_t out;
+    memset(&out, 0, sizeof(out));
+    out.ret_status = -1;
+    out.file_size = -1;
+    out.replicas = 1;
+    out.redirect = -1;
+    HG_Respond(handle, NULL, NULL, &out);
+}
+
+static hg_return_t
+hvac_agg_open_cb(const struct hg_cb_info *info)
+{
+    struct hvac_agg_call *call = (struct hvac_agg_call *)info->arg;
+    hvac_open_out_t out;
+
+    hvac_agg_answered(call->up);
+    if (info->ret == HG_SUCCESS && HG_Get_output(call->up, &out) == HG_SUCCESS)
+    {
+        HG_Respond(call->down, NULL, NULL, &out);
+        HG_Free_output(call->up, &out);
+    }
+    else
+        hvac_agg_open_fail(call->down);
+    HG_Destroy(call->up);
+    HG_Destroy(call->down);
+    delete call;
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hvac_agg_open_handler(hg_handle_t handle)
+{
+    hvac_open_in_t in;
+    int ret = HG_Get_input(handle, &in);
+    assert(ret == HG_SUCCESS);
+
+    struct hvac_agg_call *call = new hvac_agg_call;
+    call->down = handle;
+    if (!hvac_agg_create(in.server, agg_open_id, &call->up))
+    {
+        hvac_agg_open_fail(handle);
+        HG_Destroy(handle);
+        delete call;
+    }
+    else if (hvac_agg_forward(call->up, hvac_agg_open_cb, call, &in, true) != HG_SUCCESS)
+    {
+        hvac_agg_open_fail(handle);
+        HG_Destroy(call->up);
+        HG_Destroy(handle);
+        delete call;
+    }
+    HG_Free_input(handle, &in);
+    return HG_SUCCESS;
+}
+
+/* Close is one way, the callback only tells it went out */
+static hg_return_t
+hvac_agg_close_cb(const struct hg_cb_info *info)
+{
+    HG_Destroy(info->info.forward.handle);
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hvac_agg_close_handler(hg_handle_t handle)
+{
+    hvac_close_in_t in;
+    hg_handle_t up;
+    int ret = HG_Get_input(handle, &in);
+    assert(ret == HG_SUCCESS);
+
+    if (hvac_agg_create(in.server, agg_close_id, &up) &&
+        hvac_agg_forward(up, hvac_agg_close_cb, NULL, &in, false) != HG_SUCCESS)
+        HG_Destroy(up);
+    HG_Free_input(handle, &in);
+    HG_Destroy(handle);
+    return HG_SUCCESS;
+}
+
+static void hvac_agg_read_release(struct hvac_agg_read *read)
+{
+    if (read->down_bulk != HG_BULK_NULL)
+        HG_Bulk_free(read->down_bulk);
+    if (read->up_bulk != HG_BULK_NULL)
+        HG_Bulk_free(read->up_bulk);
+    free(read->buffer);
+    delete read;
+}
+
+static void hvac_agg_read_respond(hg_handle_t handle, hvac_rpc_in_t *in, const hvac_rpc_out_t *out)
+{
+    HG_Respond(handle, NULL, NULL, (void *)out);
+    HG_Free_input(handle, in);
+    HG_Destroy(handle);
+}
+
+struct hvac_agg_push {
+    struct hvac_agg_read *read;
+    size_t waiter;
+};
+
+static hg_return_t
+hvac_agg_push_cb(const struct hg_cb_info *info)
+{
+    struct hvac_agg_push *push = (struct hvac_agg_push *)info->arg;
+    struct hvac_agg_read *read = push->read;
+    auto &waiter = read->waiters[push->waiter];
+    hvac_rpc_out_t out = read->out;
+
+    if (info->ret != HG_SUCCESS)
+        out.ret = -1;
+    hvac_agg_read_respond(waiter.first, &waiter.second, &out);
+    delete push;
+    if (--read->pushes == 0)
+        hvac_agg_read_release(read);
+    return HG_SUCCESS;
+}
+
+/* The upstream read is over, hands its bytes to everyone who asked */
+static void hvac_agg_read_finish(struct hvac_agg_read *read, int32_t ret, uint32_t load)
+{
+    /* Later reads of the range go upstream again. An expired read has no
+     * one left to answer, the server is done with its buffer now. */
+    pthread_mutex_lock(&agg_mutex);
+    bool expired = read->expired;
+    if (!expired)
+        agg_reads.erase(read->key);
+    pthread_mutex_unlock(&agg_mutex);
+    if (expired)
+    {
+        hvac_agg_read_release(read);
+        return;
+    }
+
+    read->out.ret = ret;
+    read->out.load = load;
+    hg_size_t size = ret > 0 ? (hg_size_t)ret : 0;
+    if (size > 0 && HG_Bulk_create(agg_class, 1, &read->buffer, &size, HG_BULK_READ_ONLY,
+                                   &read->down_bulk) != HG_SUCCESS)
+    {
+        read->down_bulk = HG_BULK_NULL;
+        read->out.ret = -1;
+    }
+    if (read->out.ret <= 0)
+    {
+        for (auto &waiter : read->waiters)
+            hvac_agg_read_respond(waiter.first, &waiter.second, &read->out);
+        hvac_agg_read_release(read);
+        return;
+    }
+
+    read->pushes = read->waiters.size();
+    for (size_t i = 0; i < read->waiters.size(); i++)
+    {
+        auto &waiter = read->waiters[i];
+        struct hvac_agg_push *push = new hvac_agg_push;
+        push->read = read;
+        push->waiter = i;
+        if (HG_Bulk_transfer(agg_context, hvac_agg_push_cb, push, HG_BULK_PUSH,
+                             HG_Get_info(waiter.first)->addr, waiter.second.bulk_handle, 0,
+                             read->down_bulk, 0, size, HG_OP_ID_IGNORE) != HG_SUCCESS)
+        {
+            hvac_rpc_out_t out = read->out;
+            out.ret = -1;
+            hvac_agg_read_respond(waiter.first, &waiter.second, &out);
+            delete push;
+            if (--read->pushes == 0)
+                hvac_agg_read_release(read);
+        }
+    }
+}
+
+static hg_return_t
+hvac_agg_read_cb(const struct hg_cb_info *info)
+{
+    struct hvac_agg_read *read = (struct hvac_agg_read *)info->arg;
+    hg_handle_t up = info->info.forward.handle;
+    hvac_rpc_out_t out;
+    int32_t ret = -1;
+    uint32_t load = 0;
+
+    hvac_agg_answered(up);
+    if (info->ret == HG_SUCCESS && HG_Get_output(up, &out) == HG_SUCCESS)
+    {
+        ret = out.ret;
+        load = out.load;
+        HG_Free_output(up, &out);
+    }
+    HG_Destroy(up);
+    hvac_agg_read_finish(read, ret, load);
+    return HG_SUCCESS;
+}
+
+static hg_return_t
+hvac_agg_read_handler(hg_handle_t handle)
+{
+    hvac_rpc_in_t in;
+    int ret = HG_Get_input(handle, &in);
+    assert(ret == HG_SUCCESS);
+
+    agg_read_count++;
+    hvac_agg_key key = { in.server, in.accessfd, in.offset, in.input_val };
+    pthread_mutex_lock(&agg_mutex);
+    auto it = agg_reads.find(key);
+    if (it != agg_reads.end())
+    {
+        it->second->waiters.push_back(make_pair(handle, in));
+        pthread_mutex_unlock(&agg_mutex);
+        agg_read_joined++;
+        return HG_SUCCESS;
+    }
+    struct hvac_agg_read *read = new hvac_agg_read;
+    read->key = key;
+    read->expired = false;
+    read->size = in.input_val > 0 ? in.input_val : 0;
+    read->buffer = malloc(read->size ? read->size : 1);
+    read->up_bulk = HG_BULK_NULL;
+    read->down_bulk = HG_BULK_NULL;
+    read->waiters.push_back(make_pair(handle, in));
+    agg_reads[key] = read;
+    pthread_mutex_unlock(&agg_mutex);
+
+    hg_handle_t up;
+    if (read->buffer == NULL || read->size == 0 || !hvac_agg_create(in.server, agg_read_id, &up))
+    {
+        hvac_agg_read_finish(read, -1, 0);
+        return HG_SUCCESS;
+    }
+    if (HG_Bulk_create(HG_Get_info(up)->hg_class, 1, &read->buffer, &read->size, HG_BULK_WRITE_ONLY,
+                       &read->up_bulk) != HG_SUCCESS)
+    {
+        read->up_bulk = HG_BULK_NULL;
+        HG_Destroy(up);
+        hvac_agg_read_finish(read, -1, 0);
+        return HG_SUCCESS;
+    }
+    hvac_rpc_in_t up_in = in;
+    up_in.bulk_handle = read->up_bulk;
+    if (hvac_agg_forward(up, hvac_agg_read_cb, read, &up_in, true, read) != HG_SUCCESS)
+    {
+        HG_Destroy(up);
+        hvac_agg_read_finish(read, -1, 0);
+    }
+    return HG_SUCCESS;
+}
+
+/* Answered here, the server connections are ours to keep warm */
+static hg_return_t
+hvac_agg_ping_handler(hg_handle_t handle)
+{
+    int ret = HG_Respond(handle, NULL, NULL, NULL);
+    HG_Destroy(handle);
+    return (hg_return_t)ret;
+}
+
+static void hvac_agg_register()
+{
+    MERCURY_REGISTER(agg_class, "hvac_open_rpc", hvac_open_in_t, hvac_open_out_t, hvac_agg_open_handler);
+    MERCURY_REGISTER(agg_class, "hvac_base_rpc", hvac_rpc_in_t, hvac_rpc_out_t, hvac_agg_read_handler);
+    hg_id_t close_id = MERCURY_REGISTER(agg_class, "hvac_close_rpc", hvac_close_in_t, void, hvac_agg_close_handler);
+    int ret = HG_Registered_disable_response(agg_class, close_id, HG_TRUE);
+    assert(ret == HG_SUCCESS);
+    MERCURY_REGISTER(agg_class, "hvac_ping_rpc", void, void, hvac_agg_ping_handler);
+}
+
+/* Where our address is posted, removed when we are stopped */
+static char agg_filename[PATH_MAX];
+static volatile sig_atomic_t agg_done = 0;
+
+static void hvac_agg_stop(int sig)
+{
+    agg_done = 1;
+}
+
+/* Written aside and renamed, clients never see a partial address */
+static void hvac_agg_publish()
+{
+    char addr[PATH_MAX];
+    hg_size_t addr_size = sizeof(addr);
+    hg_addr_t self;
+    char *filename = agg_filename;
+    char tmpname[PATH_MAX];
+    const char *jobid = getenv("SLURM_JOBID");
+
+    HG_Addr_self(agg_class, &self);
+    HG_Addr_to_string(agg_class, addr, &addr_size, self);
+    HG_Addr_free(agg_class, self);
+
+    snprintf(filename, sizeof(agg_filename), HVAC_AGGREGATOR_FILE, jobid ? jobid : "0");
+    snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, (int)getpid());
+    FILE *file = fopen(tmpname, "w");
+    if (file == NULL)
+    {
+        L4C_FATAL("Could not write %s\n", tmpname);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(file, "%s\n%016lx %d\n", addr, (unsigned long)hvac_bootstrap_run(), (int)getpid());
+    fclose(file);
+    if (rename(tmpname, filename) != 0)
+    {
+        L4C_FATAL("Could not publish %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    L4C_INFO("Aggregator listening on %s\n", addr);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t progress_tid;
+    const char *timeout_env = getenv("HVAC_RPC_TIMEOUT_MS");
+    if (timeout_env)
+        agg_timeout_ns = strtoull(timeout_env, NULL, 10) * 1000000ULL;
+
+    hvac_init_logging();
+    L4C_INFO("Aggregator starting up");
+
+    /* Upstream, the same classes and address table a client uses. Read
+     * the table file ourselves, we may be killed rather than stopped and would
+     * never let go of the node's copy. */
+    setenv("HVAC_BOOTSTRAP_SHM", "0", 1);
+    hvac_init_comm(false);
+    hvac_client_comm_register_rpc();
+    hvac_client_comm_ping_all();
+    hvac_client_comm_ids(&agg_open_id, &agg_read_id, &agg_close_id);
+
+    agg_class = HG_Init("na+sm", HG_TRUE);
+    if (agg_class == NULL)
+    {
+        L4C_FATAL("Failed to initialize na+sm for the local ranks\n");
+        exit(EXIT_FAILURE);
+    }
+    agg_context = HG_Context_create(agg_class);
+    if (agg_context == NULL)
+    {
+        L4C_FATAL("Failed to create the na+sm context\n");
+        exit(EXIT_FAILURE);
+    }
+    hvac_agg_register();
+    if (pthread_create(&progress_tid, NULL, hvac_progress_fn, agg_context) != 0)
+    {
+        L4C_FATAL("Failed to start the na+sm progress thread\n");
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = hvac_agg_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    hvac_agg_publish();
+
+    uint64_t reported = 0;
+    for (unsigned tick = 1; !agg_done; tick++)
+    {
+        sleep(1);
+        hvac_agg_sweep();
+        uint64_t reads = agg_read_count.load();
+        if (tick % HVAC_AGG_REPORT_S == 0 && reads != reported)
+        {
+            L4C_INFO("Aggregator relayed %lu reads, %lu joined one in flight\n",
+                     (unsigned long)reads, (unsigned long)agg_read_joined.load());
+            reported = reads;
+        }
+    }
+    /* Ranks started after us connect to the servers directly */
+    unlink(agg_filename);
+    L4C_INFO("Aggregator stopped\n");
+    return 0;
+}
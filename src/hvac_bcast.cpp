@@ -0,0 +1,321 @@
+/* Node-local sharing of broadcast files, see hvac_bcast.h */
+#include <string>
+#include <atomic>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "hvac_logging.h"
+#include "hvac_comm.h"
+#include "hvac_bootstrap.h"
+#include "hvac_bcast.h"
+
+extern __thread bool tl_disable_redirect;
+
+/* The segment starts with this page, the file follows it. All fields are
+ * shared between processes and only accessed through __atomic builtins. */
+#define HVAC_BCAST_HDR 4096
+#define HVAC_BCAST_INIT 0
+#define HVAC_BCAST_LOADING 1
+#define HVAC_BCAST_READY 2
+#define HVAC_BCAST_FAILED 3
+
+struct hvac_bcast_hdr {
+    uint32_t state;
+    int32_t users;
+    int64_t size;
+    int64_t filled;
+    pid_t leader;
+    /* What the leader is loading, a hash collision is not served */
+    char path[HVAC_BCAST_HDR - 32];
+};
+static_assert(sizeof(struct hvac_bcast_hdr) <= HVAC_BCAST_HDR, "header outgrew its page");
+
+/* One per attach, the fill thread holds a reference on the leader's */
+struct hvac_bcast {
+    std::string name;
+    std::string path;
+    uint32_t home;
+    int64_t size;
+    struct hvac_bcast_hdr *hdr;
+    char *data;
+    std::atomic<int> refs;
+    std::atomic<bool> failed;
+};
+
+static pthread_once_t bcast_once = PTHREAD_ONCE_INIT;
+static bool bcast_enabled = true;
+static int64_t bcast_max = 4096LL << 20;
+static uint64_t bcast_timeout_us = 30000000;
+
+static void hvac_bcast_config()
+{
+    const char *env = getenv("HVAC_BCAST");
+    if (env != NULL && atoi(env) == 0)
+        bcast_enabled = false;
+    env = getenv("HVAC_BCAST_MAX_MB");
+    if (env != NULL)
+        bcast_max = atoll(env) << 20;
+    env = getenv("HVAC_BCAST_TIMEOUT");
+    if (env != NULL)
+        bcast_timeout_us = (uint64_t)atoi(env) * 1000000;
+}
+
+static uint64_t hvac_bcast_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void hvac_bcast_release(struct hvac_bcast *bcast)
+{
+    if (--bcast->refs > 0)
+        return;
+    munmap(bcast->hdr, HVAC_BCAST_HDR + bcast->size);
+    delete bcast;
+}
+
+/* Leader side, reads the file into the segment through the node's server */
+static bool hvac_bcast_fill_from(struct hvac_bcast *bcast, uint32_t server)
+{
+    int64_t remote_fd = -1;
+    int64_t file_size = -1;
+    bool ok = true;
+
+    hvac_client_comm_gen_open_rpc(server, bcast->path, &remote_fd, &file_size);
+    hvac_client_block();
+    if (remote_fd < 0)
+        return false;
+
+    for (int64_t offset = __atomic_load_n(&bcast->hdr->filled, __ATOMIC_RELAXED); offset < bcast->size; )
+    {
+        int64_t count = bcast->size - offset;
+        if (count > HVAC_BCAST_CHUNK)
+            count = HVAC_BCAST_CHUNK;
+        hvac_client_comm_gen_read_rpc(server, remote_fd, bcast->data + offset, count, offset);
+        ssize_t ret = hvac_read_block();
+        if (ret <= 0)
+        {
+            ok = false;
+            break;
+        }
+        offset += ret;
+        __atomic_store_n(&bcast->hdr->filled, offset, __ATOMIC_RELEASE);
+    }
+    hvac_client_comm_gen_close_rpc(server, remote_fd);
+    return ok;
+}
+
+static void *hvac_bcast_fill_fn(void *args)
+{
+    struct hvac_bcast *bcast = (struct hvac_bcast *)args;
+    tl_disable_redirect = true;
+
+    int server = hvac_client_comm_node_server();
+    bool ok = server >= 0 && hvac_bcast_fill_from(bcast, server);
+    /* The home server continues where the node server stopped */
+    if (!ok && (uint32_t)server != bcast->home)
+        ok = hvac_bcast_fill_from(bcast, bcast->home);
+
+    if (ok)
+    {
+        L4C_INFO("Shared %s on this node", bcast->path.c_str());
+        __atomic_store_n(&bcast->hdr->state, HVAC_BCAST_READY, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        /* Readers fall back, the next open on this node tries again */
+        L4C_INFO("Could not share %s on this node", bcast->path.c_str());
+        __atomic_store_n(&bcast->hdr->state, HVAC_BCAST_FAILED, __ATOMIC_RELEASE);
+        shm_unlink(bcast->name.c_str());
+    }
+    hvac_bcast_detach(bcast);
+    return NULL;
+}
+
+/* Leader side, followers waiting on the segment see it failed before it goes */
+static void hvac_bcast_abandon(int fd, const char *name)
+{
+    uint32_t state = HVAC_BCAST_FAILED;
+    pwrite(fd, &state, sizeof(state), offsetof(struct hvac_bcast_hdr, state));
+    close(fd);
+    shm_unlink(name);
+}
+
+struct hvac_bcast *hvac_bcast_attach(const std::string &path, int64_t size, uint32_t home)
+{
+    char name[NAME_MAX];
+    const char *jobid = getenv("SLURM_JOBID");
+    struct stat st;
+    bool leader = true;
+
+    pthread_once(&bcast_once, hvac_bcast_config);
+    if (!bcast_enabled || size <= 0 || size > bcast_max)
+        return NULL;
+    if (path.size() >= sizeof(((struct hvac_bcast_hdr *)0)->path))
+        return NULL;
+
+    /* Scoped by the run, a segment left by an earlier run is never found */
+    snprintf(name, sizeof(name), "/hvac_bc.%s.%016lx.%016zx", jobid ? jobid : "0",
+             (unsigned long)hvac_bootstrap_run(), std::hash<std::string>{}(path));
+    size_t len = HVAC_BCAST_HDR + size;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        leader = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+        return NULL;
+
+    uint64_t deadline = hvac_bcast_now() + bcast_timeout_us;
+    if (leader)
+    {
+        /* Reserve all of it now, a full /dev/shm would otherwise SIGBUS the readers */
+        if (ftruncate(fd, len) != 0 || posix_fallocate(fd, 0, len) != 0)
+        {
+            hvac_bcast_abandon(fd, name);
+            return NULL;
+        }
+    }
+    else
+    {
+        /* The leader may still be sizing it, or have given up on it */
+        while (fstat(fd, &st) == 0 && st.st_size == 0 && st.st_nlink > 0 && hvac_bcast_now() < deadline)
+            usleep(1000);
+        if (st.st_size != (off_t)len)
+        {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        if (leader)
+            hvac_bcast_abandon(fd, name);
+        else
+            close(fd);
+        return NULL;
+    }
+    struct hvac_bcast_hdr *hdr = (struct hvac_bcast_hdr *)map;
+
+    if (leader)
+    {
+        hdr->size = size;
+        memcpy(hdr->path, path.c_str(), path.size() + 1);
+        __atomic_store_n(&hdr->leader, getpid(), __ATOMIC_RELAXED);
+        __atomic_store_n(&hdr->state, HVAC_BCAST_LOADING, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        /* Path and size are only valid once the leader moved past INIT */
+        uint32_t state;
+        while ((state = __atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE)) == HVAC_BCAST_INIT &&
+               fstat(fd, &st) == 0 && st.st_nlink > 0 && hvac_bcast_now() < deadline)
+            usleep(1000);
+        if (state == HVAC_BCAST_INIT || state == HVAC_BCAST_FAILED ||
+            hdr->size != size || strcmp(hdr->path, path.c_str()) != 0)
+        {
+            close(fd);
+            munmap(map, len);
+            return NULL;
+        }
+    }
+    close(fd);
+
+    struct hvac_bcast *bcast = new hvac_bcast;
+    bcast->name = name;
+    bcast->path = path;
+    bcast->home = home;
+    bcast->size = size;
+    bcast->hdr = hdr;
+    bcast->data = (char *)map + HVAC_BCAST_HDR;
+    bcast->refs.store(1);
+    bcast->failed.store(false);
+    __atomic_add_fetch(&bcast->hdr->users, 1, __ATOMIC_ACQ_REL);
+
+    if (leader)
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+        bcast->refs++;
+        __atomic_add_fetch(&bcast->hdr->users, 1, __ATOMIC_ACQ_REL);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, hvac_bcast_fill_fn, bcast) != 0)
+        {
+            __atomic_store_n(&bcast->hdr->state, HVAC_BCAST_FAILED, __ATOMIC_RELEASE);
+            shm_unlink(name);
+            hvac_bcast_detach(bcast);
+        }
+        pthread_attr_destroy(&attr);
+        L4C_INFO("Node leader for %s", path.c_str());
+    }
+    return bcast;
+}
+
+ssize_t hvac_bcast_read(struct hvac_bcast *bcast, void *buf, size_t count, off_t offset)
+{
+    if (bcast == NULL || bcast->failed.load(std::memory_order_relaxed) || offset < 0)
+        return -1;
+    if (offset >= bcast->size)
+        return 0;
+    int64_t end = offset + (int64_t)count;
+    if (end > bcast->size)
+        end = bcast->size;
+
+    uint64_t deadline = 0;
+    useconds_t backoff = 50;
+    while (__atomic_load_n(&bcast->hdr->filled, __ATOMIC_ACQUIRE) < end)
+    {
+        uint32_t state = __atomic_load_n(&bcast->hdr->state, __ATOMIC_ACQUIRE);
+        pid_t leader = __atomic_load_n(&bcast->hdr->leader, __ATOMIC_RELAXED);
+        uint64_t now = hvac_bcast_now();
+        if (deadline == 0)
+            deadline = now + bcast_timeout_us;
+        bool dead = state == HVAC_BCAST_LOADING && leader > 0 && kill(leader, 0) != 0 && errno == ESRCH;
+        if (state == HVAC_BCAST_FAILED || dead || now >= deadline)
+        {
+            L4C_INFO("Node copy of %s unavailable, reading remotely", bcast->path.c_str());
+            bcast->failed.store(true, std::memory_order_relaxed);
+            /* Let the next open elect a new leader */
+            if (dead)
+                shm_unlink(bcast->name.c_str());
+            return -1;
+        }
+        usleep(backoff);
+        if (backoff < 10000)
+            backoff *= 2;
+    }
+    memcpy(buf, bcast->data + offset, end - offset);
+    return end - offset;
+}
+
+void hvac_bcast_detach(struct hvac_bcast *bcast)
+{
+    if (bcast == NULL)
+        return;
+    /* Last user on the node */
+    if (__atomic_sub_fetch(&bcast->hdr->users, 1, __ATOMIC_ACQ_REL) == 0)
+        shm_unlink(bcast->name.c_str());
+    hvac_bcast_release(bcast);
+}
+
+void hvac_bcast_inherit(struct hvac_bcast *bcast)
+{
+    if (bcast != NULL)
+        __atomic_add_fetch(&bcast->hdr->users, 1, __ATOMIC_ACQ_REL);
+}
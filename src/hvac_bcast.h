@@ -0,0 +1,41 @@
+#ifndef __HVAC_BCAST_H__
+#define __HVAC_BCAST_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+
+/* Node-local sharing of broadcast files, client side
+ *
+ * Open responses flag files that many ranks read whole at once, see
+ * hvac_replica.h. The first process on a node to open such a file becomes
+ * the node leader. It creates the shared memory segment
+ * /hvac_bc.<jobid>.<run>.<hash> sized for the whole file, run being the id
+ * of the address table, and records the path in its header. A background thread
+ * fills it from the server on this node (any server if none runs here),
+ * HVAC_BCAST_CHUNK bytes per read RPC. The other processes on the node map
+ * the segment and copy from it as soon as the range they ask for is filled,
+ * so the servers see one reader per node instead of one per rank.
+ *
+ * A follower that waits longer than HVAC_BCAST_TIMEOUT seconds, finds the
+ * leader gone or failed, or finds another path in the header, reads
+ * through the servers as usual.
+ *
+ * Environment
+ *   HVAC_BCAST              0 turns node sharing off
+ *   HVAC_BCAST_MAX_MB       larger files are not shared (4096)
+ *   HVAC_BCAST_TIMEOUT      seconds a reader waits for its range (30)
+ */
+#define HVAC_BCAST_CHUNK (4 << 20)
+
+struct hvac_bcast;
+
+/* NULL if the file is not shared on this node */
+struct hvac_bcast *hvac_bcast_attach(const std::string &path, int64_t size, uint32_t home);
+/* Bytes copied, -1 to read through the servers instead */
+ssize_t hvac_bcast_read(struct hvac_bcast *bcast, void *buf, size_t count, off_t offset);
+void hvac_bcast_detach(struct hvac_bcast *bcast);
+/* A forked child holds the mappings as well */
+void hvac_bcast_inherit(struct hvac_bcast *bcast);
+
+#endif
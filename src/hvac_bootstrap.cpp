@@ -0,0 +1,442 @@
+/* Address table publishing (server rank 0) and loading (clients).
+ * See hvac_bootstrap.h for the protocol.
+ */
+#include <string>
+#include <vector>
+#include <map>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hvac_logging.h"
+#include "hvac_bootstrap.h"
+
+using namespace std;
+
+extern __thread bool tl_disable_redirect;
+
+#define HVAC_BOOTSTRAP_POLL_US 100000
+
+/* Header of the node shared copy, the table follows it. The table file it
+ * was read from is named by inode and mtime. */
+struct hvac_addr_shm_hdr {
+    uint32_t state;     /* HVAC_ADDR_SHM_* */
+    uint32_t size;      /* bytes of table */
+    uint32_t users;     /* clients that loaded from it and have not exited */
+    int32_t leader;     /* pid of the client loading it */
+    uint64_t run_id;
+    uint64_t tbl_ino;
+    int64_t tbl_mtime_ns;
+};
+#define HVAC_ADDR_SHM_LOADING 0
+#define HVAC_ADDR_SHM_READY 1
+#define HVAC_ADDR_SHM_FAILED 2
+
+/* The segment this process counts itself in, kept mapped until exit */
+static hvac_addr_shm_hdr *addr_shm = NULL;
+static size_t addr_shm_size = 0;
+static ino_t addr_shm_ino = 0;
+static pid_t addr_shm_pid = 0;
+/* Run the loaded table belongs to, names the node block cache */
+static uint64_t addr_run_id = 0;
+
+static string hvac_bootstrap_name(const char *prefix)
+{
+    const char *jobid = getenv("SLURM_JOBID");
+    return string(prefix) + (jobid ? jobid : "0");
+}
+
+static int64_t hvac_bootstrap_mtime(const struct stat &st)
+{
+    return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+/* Not a value a table of another run is likely to carry */
+static uint64_t hvac_bootstrap_run_id()
+{
+    struct timespec ts;
+    uint64_t id = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1 || read(fd, &id, sizeof(id)) != sizeof(id))
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        id = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)getpid() << 32);
+    }
+    if (fd != -1)
+        close(fd);
+    return id;
+}
+
+bool hvac_bootstrap_parse_line(const char *line, struct hvac_addr_entry *entry)
+{
+    char addr[PATH_MAX], sm_addr[PATH_MAX], host[PATH_MAX];
+    int rank;
+    int n = sscanf(line, "%d %s %s %s", &rank, addr, sm_addr, host);
+    if (n < 2 || strlen(addr) >= HVAC_ADDR_LEN)
+        return false;
+
+    memset(entry, 0, sizeof(*entry));
+    entry->rank = rank;
+    strcpy(entry->addr, addr);
+    strcpy(entry->sm_addr, "-");
+    if (n == 4 && strlen(sm_addr) < HVAC_ADDR_LEN && strlen(host) < HVAC_ADDR_HOST_LEN)
+    {
+        strcpy(entry->sm_addr, sm_addr);
+        strcpy(entry->host, host);
+    }
+    return true;
+}
+
+/* Table bytes are checked against their own header */
+static bool hvac_bootstrap_valid(const char *buf, size_t size)
+{
+    const hvac_addr_table_hdr *hdr = (const hvac_addr_table_hdr *)buf;
+    if (size < sizeof(*hdr) || memcmp(hdr->magic, HVAC_ADDR_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != HVAC_ADDR_VERSION)
+        return false;
+    return size == sizeof(*hdr) + (size_t)hdr->count * sizeof(hvac_addr_entry);
+}
+
+static void *hvac_bootstrap_publish_fn(void *args)
+{
+    uint32_t server_count = (uint32_t)(uintptr_t)args;
+    string cfg = hvac_bootstrap_name("./.ports.cfg.");
+    string tbl = hvac_bootstrap_name("./.ports.tbl.");
+    string tmp = tbl + ".tmp." + to_string(getpid());
+    map<int, hvac_addr_entry> entries;
+    char line[3 * PATH_MAX];
+
+    tl_disable_redirect = true;
+    /* An earlier run's table must not be loaded while we wait for ours */
+    unlink(tbl.c_str());
+    while (entries.size() < server_count)
+    {
+        usleep(HVAC_BOOTSTRAP_POLL_US);
+        FILE *fp = fopen(cfg.c_str(), "r");
+        if (fp == NULL)
+            continue;
+        while (fgets(line, sizeof(line), fp))
+        {
+            hvac_addr_entry entry;
+            /* A line still being appended has no newline yet */
+            if (strchr(line, '\n') && hvac_bootstrap_parse_line(line, &entry))
+                entries[entry.rank] = entry;
+        }
+        fclose(fp);
+    }
+
+    hvac_addr_table_hdr hdr;
+    memcpy(hdr.magic, HVAC_ADDR_MAGIC, sizeof(hdr.magic));
+    hdr.version = HVAC_ADDR_VERSION;
+    hdr.count = entries.size();
+    hdr.run_id = hvac_bootstrap_run_id();
+    string buf((const char *)&hdr, sizeof(hdr));
+    for (auto &it : entries)
+        buf.append((const char *)&it.second, sizeof(it.second));
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write(fd, buf.data(), buf.size()) != (ssize_t)buf.size() || fsync(fd) != 0)
+    {
+        L4C_ERR("Could not write address table %s: %s", tmp.c_str(), strerror(errno));
+        if (fd != -1)
+            close(fd);
+        unlink(tmp.c_str());
+        return NULL;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), tbl.c_str()) != 0)
+    {
+        L4C_ERR("Could not publish address table %s: %s", tbl.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return NULL;
+    }
+    L4C_INFO("Published %u server addresses to %s, run %016lx", hdr.count, tbl.c_str(),
+             (unsigned long)hdr.run_id);
+    return NULL;
+}
+
+void hvac_bootstrap_unpublish()
+{
+    unlink(hvac_bootstrap_name("./.ports.tbl.").c_str());
+    unlink(hvac_bootstrap_name("./.ports.cfg.").c_str());
+}
+
+void hvac_bootstrap_publish(uint32_t server_count)
+{
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, hvac_bootstrap_publish_fn, (void *)(uintptr_t)server_count) != 0)
+    {
+        L4C_ERR("Failed to start the address table publisher");
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static bool hvac_bootstrap_expired(const struct timespec &deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline.tv_sec ||
+           (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+/* One open and one read of the whole table once it has been renamed in,
+ * st describes the file it came from */
+static bool hvac_bootstrap_read_file(string &buf, const struct timespec &deadline, struct stat &st)
+{
+    string tbl = hvac_bootstrap_name("./.ports.tbl.");
+    int fd;
+
+    while ((fd = open(tbl.c_str(), O_RDONLY)) == -1)
+    {
+        if (hvac_bootstrap_expired(deadline))
+        {
+            L4C_ERR("Address table %s did not appear", tbl.c_str());
+            return false;
+        }
+        usleep(HVAC_BOOTSTRAP_POLL_US);
+    }
+
+    bool ok = fstat(fd, &st) == 0;
+    if (ok)
+    {
+        buf.resize(st.st_size);
+        ok = read(fd, &buf[0], buf.size()) == (ssize_t)buf.size() &&
+             hvac_bootstrap_valid(buf.data(), buf.size());
+    }
+    close(fd);
+    if (!ok)
+        L4C_ERR("Address table %s is not valid", tbl.c_str());
+    return ok;
+}
+
+/* Unlinks name if it still is the segment with inode ino */
+static void hvac_bootstrap_unlink_shm(const string &name, ino_t ino)
+{
+    struct stat st;
+    int fd = shm_open(name.c_str(), O_RDONLY, 0600);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == 0 && st.st_ino == ino)
+        shm_unlink(name.c_str());
+    close(fd);
+}
+
+static void hvac_bootstrap_hold(hvac_addr_shm_hdr *shm, size_t size, ino_t ino)
+{
+    addr_shm = shm;
+    addr_shm_size = size;
+    addr_shm_ino = ino;
+    addr_shm_pid = getpid();
+}
+
+#define HVAC_ADDR_SHM_STALE 3
+
+/* The first client on the node publishes what it read, the rest wait for
+ * it. The leader sizes the header and stores its pid before it reads the
+ * file, a follower that finds the leader gone treats the segment as stale.
+ * Returns an HVAC_ADDR_SHM_* state, READY if buf holds the table. */
+static uint32_t hvac_bootstrap_read_shm_once(const string &name, string &buf, const struct timespec &deadline)
+{
+    hvac_addr_shm_hdr *shm;
+    struct stat st;
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != -1)
+    {
+        if (fstat(fd, &st) != 0 || ftruncate(fd, sizeof(*shm)) != 0 ||
+            (shm = (hvac_addr_shm_hdr *)mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        {
+            /* Followers find it gone or empty and read the file themselves */
+            close(fd);
+            shm_unlink(name.c_str());
+            return HVAC_ADDR_SHM_FAILED;
+        }
+        shm->leader = getpid();
+        shm->users = 1;
+
+        struct stat tbl_st;
+        bool loaded = hvac_bootstrap_read_file(buf, deadline, tbl_st);
+        /* The table goes in behind the header, the state publishes it */
+        bool ok = loaded && ftruncate(fd, sizeof(*shm) + buf.size()) == 0 &&
+             pwrite(fd, buf.data(), buf.size(), sizeof(*shm)) == (ssize_t)buf.size();
+        close(fd);
+        if (ok)
+        {
+            shm->size = buf.size();
+            shm->run_id = ((const hvac_addr_table_hdr *)buf.data())->run_id;
+            shm->tbl_ino = tbl_st.st_ino;
+            shm->tbl_mtime_ns = hvac_bootstrap_mtime(tbl_st);
+        }
+        __atomic_store_n(&shm->state, ok ? HVAC_ADDR_SHM_READY : HVAC_ADDR_SHM_FAILED, __ATOMIC_RELEASE);
+        if (!ok)
+        {
+            /* The next client tries again */
+            shm_unlink(name.c_str());
+            munmap(shm, sizeof(*shm));
+            return loaded ? HVAC_ADDR_SHM_READY : HVAC_ADDR_SHM_FAILED;
+        }
+        hvac_bootstrap_hold(shm, sizeof(*shm), st.st_ino);
+        return HVAC_ADDR_SHM_READY;
+    }
+    if (errno != EEXIST || (fd = shm_open(name.c_str(), O_RDWR, 0600)) == -1)
+        return HVAC_ADDR_SHM_FAILED;
+    memset(&st, 0, sizeof(st));
+
+    /* The leader sizes the header right after creating it, a segment that
+     * stays empty lost its leader before that */
+    struct timespec sized;
+    clock_gettime(CLOCK_MONOTONIC, &sized);
+    sized.tv_sec += 1;
+    while (fstat(fd, &st) == 0 && st.st_size == 0 && !hvac_bootstrap_expired(sized))
+        usleep(HVAC_BOOTSTRAP_POLL_US / 10);
+    if (st.st_size == 0 && st.st_ino != 0)
+    {
+        close(fd);
+        L4C_ERR("Address segment %s was left empty, removing it", name.c_str());
+        hvac_bootstrap_unlink_shm(name, st.st_ino);
+        return HVAC_ADDR_SHM_STALE;
+    }
+    if (st.st_size < (off_t)sizeof(*shm) ||
+        (shm = (hvac_addr_shm_hdr *)mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return HVAC_ADDR_SHM_FAILED;
+    }
+
+    uint32_t state;
+    while ((state = __atomic_load_n(&shm->state, __ATOMIC_ACQUIRE)) == HVAC_ADDR_SHM_LOADING &&
+           !hvac_bootstrap_expired(deadline))
+    {
+        /* A leader that died mid-load never finishes */
+        if (shm->leader > 0 && kill(shm->leader, 0) != 0 && errno == ESRCH)
+        {
+            L4C_ERR("Address segment %s lost its leader %d, removing it", name.c_str(), (int)shm->leader);
+            munmap(shm, sizeof(*shm));
+            close(fd);
+            hvac_bootstrap_unlink_shm(name, st.st_ino);
+            return HVAC_ADDR_SHM_STALE;
+        }
+        usleep(HVAC_BOOTSTRAP_POLL_US / 10);
+    }
+    munmap(shm, sizeof(*shm));
+
+    /* Ready, the table is in place behind the header now */
+    if (state != HVAC_ADDR_SHM_READY || fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*shm) ||
+        (shm = (hvac_addr_shm_hdr *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return HVAC_ADDR_SHM_FAILED;
+    }
+    close(fd);
+
+    bool ok = sizeof(*shm) + shm->size <= (size_t)st.st_size &&
+              hvac_bootstrap_valid((const char *)(shm + 1), shm->size) &&
+              ((const hvac_addr_table_hdr *)(shm + 1))->run_id == shm->run_id;
+
+    /* Only trusted while it is a copy of the table published now */
+    struct stat tbl_st;
+    if (ok && (stat(hvac_bootstrap_name("./.ports.tbl.").c_str(), &tbl_st) != 0 ||
+               (uint64_t)tbl_st.st_ino != shm->tbl_ino || hvac_bootstrap_mtime(tbl_st) != shm->tbl_mtime_ns))
+    {
+        L4C_ERR("Address segment %s holds run %016lx, not the published table", name.c_str(),
+                (unsigned long)shm->run_id);
+        munmap(shm, st.st_size);
+        hvac_bootstrap_unlink_shm(name, st.st_ino);
+        return HVAC_ADDR_SHM_STALE;
+    }
+    if (!ok)
+    {
+        munmap(shm, st.st_size);
+        return HVAC_ADDR_SHM_FAILED;
+    }
+    buf.assign((const char *)(shm + 1), shm->size);
+    __atomic_add_fetch(&shm->users, 1, __ATOMIC_ACQ_REL);
+    hvac_bootstrap_hold(shm, st.st_size, st.st_ino);
+    return HVAC_ADDR_SHM_READY;
+}
+
+static bool hvac_bootstrap_read_shm(string &buf, const struct timespec &deadline)
+{
+    string name = hvac_bootstrap_name("/hvac_addr.");
+    uint32_t state = hvac_bootstrap_read_shm_once(name, buf, deadline);
+    /* A stale segment is gone now, one of us loads the table again */
+    if (state == HVAC_ADDR_SHM_STALE)
+        state = hvac_bootstrap_read_shm_once(name, buf, deadline);
+    return state == HVAC_ADDR_SHM_READY;
+}
+
+uint64_t hvac_bootstrap_run()
+{
+    return addr_run_id;
+}
+
+uint64_t hvac_bootstrap_peek_run()
+{
+    hvac_addr_table_hdr hdr;
+    bool saved = tl_disable_redirect;
+    tl_disable_redirect = true;
+    int fd = open(hvac_bootstrap_name("./.ports.tbl.").c_str(), O_RDONLY);
+    bool ok = fd != -1 && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+              memcmp(hdr.magic, HVAC_ADDR_MAGIC, sizeof(hdr.magic)) == 0 && hdr.version == HVAC_ADDR_VERSION;
+    if (fd != -1)
+        close(fd);
+    tl_disable_redirect = saved;
+    return ok ? hdr.run_id : 0;
+}
+
+void hvac_bootstrap_detach()
+{
+    /* A fork child's copy of the mapping was counted by its parent */
+    if (addr_shm == NULL || addr_shm_pid != getpid())
+        return;
+    if (__atomic_sub_fetch(&addr_shm->users, 1, __ATOMIC_ACQ_REL) == 0)
+        hvac_bootstrap_unlink_shm(hvac_bootstrap_name("/hvac_addr."), addr_shm_ino);
+    munmap(addr_shm, addr_shm_size);
+    addr_shm = NULL;
+}
+
+int hvac_bootstrap_load(vector<struct hvac_addr_entry> &entries)
+{
+    const char *timeout_env = getenv("HVAC_BOOTSTRAP_TIMEOUT");
+    const char *shm_env = getenv("HVAC_BOOTSTRAP_SHM");
+    struct timespec deadline;
+    string buf;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_env ? atoi(timeout_env) : 30;
+
+    /* Inherited over fork, the parent holds that count */
+    if (addr_shm != NULL && addr_shm_pid != getpid())
+    {
+        munmap(addr_shm, addr_shm_size);
+        addr_shm = NULL;
+    }
+
+    /* Our own file accesses must not go through the wrappers */
+    bool saved = tl_disable_redirect;
+    tl_disable_redirect = true;
+    bool ok = addr_shm == NULL && !(shm_env && strcmp(shm_env, "0") == 0) && hvac_bootstrap_read_shm(buf, deadline);
+    struct stat st;
+    if (!ok)
+        ok = hvac_bootstrap_read_file(buf, deadline, st);
+    tl_disable_redirect = saved;
+    if (!ok)
+        return -1;
+
+    const hvac_addr_table_hdr *hdr = (const hvac_addr_table_hdr *)buf.data();
+    const hvac_addr_entry *first = (const hvac_addr_entry *)(hdr + 1);
+    entries.assign(first, first + hdr->count);
+    addr_run_id = hdr->run_id;
+    return 0;
+}
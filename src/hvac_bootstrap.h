@@ -0,0 +1,73 @@
+#ifndef __HVAC_BOOTSTRAP_H__
+#define __HVAC_BOOTSTRAP_H__
+
+#include <stdint.h>
+#include <vector>
+
+/* Server address table
+ *
+ * Every server appends "rank addr sm_addr host" to ./.ports.cfg.<jobid>.
+ * Once all of them are listed, server rank 0 writes the same information
+ * as one binary table to a temporary file and renames it to
+ * ./.ports.tbl.<jobid>. The rename is the readiness marker, a table that
+ * exists is complete.
+ *
+ * Clients load the table once. The first client on a node becomes the
+ * node leader, it reads the file with a single read and copies it into the
+ * shared memory segment /hvac_addr.<jobid>. The other clients on the node
+ * copy it from there and only stat the file. The segment records the
+ * leader's pid, one whose leader died before it was loaded is removed and
+ * the next client takes over.
+ *
+ * Rank 0 stamps the table with a random run id, removes any table left
+ * over before publishing its own and removes both files when it is
+ * stopped. The segment records the run id and the identity of the file it
+ * was loaded from, a client that finds the file replaced (a segment left
+ * behind by an earlier run with the same jobid) reads the file itself. The
+ * last client on the node to exit unlinks the segment.
+ *
+ * Environment
+ *   HVAC_BOOTSTRAP_TIMEOUT  seconds clients wait for the table (30)
+ *   HVAC_BOOTSTRAP_SHM      0 makes every client read the file itself
+ */
+#define HVAC_ADDR_MAGIC "HVACADR1"
+#define HVAC_ADDR_VERSION 2
+#define HVAC_ADDR_LEN 256
+#define HVAC_ADDR_HOST_LEN 64
+
+struct hvac_addr_table_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t run_id;
+};
+
+/* sm_addr is "-" when the server has no na+sm class */
+struct hvac_addr_entry {
+    int32_t rank;
+    char addr[HVAC_ADDR_LEN];
+    char sm_addr[HVAC_ADDR_LEN];
+    char host[HVAC_ADDR_HOST_LEN];
+};
+
+/* Parses one .ports.cfg line, older "rank addr" lines get sm_addr "-" */
+bool hvac_bootstrap_parse_line(const char *line, struct hvac_addr_entry *entry);
+
+/* Server rank 0, waits in the background for server_count servers */
+void hvac_bootstrap_publish(uint32_t server_count);
+
+/* Server rank 0 on shutdown, removes the posted addresses and the table */
+void hvac_bootstrap_unpublish();
+
+/* Client, 0 on success. Falls back to -1 after HVAC_BOOTSTRAP_TIMEOUT */
+int hvac_bootstrap_load(std::vector<struct hvac_addr_entry> &entries);
+
+/* Client, run id of the table loaded last, 0 before the first load */
+uint64_t hvac_bootstrap_run();
+/* Run id of the table published now without loading it, 0 if there is none */
+uint64_t hvac_bootstrap_peek_run();
+
+/* Client exit, drops our use of the node segment */
+void hvac_bootstrap_detach();
+
+#endif
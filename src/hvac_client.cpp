@@ -2,14 +2,27 @@
 
 
 #include <map>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
 #include <string>
 #include <filesystem>
 #include <iostream>
 #include <assert.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sched.h>
 
 #include "hvac_internal.h"
 #include "hvac_logging.h"
 #include "hvac_comm.h"
+#include "hvac_replica.h"
+#include "hvac_bcast.h"
+#include "hvac_shm_cache.h"
+#include "hvac_handoff.h"
+#include "hvac_telemetry.h"
+#include "hvac_bootstrap.h"
 
 
 #define HVAC_CLIENT 1
@@ -22,11 +35,526 @@ bool g_mercury_init=false;
 
 uint32_t g_hvac_server_count = 0;
 char *hvac_data_dir = NULL;
+/* HVAC_DATA_DIR resolved once at init, with a trailing '/' */
+std::string g_hvac_data_dir_canon;
+
+/* Directory classification cache. Keyed by the directory as the application
+ * spelled it (made absolute), holds the canonical directory and whether it is
+ * under HVAC_DATA_DIR. Every open after the first one in a directory costs a
+ * hash lookup instead of realpath walks on the PFS.
+ */
+struct hvac_dir_class {
+	std::string canon;
+	bool tracked;
+};
+#define HVAC_DIR_CACHE_MAX 65536
+std::unordered_map<std::string, hvac_dir_class> dir_class_cache;
+pthread_mutex_t dir_class_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Mercury is set up on its own thread from the constructor, tracked opens
+ * only wait for it if it has not finished yet. Both under init_mutex. */
+static pthread_cond_t mercury_init_cond = PTHREAD_COND_INITIALIZER;
+static bool g_mercury_init_started = false;
+
+/* hvac_client_stats.cpp */
+void hvac_cstat_init();
+void hvac_cstat_report();
+void hvac_cstat_atfork_child();
+extern __thread bool tl_cstat_open_fallback;
+
+/* Client descriptor table.
+ *
+ * A flat array indexed by the local fd holding a pointer to a compact record
+ * for every tracked file, nullptr otherwise. Readers do not take locks: they
+ * load the current table and the slot with acquire semantics, so an untracked
+ * read/lseek/close costs one array load. Writers (track/remove) serialize on
+ * fd_table_mutex and publish with release stores. Growing copies the slots
+ * into a larger table; old tables are never freed since a reader may still
+ * hold one, they add up to less than the live table.
+ *
+ * Records are reference counted, the table holds one and every operation
+ * holds one from hvac_fd_lookup to hvac_fd_release, so a read racing a close
+ * of the same fd keeps its record however long the read takes. A lookup
+ * that found a record takes its reference inside a fd_lookups window. A
+ * record that was unpublished drops the table's reference only once no
+ * lookup is inside the window, until then it waits on fd_unpublished.
+ */
+struct hvac_fd_entry;
+static void hvac_fd_local_unpin(hvac_fd_entry *entry);
+
+struct hvac_fd_entry {
+	std::string path;
+	int64_t remote_fd;
+	uint32_t server;
+	/* File position and size live on the client, the server only sees preads */
+	std::atomic<int64_t> offset;
+	std::atomic<int64_t> size;
+	/* Came over fork, remote_fd is the parent's reference until adopted */
+	std::atomic<bool> inherited;
+	/* Size of the replica set from the open RPC. Handles on replicas 1.. are
+	 * opened on first use, -1 not yet, -2 failed. remote_fd is replica 0. */
+	uint32_t replicas;
+	std::atomic<int64_t> replica_fd[HVAC_MAX_REPLICAS];
+	std::atomic<uint32_t> next_replica;
+	/* Node-local copy of a broadcast file, NULL if reads go to the servers */
+	struct hvac_bcast *bcast = nullptr;
+	/* Names the file's blocks in the node block cache */
+	struct hvac_shm_key shm_key;
+	/* The NVMe copy handed over by a server on this node, -1 if none.
+	 * local_handle is the handle it was handed out for while it is pinned,
+	 * close unpins it and the fd is closed with the last reference. */
+	int local_fd = -1;
+	std::atomic<int64_t> local_handle{-1};
+	std::atomic<int> refs{1};
+
+	~hvac_fd_entry()
+	{
+		hvac_bcast_detach(bcast);
+		hvac_fd_local_unpin(this);
+		if (local_fd >= 0)
+			close(local_fd);
+	}
+};
+
+/* Lets the server evict the NVMe copy again, once per record */
+static void hvac_fd_local_unpin(hvac_fd_entry *entry)
+{
+	int64_t handle = entry->local_handle.exchange(-1);
+	if (handle >= 0)
+		hvac_handoff_put(entry->server, handle);
+}
+
+struct hvac_fd_table {
+	size_t nslots;
+	std::atomic<hvac_fd_entry *> *slots;
+};
+
+#define HVAC_FD_TABLE_MIN 1024
+/* Spins an unpublish waits for lookups to leave their window */
+#define HVAC_FD_QUIESCE_SPINS 1024
+std::atomic<hvac_fd_table *> g_fd_table(nullptr);
+pthread_mutex_t fd_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<int> fd_lookups(0);
+/* Unpublished records still holding the table's reference, under fd_table_mutex */
+static std::vector<hvac_fd_entry *> fd_unpublished;
+
+/* Returns the record of fd with a reference the caller drops with
+ * hvac_fd_release, nullptr if fd is not tracked */
+static inline hvac_fd_entry *hvac_fd_lookup(int fd)
+{
+	if (fd < 0)
+		return nullptr;
+	hvac_fd_table *table = g_fd_table.load(std::memory_order_acquire);
+	if (table == nullptr || (size_t)fd >= table->nslots)
+		return nullptr;
+	/* Untracked fds stop at this load */
+	if (table->slots[fd].load(std::memory_order_acquire) == nullptr)
+		return nullptr;
+
+	fd_lookups.fetch_add(1, std::memory_order_seq_cst);
+	hvac_fd_entry *entry = table->slots[fd].load(std::memory_order_seq_cst);
+	if (entry != nullptr)
+		entry->refs.fetch_add(1, std::memory_order_relaxed);
+	fd_lookups.fetch_sub(1, std::memory_order_seq_cst);
+	return entry;
+}
+
+static inline void hvac_fd_release(hvac_fd_entry *entry)
+{
+	if (entry != nullptr && entry->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete entry;
+}
+
+/* Holds a reference on the record of fd for the length of an operation */
+struct hvac_fd_ref {
+	hvac_fd_entry *entry;
+
+	explicit hvac_fd_ref(int fd) : entry(hvac_fd_lookup(fd)) {}
+	~hvac_fd_ref() { hvac_fd_release(entry); }
+	hvac_fd_ref(const hvac_fd_ref &) = delete;
+	hvac_fd_ref &operator=(const hvac_fd_ref &) = delete;
+};
+
+/* Called with fd_table_mutex held */
+static hvac_fd_table *hvac_fd_table_reserve(int fd)
+{
+	hvac_fd_table *table = g_fd_table.load(std::memory_order_relaxed);
+	if (table != nullptr && (size_t)fd < table->nslots)
+		return table;
+
+	size_t nslots = table ? table->nslots * 2 : HVAC_FD_TABLE_MIN;
+	while (nslots <= (size_t)fd)
+		nslots *= 2;
+
+	hvac_fd_table *grown = new hvac_fd_table;
+	grown->nslots = nslots;
+	grown->slots = new std::atomic<hvac_fd_entry *>[nslots];
+	for (size_t i = 0; i < nslots; i++){
+		hvac_fd_entry *entry = (table && i < table->nslots) ?
+			table->slots[i].load(std::memory_order_relaxed) : nullptr;
+		grown->slots[i].store(entry, std::memory_order_relaxed);
+	}
+	g_fd_table.store(grown, std::memory_order_release);
+	return grown;
+}
+
+static void hvac_fd_publish(int fd, hvac_fd_entry *entry)
+{
+	pthread_mutex_lock(&fd_table_mutex);
+	hvac_fd_table *table = hvac_fd_table_reserve(fd);
+	table->slots[fd].store(entry, std::memory_order_release);
+	pthread_mutex_unlock(&fd_table_mutex);
+}
+
+/* Unpublishes the record of fd, false if there was none. The table's
+ * reference goes once no lookup can still be taking one. */
+static bool hvac_fd_unpublish(int fd)
+{
+	hvac_fd_entry *entry = nullptr;
+	std::vector<hvac_fd_entry *> quiesced;
+	pthread_mutex_lock(&fd_table_mutex);
+	hvac_fd_table *table = g_fd_table.load(std::memory_order_relaxed);
+	if (table != nullptr && fd >= 0 && (size_t)fd < table->nslots){
+		entry = table->slots[fd].exchange(nullptr, std::memory_order_seq_cst);
+	}
+	if (entry != nullptr)
+		fd_unpublished.push_back(entry);
+	/* The window is a few instructions, when it stays busy the next close
+	 * tries again */
+	for (int i = 0; i < HVAC_FD_QUIESCE_SPINS && fd_lookups.load(std::memory_order_seq_cst) != 0; i++)
+		sched_yield();
+	if (fd_lookups.load(std::memory_order_seq_cst) == 0)
+		quiesced.swap(fd_unpublished);
+	pthread_mutex_unlock(&fd_table_mutex);
+
+	for (hvac_fd_entry *it : quiesced)
+		hvac_fd_release(it);
+	return entry != nullptr;
+}
+
+/* Gives an inherited record a server reference of its own. The parent may
+ * close its fd at any time, which drops the reference the record was using. */
+static pthread_mutex_t fd_adopt_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void hvac_client_wait_mercury();
+
+static void hvac_fd_init_replicas(hvac_fd_entry *entry, uint32_t replicas)
+{
+	if (replicas > HVAC_MAX_REPLICAS)
+		replicas = HVAC_MAX_REPLICAS;
+	if (replicas > g_hvac_server_count)
+		replicas = g_hvac_server_count;
+	entry->replicas = replicas ? replicas : 1;
+	for (uint32_t i = 0; i < HVAC_MAX_REPLICAS; i++)
+		entry->replica_fd[i].store(-1, std::memory_order_relaxed);
+	entry->next_replica.store(0, std::memory_order_relaxed);
+}
+
+/* Read routing, set at init
+ *   HVAC_REPLICA_POLICY  p2c (default) reads from the less loaded of two random
+ *                        replicas, rr goes round robin
+ *   HVAC_PFS_BYPASS_US   a read whose server expects a longer wait than this
+ *                        goes straight to the PFS (200000), 0 never bypasses
+ */
+static bool g_replica_p2c = true;
+static uint64_t g_pfs_bypass_us = 200000;
+
+static uint32_t hvac_fd_choose(hvac_fd_entry *entry)
+{
+	static __thread uint32_t tl_seed = 0;
+	uint32_t n = entry->replicas;
+
+	if (!g_replica_p2c)
+		return entry->next_replica.fetch_add(1, std::memory_order_relaxed) % n;
+
+	if (tl_seed == 0)
+		tl_seed = (uint32_t)pthread_self() | 1;
+	tl_seed ^= tl_seed << 13;
+	tl_seed ^= tl_seed >> 17;
+	tl_seed ^= tl_seed << 5;
+	uint32_t a = tl_seed % n;
+	uint32_t b = (a + 1 + (tl_seed >> 16) % (n - 1)) % n;
+	uint64_t wait_a = hvac_client_load_wait(hvac_replica_server(entry->server, a, g_hvac_server_count));
+	uint64_t wait_b = hvac_client_load_wait(hvac_replica_server(entry->server, b, g_hvac_server_count));
+	return wait_a <= wait_b ? a : b;
+}
 
-std::map<int,std::string> fd_map;
-std::map<int, int > fd_redir_map;
+/* Picks the server to read from and its handle, the home server if a replica
+ * cannot open the file. False means the pick is overloaded, read the PFS. */
+static bool hvac_fd_pick(hvac_fd_entry *entry, uint32_t *server, int64_t *handle)
+{
+	uint32_t i = entry->replicas > 1 ? hvac_fd_choose(entry) : 0;
+
+	*server = hvac_replica_server(entry->server, i, g_hvac_server_count);
+	if (g_pfs_bypass_us && hvac_client_load_wait(*server) > g_pfs_bypass_us){
+		L4C_INFO("Server %u is overloaded, reading %s from the PFS", *server, entry->path.c_str());
+		return false;
+	}
+
+	*handle = entry->remote_fd;
+	if (i == 0)
+		return true;
+	int64_t fd = entry->replica_fd[i].load(std::memory_order_acquire);
+	if (fd == -1){
+		int64_t opened = -1;
+		int64_t file_size = -1;
+		hvac_client_comm_gen_open_rpc(*server, entry->path, &opened, &file_size);
+		hvac_client_block();
+		int64_t expected = -1;
+		if (opened < 0)
+			opened = -2;
+		if (entry->replica_fd[i].compare_exchange_strong(expected, opened)){
+			fd = opened;
+		}else{
+			/* Another thread opened it first, give our reference back */
+			if (opened >= 0)
+				hvac_client_comm_gen_close_rpc(*server, opened);
+			fd = expected;
+		}
+	}
+	if (fd < 0){
+		*server = entry->server;
+		return true;
+	}
+	*handle = fd;
+	return true;
+}
+
+static bool hvac_fd_adopt(hvac_fd_entry *entry)
+{
+	if (!entry->inherited.load(std::memory_order_acquire))
+		return true;
+
+	pthread_mutex_lock(&fd_adopt_mutex);
+	if (entry->inherited.load(std::memory_order_relaxed)){
+		int64_t remote_fd = -1;
+		int64_t file_size = -1;
+		uint32_t replicas = 1;
+		if (!__atomic_load_n(&g_mercury_init, __ATOMIC_ACQUIRE))
+			hvac_client_wait_mercury();
+		hvac_client_comm_gen_open_rpc(entry->server, entry->path, &remote_fd, &file_size, &replicas);
+		hvac_client_block();
+		L4C_INFO("Adopted inherited %s as handle %ld", entry->path.c_str(), remote_fd);
+		entry->remote_fd = remote_fd;
+		/* Replica handles were the parent's as well */
+		hvac_fd_init_replicas(entry, replicas);
+		entry->inherited.store(false, std::memory_order_release);
+	}
+	pthread_mutex_unlock(&fd_adopt_mutex);
+	/* A failed reopen leaves the wrappers to fall back to the PFS */
+	return entry->remote_fd >= 0;
+}
+
+/* Least loaded replica other than busy that already has the file open */
+static bool hvac_fd_hedge_target(hvac_fd_entry *entry, uint32_t busy, uint32_t *server, int64_t *handle)
+{
+	uint64_t best_wait = UINT64_MAX;
+	bool found = false;
+
+	for (uint32_t i = 0; i < entry->replicas; i++){
+		uint32_t s = hvac_replica_server(entry->server, i, g_hvac_server_count);
+		int64_t fd = i == 0 ? entry->remote_fd : entry->replica_fd[i].load(std::memory_order_acquire);
+		if (s == busy || fd < 0)
+			continue;
+		uint64_t wait = hvac_client_load_wait(s);
+		if (wait < best_wait){
+			best_wait = wait;
+			*server = s;
+			*handle = fd;
+			found = true;
+		}
+	}
+	return found;
+}
+
+/* Reads through server and waits for it. A read still outstanding after the
+ * hedge delay is raced against a duplicate, sent to another replica that has
+ * the file open or read from the PFS on this thread. Only a read that went
+ * into a bounce buffer is hedged, the hedge needs one as well. The winner is
+ * copied out, the loser is left to finish on its own. -1 falls back to the
+ * PFS. */
+static ssize_t hvac_read_hedged(hvac_fd_entry *entry, int fd, uint32_t server, int64_t handle,
+                                const struct iovec *iov, int iovcnt, off_t offset)
+{
+	uint32_t hedge_server;
+	int64_t hedge_handle;
+
+	hvac_client_comm_gen_readv_rpc(server, handle, iov, iovcnt, offset);
+	if (!hvac_read_hedge_wait())
+		return hvac_read_block();
+
+	if (hvac_fd_hedge_target(entry, server, &hedge_server, &hedge_handle)){
+		L4C_INFO("Hedging read of %s on server %u to server %u", entry->path.c_str(), server, hedge_server);
+		if (!hvac_client_comm_gen_hedge_rpc(hedge_server, hedge_handle, iov, iovcnt, offset))
+			return hvac_read_block();
+		return hvac_read_block_first();
+	}
+
+	L4C_INFO("Hedging read of %s on server %u to the PFS", entry->path.c_str(), server);
+	bool saved = tl_disable_redirect;
+	tl_disable_redirect = true;
+	ssize_t pfs = preadv(fd, iov, iovcnt, offset);
+	tl_disable_redirect = saved;
+	if (pfs < 0)
+		return hvac_read_block();
+	hvac_read_abandon();
+	return pfs;
+}
+
+/* Fills a node block cache block, from the PFS when the servers are overloaded */
+struct hvac_shm_fetch_arg {
+	hvac_fd_entry *entry;
+	int fd;
+};
+
+static ssize_t hvac_shm_fetch(void *arg, void *dst, size_t len, off_t offset)
+{
+	struct hvac_shm_fetch_arg *fetch = (struct hvac_shm_fetch_arg *)arg;
+	uint32_t server;
+	int64_t handle;
+
+	if (!hvac_fd_adopt(fetch->entry))
+		return -1;
+	if (!hvac_fd_pick(fetch->entry, &server, &handle)){
+		bool saved = tl_disable_redirect;
+		tl_disable_redirect = true;
+		ssize_t ret = pread(fetch->fd, dst, len, offset);
+		tl_disable_redirect = saved;
+		return ret;
+	}
+	struct iovec iov = { dst, len };
+	return hvac_read_hedged(fetch->entry, fetch->fd, server, handle, &iov, 1, offset);
+}
+
+/* Reads that need no server: the NVMe copy handed over by a server on this
+ * node, or what another rank on this node already fetched, the broadcast
+ * copy or the block cache. -1 sends the read to the servers. */
+static ssize_t hvac_local_read(hvac_fd_entry *entry, int fd, void *buf, size_t count, off_t offset)
+{
+	if (entry->local_fd >= 0){
+		bool saved = tl_disable_redirect;
+		tl_disable_redirect = true;
+		ssize_t ret = pread(entry->local_fd, buf, count, offset);
+		tl_disable_redirect = saved;
+		if (ret >= 0)
+			return ret;
+	}
+	if (entry->bcast){
+		ssize_t ret = hvac_bcast_read(entry->bcast, buf, count, offset);
+		if (ret >= 0)
+			return ret;
+	}
+	struct hvac_shm_fetch_arg arg = { entry, fd };
+	return hvac_shm_cache_read(entry->shm_key, entry->size.load(), buf, count, offset, hvac_shm_fetch, &arg);
+}
+
+static void hvac_client_init_mercury()
+{
+	const char *warmup = getenv("HVAC_WARMUP");
+
+	/* Behind the node aggregator one na+sm class is all we need */
+	bool aggregator = hvac_client_comm_aggregator_find();
+	if (aggregator)
+		hvac_init_comm(false, "na+sm");
+	else
+		hvac_init_comm(false);
+	hvac_client_load_init(g_hvac_server_count);
+	/* Also loads and resolves every server address */
+	hvac_client_comm_register_rpc();
+	/* An na+sm class alone cannot reach the servers, start over with the
+	 * normal transport. The unused class stays behind. */
+	if (aggregator && !hvac_client_comm_aggregator_used()){
+		L4C_ERR("Node aggregator unreachable, connecting to the servers directly");
+		hvac_init_comm(false);
+		hvac_client_comm_register_rpc();
+	}
+	if (warmup != NULL && strcmp(warmup, "1") == 0)
+		hvac_client_comm_ping_all();
+}
+
+static void *hvac_client_mercury_fn(void *args)
+{
+	/* Whatever Mercury opens must not wait on us through the wrappers */
+	tl_disable_redirect = true;
+	hvac_client_init_mercury();
+
+	pthread_mutex_lock(&init_mutex);
+	__atomic_store_n(&g_mercury_init, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&mercury_init_cond);
+	pthread_mutex_unlock(&init_mutex);
+	return NULL;
+}
+
+/* Sets Mercury up inline when the constructor did not start it */
+static void hvac_client_wait_mercury()
+{
+	pthread_mutex_lock(&init_mutex);
+	if (!g_mercury_init_started){
+		g_mercury_init_started = true;
+		hvac_client_init_mercury();
+		__atomic_store_n(&g_mercury_init, true, __ATOMIC_RELEASE);
+	}
+	while (!g_mercury_init)
+		pthread_cond_wait(&mercury_init_cond, &init_mutex);
+	pthread_mutex_unlock(&init_mutex);
+}
+
+/* fork() copies the Mercury class, its connections and the fd table, but not
+ * the progress threads. The child forgets the comm state without finalizing
+ * it, which would tear down endpoints the parent still uses, and sets up its
+ * own on the next tracked open. Inherited fds stay tracked and take their own
+ * server reference when first read. Offsets are kept per process from then on.
+ */
+static void hvac_client_atfork_prepare()
+{
+	/* Adoption waits on init_mutex, take the locks in that order */
+	pthread_mutex_lock(&fd_adopt_mutex);
+	pthread_mutex_lock(&init_mutex);
+	pthread_mutex_lock(&fd_table_mutex);
+	hvac_client_comm_atfork_prepare();
+	hvac_handoff_atfork_prepare();
+}
+
+static void hvac_client_atfork_parent()
+{
+	hvac_handoff_atfork_parent();
+	hvac_client_comm_atfork_parent();
+	pthread_mutex_unlock(&fd_table_mutex);
+	pthread_mutex_unlock(&init_mutex);
+	pthread_mutex_unlock(&fd_adopt_mutex);
+}
+
+static void hvac_client_atfork_child()
+{
+	hvac_comm_forget();
+	hvac_client_comm_atfork_child();
+	hvac_cstat_atfork_child();
+	hvac_handoff_atfork_child();
+	g_mercury_init = false;
+	g_mercury_init_started = false;
+
+	/* The parent's threads and the references they held are not ours */
+	fd_lookups.store(0, std::memory_order_relaxed);
+	hvac_fd_table *table = g_fd_table.load(std::memory_order_relaxed);
+	for (size_t fd = 0; table != nullptr && fd < table->nslots; fd++){
+		hvac_fd_entry *entry = table->slots[fd].load(std::memory_order_relaxed);
+		if (entry != nullptr){
+			entry->inherited.store(true, std::memory_order_relaxed);
+			entry->refs.store(1, std::memory_order_relaxed);
+			hvac_bcast_inherit(entry->bcast);
+		}
+	}
+	/* Unpublished ones are deleted in the child as well */
+	for (hvac_fd_entry *entry : fd_unpublished){
+		hvac_bcast_inherit(entry->bcast);
+		delete entry;
+	}
+	fd_unpublished.clear();
+
+	pthread_mutex_unlock(&fd_table_mutex);
+	pthread_mutex_unlock(&init_mutex);
+	pthread_mutex_unlock(&fd_adopt_mutex);
+}
 
 /* Devise a way to safely call this and initialize early */
 static void __attribute__((constructor)) hvac_client_init()
@@ -37,6 +565,7 @@ static void __attribute__((constructor)) hvac_client_init()
         return;
     }
     hvac_init_logging();
+    hvac_cstat_init();
 
     char * hvac_data_dir_c = getenv("HVAC_DATA_DIR");
 
@@ -55,9 +584,35 @@ static void __attribute__((constructor)) hvac_client_init()
     {
 		hvac_data_dir = (char *)malloc(strlen(hvac_data_dir_c) + 1);
 		snprintf(hvac_data_dir, strlen(hvac_data_dir_c) + 1, "%s", hvac_data_dir_c);
+		try {
+			g_hvac_data_dir_canon = std::filesystem::canonical(hvac_data_dir).string();
+		} catch (...) {
+			L4C_ERR("Could not resolve HVAC_DATA_DIR %s", hvac_data_dir);
+			g_hvac_data_dir_canon = std::filesystem::path(hvac_data_dir).lexically_normal().string();
+		}
+		if (g_hvac_data_dir_canon.empty() || g_hvac_data_dir_canon.back() != '/')
+			g_hvac_data_dir_canon += '/';
     }
     
 
+    const char *policy = getenv("HVAC_REPLICA_POLICY");
+    if (policy != NULL)
+        g_replica_p2c = strcmp(policy, "rr") != 0;
+    if (getenv("HVAC_PFS_BYPASS_US") != NULL)
+        g_pfs_bypass_us = strtoull(getenv("HVAC_PFS_BYPASS_US"), NULL, 10);
+
+    pthread_atfork(hvac_client_atfork_prepare, hvac_client_atfork_parent, hvac_client_atfork_child);
+
+    /* HVAC_EAGER_INIT=0 defers Mercury to the first tracked open */
+    const char *eager = getenv("HVAC_EAGER_INIT");
+    if (eager == NULL || strcmp(eager, "0") != 0){
+        pthread_t mercury_tid;
+        g_mercury_init_started =
+            pthread_create(&mercury_tid, NULL, hvac_client_mercury_fn, NULL) == 0;
+        if (g_mercury_init_started)
+            pthread_detach(mercury_tid);
+    }
+
     g_hvac_initialized = true;
     pthread_mutex_unlock(&init_mutex);
     
@@ -66,7 +621,80 @@ static void __attribute__((constructor)) hvac_client_init()
 
 static void __attribute((destructor)) hvac_client_shutdown()
 {
-    hvac_shutdown_comm();
+    hvac_cstat_report();
+    hvac_telemetry_shutdown();
+    hvac_bootstrap_detach();
+    hvac_shm_cache_detach();
+    /* A setup still in flight owns the Mercury state, leave it to exit */
+    pthread_mutex_lock(&init_mutex);
+    bool mercury_up = g_mercury_init;
+    pthread_mutex_unlock(&init_mutex);
+    if (mercury_up)
+        hvac_shutdown_comm();
+}
+
+/* True if dir (no trailing '/') is prefix or a subdirectory of prefix (with trailing '/') */
+static bool hvac_dir_under(const std::string &dir, const std::string &prefix)
+{
+	return dir.size() + 1 >= prefix.size() &&
+		dir.compare(0, prefix.size() - 1, prefix, 0, prefix.size() - 1) == 0 &&
+		(dir.size() + 1 == prefix.size() || dir[prefix.size() - 1] == '/');
+}
+
+/* Work out the canonical parent directory of path and whether it is tracked.
+ * Lexical fast path first, then the directory cache, and only on a cache miss
+ * a single canonical() of the parent directory.
+ */
+static bool hvac_classify_path(const char *path, std::string &canon_dir, bool &tracked)
+{
+	std::string abs;
+	std::string dir;
+	bool dotdot = (strstr(path, "..") != NULL);
+
+	if (path[0] == '/'){
+		abs = path;
+	}else{
+		abs = std::filesystem::current_path().string() + "/" + path;
+	}
+	/* Collapsing ".." lexically is wrong across symlinks, keep those spelled as given */
+	if (!dotdot){
+		abs = std::filesystem::path(abs).lexically_normal().string();
+	}
+	size_t slash = abs.find_last_of('/');
+	dir = (slash == 0) ? std::string("/") : abs.substr(0, slash);
+
+	if (hvac_data_dir != NULL && !dotdot && hvac_dir_under(dir, g_hvac_data_dir_canon)){
+		canon_dir = dir;
+		tracked = true;
+		return true;
+	}
+
+	pthread_mutex_lock(&dir_class_mutex);
+	auto it = dir_class_cache.find(dir);
+	if (it != dir_class_cache.end()){
+		canon_dir = it->second.canon;
+		tracked = it->second.tracked;
+		pthread_mutex_unlock(&dir_class_mutex);
+	}else{
+		pthread_mutex_unlock(&dir_class_mutex);
+		hvac_dir_class entry;
+		entry.canon = std::filesystem::canonical(dir).string();
+		entry.tracked = (hvac_data_dir != NULL) && hvac_dir_under(entry.canon, g_hvac_data_dir_canon);
+		canon_dir = entry.canon;
+		tracked = entry.tracked;
+		pthread_mutex_lock(&dir_class_mutex);
+		if (dir_class_cache.size() >= HVAC_DIR_CACHE_MAX){
+			dir_class_cache.clear();
+		}
+		dir_class_cache[dir] = entry;
+		pthread_mutex_unlock(&dir_class_mutex);
+	}
+
+	/* Without HVAC_DATA_DIR we track files in the current working directory */
+	if (hvac_data_dir == NULL){
+		tracked = (canon_dir == std::filesystem::current_path().string());
+	}
+	return true;
 }
 
 bool hvac_track_file(const char *path, int flags, int fd)
@@ -88,47 +716,79 @@ bool hvac_track_file(const char *path, int flags, int fd)
 		return false;
 	}    
 
+	std::string tracked_path;
 	try {
-
-		std::string ppath = std::filesystem::canonical(path).parent_path();
-//	L4C_INFO("ppath: %s", ppath.c_str());	
-		// Check if current file exists in HVAC_DATA_DIR
-		if (hvac_data_dir != NULL){
-			std::string test = std::filesystem::canonical(hvac_data_dir);
-			
-			if (ppath.find(test) != std::string::npos)
-			{
-
-				//L4C_FATAL("Got a file want a stack trace");
-				L4C_INFO("Traacking used HV_DD file %s",path);
-				fd_map[fd] = std::filesystem::canonical(path);
-				tracked = true;
-			}		
-		}else if (ppath == std::filesystem::current_path()) {       
-			L4C_INFO("Traacking used CWD file %s",path);
-			fd_map[fd] = std::filesystem::canonical(path);
-			tracked = true;
+		std::string ppath;
+		if (hvac_classify_path(path, ppath, tracked) && tracked){
+			std::string fname = std::filesystem::path(path).filename().string();
+			tracked_path = (ppath == "/" ? std::string() : ppath) + "/" + fname;
+			L4C_INFO("Traacking used %s file %s", hvac_data_dir ? "HV_DD" : "CWD", path);
 		}
 	} catch (...)
 	{
 		//Need to do something here
 		L4C_INFO("inside catch\n");
+		tracked = false;
 	}
 
 
 	// Send RPC to tell server to open file 
 	if (tracked){	
-		if (!g_mercury_init){
-			hvac_init_comm(false);	
-			/* I think I only need to do this once */
-			hvac_client_comm_register_rpc();
-			g_mercury_init = true;
-		}
+		if (!__atomic_load_n(&g_mercury_init, __ATOMIC_ACQUIRE))
+			hvac_client_wait_mercury();
 		
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
-		L4C_INFO("Remote open - Host %d", host);
-		hvac_client_comm_gen_open_rpc(host, fd_map[fd], fd);
+		hvac_fd_entry *entry = new hvac_fd_entry;
+		int64_t remote_fd = -1;
+		int64_t file_size = -1;
+		uint32_t replicas = 1;
+		int32_t redirect = -1;
+		uint32_t bcast = 0;
+		entry->path = tracked_path;
+		entry->server = std::hash<std::string>{}(tracked_path) % g_hvac_server_count;
+		L4C_INFO("Remote open - Host %d", entry->server);
+		hvac_client_comm_gen_open_rpc(entry->server, tracked_path, &remote_fd, &file_size, &replicas, &redirect, &bcast);
 		hvac_client_block();
+
+		/* The home server had no room and placed the file on a peer.
+		 * Keep the home handle if the peer cannot open it. */
+		if (remote_fd >= 0 && redirect >= 0 && (uint32_t)redirect < g_hvac_server_count){
+			int64_t peer_fd = -1;
+			int64_t peer_size = -1;
+			hvac_client_comm_gen_open_rpc(redirect, tracked_path, &peer_fd, &peer_size);
+			hvac_client_block();
+			if (peer_fd >= 0){
+				L4C_INFO("Redirected %s to host %d", path, redirect);
+				hvac_client_comm_gen_close_rpc(entry->server, remote_fd);
+				entry->server = redirect;
+				remote_fd = peer_fd;
+				/* Spilled files have no replica set */
+				replicas = 1;
+			}
+		}
+
+		/* Nothing to redirect to if the server could not open it */
+		if (remote_fd < 0){
+			L4C_INFO("Remote open failed for %s, not tracking", path);
+			tl_cstat_open_fallback = true;
+			delete entry;
+			return false;
+		}
+		entry->remote_fd = remote_fd;
+		entry->offset.store(0, std::memory_order_relaxed);
+		entry->size.store(file_size, std::memory_order_relaxed);
+		entry->inherited.store(false, std::memory_order_relaxed);
+		hvac_fd_init_replicas(entry, replicas);
+		/* Every rank reads this one, one process per node fetches it */
+		if (bcast)
+			entry->bcast = hvac_bcast_attach(tracked_path, file_size, entry->server);
+		entry->shm_key = hvac_shm_cache_key(tracked_path, file_size);
+		/* Our own node's NVMe, read it without the RPCs */
+		if (hvac_client_comm_server_local(entry->server)){
+			entry->local_fd = hvac_handoff_get(entry->server, remote_fd);
+			if (entry->local_fd >= 0)
+				entry->local_handle.store(remote_fd, std::memory_order_relaxed);
+		}
+		hvac_fd_publish(fd, entry);
 	}
 
 
@@ -148,11 +808,27 @@ ssize_t hvac_remote_read(int fd, void *buf, size_t count)
 	 */
 		L4C_INFO("remote_read func\n");		
 	ssize_t bytes_read = -1;
-	if (hvac_file_tracked(fd)){
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
-		L4C_INFO("Remote read - Host %d", host);		
-		hvac_client_comm_gen_read_rpc(host, fd, buf, count, -1);
-		bytes_read = hvac_read_block();   		
+	hvac_fd_ref ref(fd);
+	hvac_fd_entry *entry = ref.entry;
+	int64_t handle;
+	uint32_t server;
+	/* Nothing to transfer, and Mercury rejects empty bulk handles */
+	if (entry && count == 0)
+		return 0;
+	if (entry){
+		bytes_read = hvac_local_read(entry, fd, buf, count, entry->offset.load());
+		if (bytes_read >= 0){
+			entry->offset += bytes_read;
+			return bytes_read;
+		}
+	}
+	if (entry && hvac_fd_adopt(entry) && hvac_fd_pick(entry, &server, &handle)){
+		L4C_INFO("Remote read - Host %d", server);		
+		struct iovec iov = { buf, count };
+		bytes_read = hvac_read_hedged(entry, fd, server, handle, &iov, 1, entry->offset.load());
+		if (bytes_read > 0){
+			entry->offset += bytes_read;
+		}
 		return bytes_read;
 	}
 	/* Non-HVAC Reads come from base */
@@ -172,61 +848,202 @@ ssize_t hvac_remote_pread(int fd, void *buf, size_t count, off_t offset)
 	 */
 		L4C_INFO("remote_pread func\n");		
 	ssize_t bytes_read = -1;
-	if (hvac_file_tracked(fd)){
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
-		L4C_INFO("Remote pread - Host %d", host);		
-		hvac_client_comm_gen_read_rpc(host, fd, buf, count, offset);
-		bytes_read = hvac_read_block();   	
+	hvac_fd_ref ref(fd);
+	hvac_fd_entry *entry = ref.entry;
+	int64_t handle;
+	uint32_t server;
+	if (entry && count == 0)
+		return 0;
+	if (entry){
+		bytes_read = hvac_local_read(entry, fd, buf, count, offset);
+		if (bytes_read >= 0)
+			return bytes_read;
+	}
+	if (entry && hvac_fd_adopt(entry) && hvac_fd_pick(entry, &server, &handle)){
+		L4C_INFO("Remote pread - Host %d", server);		
+		struct iovec iov = { buf, count };
+		bytes_read = hvac_read_hedged(entry, fd, server, handle, &iov, 1, offset);
 		return bytes_read;
 	}
 	/* Non-HVAC Reads come from base */
 	return bytes_read;
 }
 
-ssize_t hvac_remote_lseek(int fd, int offset, int whence)
+/* readv/preadv family - offset of -1 means use the file position like readv.
+ * The whole iovec array goes out as one RPC with a multi-segment bulk handle.
+ */
+ssize_t hvac_remote_readv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
 {
-		/* HVAC Code */
-	/* Check the local fd - if it's tracked we pass it to the RPC function
-	 * The local FD is converted to the remote FD with the buf and count
-	 * We must know the remote FD to avoid collision on the remote side
-	 */
 	ssize_t bytes_read = -1;
-	if (hvac_file_tracked(fd)){
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
-		L4C_INFO("Remote seek - Host %d", host);		
-		hvac_client_comm_gen_seek_rpc(host, fd, offset, whence);
-		bytes_read = hvac_seek_block();   		
+	size_t total = 0;
+
+	if (iovcnt < 0 || iov == NULL){
+		return bytes_read;
+	}
+
+	hvac_fd_ref ref(fd);
+	hvac_fd_entry *entry = ref.entry;
+	int64_t handle;
+	uint32_t server;
+	for (int i = 0; i < iovcnt; i++){
+		total += iov[i].iov_len;
+	}
+	if (entry && total == 0)
+		return 0;
+	if (entry){
+		/* Segment by segment from the node copies, all of it remotely if they give out midway */
+		off_t at = (offset == -1) ? entry->offset.load() : offset;
+		ssize_t copied = 0;
+		for (int i = 0; i < iovcnt; i++){
+			ssize_t ret = hvac_local_read(entry, fd, iov[i].iov_base, iov[i].iov_len, at + copied);
+			if (ret < 0){
+				copied = -1;
+				break;
+			}
+			if (ret == 0)
+				break;
+			copied += ret;
+			if ((size_t)ret < iov[i].iov_len)
+				break;
+		}
+		if (copied >= 0){
+			if (offset == -1)
+				entry->offset += copied;
+			return copied;
+		}
+	}
+	if (entry && hvac_fd_adopt(entry) && hvac_fd_pick(entry, &server, &handle)){
+		L4C_INFO("Remote readv - Host %d segments %d bytes %ld", server, iovcnt, total);
+		/* readv style calls read at and advance the file position */
+		bool advance = (offset == -1);
+		if (advance){
+			offset = entry->offset.load();
+		}
+		bytes_read = hvac_read_hedged(entry, fd, server, handle, iov, iovcnt, offset);
+		if (advance && bytes_read > 0){
+			entry->offset += bytes_read;
+		}
 		return bytes_read;
 	}
 	/* Non-HVAC Reads come from base */
 	return bytes_read;
 }
 
+/* Seeks never leave the client. The position lives in the fd table and
+ * SEEK_END uses the size returned by the open RPC (or fstat if the server
+ * could not provide one).
+ */
+off64_t hvac_remote_lseek(int fd, off64_t offset, int whence)
+{
+	off64_t base = 0;
+	off64_t size;
+	struct stat st;
+
+	hvac_fd_ref ref(fd);
+	hvac_fd_entry *entry = ref.entry;
+	if (!entry){
+		errno = EBADF;
+		return -1;
+	}
+
+	size = entry->size.load();
+	if (size < 0 && (whence == SEEK_END || whence == SEEK_DATA || whence == SEEK_HOLE)){
+		if (fstat(fd, &st) != 0){
+			return -1;
+		}
+		size = st.st_size;
+		entry->size.store(size);
+	}
+
+	switch (whence){
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = entry->offset.load();
+			break;
+		case SEEK_END:
+			base = size;
+			break;
+		/* Cached dataset files are treated as having no holes */
+		case SEEK_DATA:
+			if (offset < 0 || offset >= size){
+				errno = ENXIO;
+				return -1;
+			}
+			entry->offset.store(offset);
+			return offset;
+		case SEEK_HOLE:
+			if (offset < 0 || offset >= size){
+				errno = ENXIO;
+				return -1;
+			}
+			entry->offset.store(size);
+			return size;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	if (base + offset < 0){
+		errno = EINVAL;
+		return -1;
+	}
+	L4C_INFO("Local seek fd %d to %ld", fd, base + offset);
+	entry->offset.store(base + offset);
+	return base + offset;
+}
+
+off64_t hvac_get_offset(int fd)
+{
+	hvac_fd_ref ref(fd);
+	hvac_fd_entry *entry = ref.entry;
+	if (!entry){
+		return -1;
+	}
+	return entry->offset.load();
+}
+
+void hvac_set_offset(int fd, off64_t offset)
+{
+	hvac_fd_ref ref(fd);
+	hvac_fd_entry *entry = ref.entry;
+	if (entry){
+		entry->offset.store(offset);
+	}
+}
+
 void hvac_remote_close(int fd){
-	if (hvac_file_tracked(fd)){
-		int host = std::hash<std::string>{}(fd_map[fd]) % g_hvac_server_count;	
-		hvac_client_comm_gen_close_rpc(host, fd);             	
+	hvac_fd_ref ref(fd);
+	hvac_fd_entry *entry = ref.entry;
+	/* Reads racing the close may still use local_fd, only the pin goes now */
+	if (entry)
+		hvac_fd_local_unpin(entry);
+	/* The parent's reference is not ours to drop */
+	if (entry && !entry->inherited.load(std::memory_order_acquire) && entry->remote_fd >= 0){
+		hvac_client_comm_gen_close_rpc(entry->server, entry->remote_fd);             	
+		for (uint32_t i = 1; i < entry->replicas; i++){
+			int64_t handle = entry->replica_fd[i].load(std::memory_order_acquire);
+			if (handle >= 0)
+				hvac_client_comm_gen_close_rpc(hvac_replica_server(entry->server, i, g_hvac_server_count), handle);
+		}
 	}
 }
 
 bool hvac_file_tracked(int fd)
 {
-	if(fd_map.empty()){
-        return false;
-    }
-	return (fd_map.find(fd) != fd_map.end());
+	hvac_fd_ref ref(fd);
+	return ref.entry != nullptr;
 }
 
+/* Valid until fd is closed */
 const char * hvac_get_path(int fd)
 {
-	
-	if(fd_map.empty()){
-		return NULL;
-	}	
-//	L4C_INFO("fd: %d\n", fd);		
-	if (fd_map.find(fd) != fd_map.end())
+	hvac_fd_ref ref(fd);
+	hvac_fd_entry *entry = ref.entry;
+	if (entry)
 	{
-		return fd_map[fd].c_str();
+		return entry->path.c_str();
 	}
 	return NULL;
 }
@@ -234,5 +1051,5 @@ const char * hvac_get_path(int fd)
 bool hvac_remove_fd(int fd)
 {
 	hvac_remote_close(fd);	
-	return fd_map.erase(fd);
+	return hvac_fd_unpublish(fd);
 }
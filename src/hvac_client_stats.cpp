@@ -0,0 +1,237 @@
+/* Client side latency histograms
+ *
+ * Every intercepted open, read, pread, seek and close is timed and binned by
+ * outcome: served by HVAC, tracked but fell back to the PFS, or untracked.
+ * Each thread records into its own histograms, they are merged and written
+ * once when the library unloads.
+ *
+ * Environment
+ *   HVAC_CLIENT_STATS         output path, %r rank, %p pid, %h host. "-" is stderr.
+ *                             Unset disables the timing altogether.
+ *   HVAC_CLIENT_STATS_FORMAT  text (default), csv or json
+ */
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "hvac_internal.h"
+#include "hvac_histogram.h"
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+using namespace std;
+
+extern __thread bool tl_disable_redirect;
+
+struct hvac_cstat_block {
+	struct hvac_histogram h[HVAC_CSTAT_OPS][HVAC_CSTAT_OUTCOMES];
+};
+
+static bool cstat_enabled = false;
+static string cstat_path;
+static string cstat_format;
+
+/* Blocks outlive their threads so short lived threads still get reported */
+static pthread_mutex_t cstat_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<hvac_cstat_block *> cstat_blocks;
+static __thread hvac_cstat_block *tl_cstat_block = NULL;
+
+/* Set by hvac_track_file when a tracked open could not be redirected */
+__thread bool tl_cstat_open_fallback = false;
+
+static const char *cstat_op_names[HVAC_CSTAT_OPS] = { "open", "read", "pread", "seek", "close" };
+static const char *cstat_outcome_names[HVAC_CSTAT_OUTCOMES] = { "remote", "fallback", "untracked" };
+
+static int hvac_cstat_rank()
+{
+	const char *vars[] = { "PMI_RANK", "PMIX_RANK", "OMPI_COMM_WORLD_RANK", "SLURM_PROCID" };
+	for (const char *var : vars){
+		if (getenv(var) != NULL)
+			return atoi(getenv(var));
+	}
+	return -1;
+}
+
+void hvac_cstat_init()
+{
+	const char *path = getenv("HVAC_CLIENT_STATS");
+	const char *format = getenv("HVAC_CLIENT_STATS_FORMAT");
+
+	if (path == NULL || path[0] == '\0')
+		return;
+	cstat_path = path;
+	cstat_format = format ? format : "text";
+	if (cstat_format != "text" && cstat_format != "csv" && cstat_format != "json"){
+		L4C_ERR("Unknown HVAC_CLIENT_STATS_FORMAT %s, using text", cstat_format.c_str());
+		cstat_format = "text";
+	}
+	cstat_enabled = true;
+}
+
+uint64_t hvac_cstat_begin(void)
+{
+	struct timespec ts;
+	if (!cstat_enabled)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void hvac_cstat_end(int op, int outcome, uint64_t t_start)
+{
+	struct timespec ts;
+	if (t_start == 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	if (tl_cstat_block == NULL){
+		tl_cstat_block = (hvac_cstat_block *)calloc(1, sizeof(hvac_cstat_block));
+		if (tl_cstat_block == NULL)
+			return;
+		pthread_mutex_lock(&cstat_mutex);
+		cstat_blocks.push_back(tl_cstat_block);
+		pthread_mutex_unlock(&cstat_mutex);
+	}
+	hvac_hist_add(&tl_cstat_block->h[op][outcome], now - t_start);
+}
+
+/* A forked child reports its own calls only */
+void hvac_cstat_atfork_child()
+{
+	pthread_mutex_init(&cstat_mutex, NULL);
+	for (hvac_cstat_block *block : cstat_blocks)
+		memset(block, 0, sizeof(*block));
+}
+
+int hvac_cstat_open_outcome(bool tracked)
+{
+	bool fallback = tl_cstat_open_fallback;
+	tl_cstat_open_fallback = false;
+	if (tracked)
+		return HVAC_CSTAT_REMOTE;
+	return fallback ? HVAC_CSTAT_FALLBACK : HVAC_CSTAT_UNTRACKED;
+}
+
+static string hvac_cstat_expand(const string &pattern, int rank)
+{
+	char host[HOST_NAME_MAX + 1] = "unknown";
+	string out;
+
+	gethostname(host, sizeof(host));
+	for (size_t i = 0; i < pattern.size(); i++){
+		if (pattern[i] != '%' || i + 1 == pattern.size()){
+			out += pattern[i];
+			continue;
+		}
+		switch (pattern[++i]){
+			case 'r': out += to_string(rank); break;
+			case 'p': out += to_string(getpid()); break;
+			case 'h': out += host; break;
+			default: out += '%'; out += pattern[i]; break;
+		}
+	}
+	return out;
+}
+
+/* Share of the calls that HVAC served */
+static double hvac_cstat_redirect(const hvac_cstat_block &total, int op)
+{
+	uint64_t all = 0;
+	for (int o = 0; o < HVAC_CSTAT_OUTCOMES; o++)
+		all += total.h[op][o].count;
+	return all ? 100.0 * total.h[op][HVAC_CSTAT_REMOTE].count / all : 0;
+}
+
+void hvac_cstat_report()
+{
+	if (!cstat_enabled)
+		return;
+
+	hvac_cstat_block *total = (hvac_cstat_block *)calloc(1, sizeof(hvac_cstat_block));
+	if (total == NULL)
+		return;
+	pthread_mutex_lock(&cstat_mutex);
+	for (hvac_cstat_block *block : cstat_blocks)
+		for (int op = 0; op < HVAC_CSTAT_OPS; op++)
+			for (int o = 0; o < HVAC_CSTAT_OUTCOMES; o++)
+				hvac_hist_merge(&total->h[op][o], &block->h[op][o]);
+	pthread_mutex_unlock(&cstat_mutex);
+
+	int rank = hvac_cstat_rank();
+	string path = hvac_cstat_expand(cstat_path, rank);
+
+	/* Our own output must not go through the wrappers */
+	tl_disable_redirect = true;
+	FILE *fp = (path == "-") ? stderr : fopen(path.c_str(), "w");
+	if (fp == NULL){
+		L4C_ERR("Could not write client stats to %s", path.c_str());
+		tl_disable_redirect = false;
+		free(total);
+		return;
+	}
+
+	bool first = true;
+	if (cstat_format == "json"){
+		fprintf(fp, "{\"rank\": %d, \"pid\": %d, \"redirect_pct\": {\"open\": %.2f, \"read\": %.2f, \"pread\": %.2f}, \"ops\": [",
+			rank, (int)getpid(), hvac_cstat_redirect(*total, HVAC_CSTAT_OPEN),
+			hvac_cstat_redirect(*total, HVAC_CSTAT_READ), hvac_cstat_redirect(*total, HVAC_CSTAT_PREAD));
+	}else if (cstat_format == "csv"){
+		fprintf(fp, "rank,pid,op,outcome,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+	}else{
+		fprintf(fp, "# hvac client stats rank %d pid %d\n", rank, (int)getpid());
+		fprintf(fp, "%-6s %-10s %10s %10s %10s %10s %10s %10s\n", "op", "outcome", "count",
+			"mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+	}
+
+	for (int op = 0; op < HVAC_CSTAT_OPS; op++){
+		for (int o = 0; o < HVAC_CSTAT_OUTCOMES; o++){
+			struct hvac_histogram *h = &total->h[op][o];
+			if (h->count == 0)
+				continue;
+			double mean = hvac_hist_mean(h);
+			uint64_t p50 = hvac_hist_quantile(h, 0.5);
+			uint64_t p99 = hvac_hist_quantile(h, 0.99);
+			uint64_t p999 = hvac_hist_quantile(h, 0.999);
+			if (cstat_format == "json"){
+				fprintf(fp, "%s{\"op\": \"%s\", \"outcome\": \"%s\", \"count\": %lu, \"mean_ns\": %.0f, \"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+					first ? "" : ", ", cstat_op_names[op], cstat_outcome_names[o],
+					(unsigned long)h->count, mean, (unsigned long)p50, (unsigned long)p99,
+					(unsigned long)p999, (unsigned long)h->max);
+			}else if (cstat_format == "csv"){
+				fprintf(fp, "%d,%d,%s,%s,%lu,%.0f,%lu,%lu,%lu,%lu\n", rank, (int)getpid(),
+					cstat_op_names[op], cstat_outcome_names[o], (unsigned long)h->count, mean,
+					(unsigned long)p50, (unsigned long)p99, (unsigned long)p999, (unsigned long)h->max);
+			}else{
+				fprintf(fp, "%-6s %-10s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+					cstat_op_names[op], cstat_outcome_names[o], (unsigned long)h->count,
+					mean / 1e3, p50 / 1e3, p99 / 1e3, p999 / 1e3, h->max / 1e3);
+			}
+			first = false;
+		}
+	}
+
+	if (cstat_format == "json"){
+		fprintf(fp, "]}\n");
+	}else if (cstat_format == "text"){
+		fprintf(fp, "redirected: open %.1f%% read %.1f%% pread %.1f%%\n",
+			hvac_cstat_redirect(*total, HVAC_CSTAT_OPEN), hvac_cstat_redirect(*total, HVAC_CSTAT_READ),
+			hvac_cstat_redirect(*total, HVAC_CSTAT_PREAD));
+	}
+
+	if (fp != stderr)
+		fclose(fp);
+	else
+		fflush(fp);
+	tl_disable_redirect = false;
+	free(total);
+}
@@ -1,11 +1,19 @@
 #include "hvac_comm.h"
 #include "hvac_data_mover_internal.h"
+#include "hvac_open_cache.h"
+#include "hvac_telemetry.h"
+#include "hvac_bootstrap.h"
+#include "hvac_replica.h"
+#include "hvac_peer.h"
 
 extern "C" {
 #include "hvac_logging.h"
 #include <fcntl.h>
 #include <cassert>
 #include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
 }
 
 
@@ -14,20 +22,12 @@ extern "C" {
 #include <map>	
 #include <unistd.h> 
 #include <fcntl.h> 
-#include <chrono>
-#include <fstream>
-#include <iostream>
-
-struct LogEntry {
-    std::string operation;
-    long long time_ns;
-};
-
-std::vector<LogEntry> log_buffer;
-
 
 static hg_class_t *hg_class = NULL;
 static hg_context_t *hg_context = NULL;
+/* Second class for co-located peers, NULL when shared memory is off */
+static hg_class_t *hg_sm_class = NULL;
+static hg_context_t *hg_sm_context = NULL;
 static int hvac_progress_thread_shutdown_flags = 0;
 static int hvac_server_rank = -1;
 static int server_rank = -1;
@@ -41,33 +41,33 @@ struct hvac_rpc_state {
     hvac_rpc_in_t in;
 };
 
-void append_to_file(int server_rank) {
-	std::string log_file = "operation_times_" + std::to_string(server_rank) + ".log";
-    std::ofstream outfile;
-    outfile.open(log_file, std::ios_base::app); // Append mode
-    for (const auto& entry : log_buffer) {
-        outfile << entry.operation << " " << entry.time_ns << "ns" << std::endl;
-    }
-    log_buffer.clear();
-}
-
 //Initialize communication for both the client and server
 //processes
 //This is based on the rpc_engine template provided by the mercury lib
 
-void hvac_init_comm(hg_bool_t listen)
+void hvac_init_comm(hg_bool_t listen, const char *transport)
 {
 	L4C_INFO("init\n");
-	const char *info_string = "ofi+tcp://";  
+	/* HVAC_TRANSPORT lets single node runs use na+sm or a loopback address,
+	 * clients and servers of one job must agree on it */
+	const char *info_string = getenv("HVAC_TRANSPORT") ? getenv("HVAC_TRANSPORT") : "ofi+tcp://";
+	if (transport != NULL)
+		info_string = transport;
+	/* Everyone also opens na+sm so peers on the same host skip the network
+	 * stack, HVAC_SM=0 turns that off */
+	const char *sm_env = getenv("HVAC_SM");
+	bool use_sm = strncmp(info_string, "na+sm", 5) != 0 && !(sm_env && strcmp(sm_env, "0") == 0);
 	char *rank_str = getenv("PMI_RANK"); //PMIX_RANK
 	
-    if (rank_str == NULL) {
+    /* Only servers need a rank, tools like hvac_stat run outside the job step */
+    if (rank_str == NULL && listen) {
         L4C_FATAL("RANK environment variable is not set\n");
         exit(EXIT_FAILURE);
 	}
   
-    server_rank = atoi(rank_str);
+    server_rank = rank_str ? atoi(rank_str) : -1;
     pthread_t hvac_progress_tid;
+    pthread_t hvac_sm_progress_tid;
 
     HG_Set_log_level("DEBUG");
 
@@ -81,11 +81,26 @@ void hvac_init_comm(hg_bool_t listen)
 		L4C_FATAL("Failed to initialize HG_CONTEXT\n");
 	}
 
+	if (use_sm){
+		hg_sm_class = HG_Init("na+sm", listen);
+		if (hg_sm_class != NULL)
+			hg_sm_context = HG_Context_create(hg_sm_class);
+		if (hg_sm_context == NULL){
+			/* Not fatal, co-located traffic keeps using the network class */
+			L4C_ERR("Failed to initialize na+sm, using %s for local peers\n", info_string);
+			if (hg_sm_class != NULL)
+				HG_Finalize(hg_sm_class);
+			hg_sm_class = NULL;
+		}
+	}
+
 	//Only for server processes
 	if (listen)
 	{
 		if (rank_str != NULL){
 			hvac_server_rank = atoi(rank_str);
+			hvac_telemetry_init(hvac_server_rank);
+			hvac_stats_init(hvac_server_rank);
 		}else
 		{
 			L4C_FATAL("Failed to extract rank\n");
@@ -95,9 +110,13 @@ void hvac_init_comm(hg_bool_t listen)
 	L4C_INFO("Mecury initialized");
 	//TODO The engine creates a pthread here to do the listening and progress work
 	//I need to understand this better I don't want to create unecessary work for the client
-	if (pthread_create(&hvac_progress_tid, NULL, hvac_progress_fn, NULL) != 0){
+	if (pthread_create(&hvac_progress_tid, NULL, hvac_progress_fn, hg_context) != 0){
 		L4C_FATAL("Failed to initialized mecury progress thread\n");
 	}
+	if (hg_sm_context != NULL &&
+	    pthread_create(&hvac_sm_progress_tid, NULL, hvac_progress_fn, hg_sm_context) != 0){
+		L4C_FATAL("Failed to initialized na+sm progress thread\n");
+	}
 }
 
 void hvac_shutdown_comm()
@@ -115,20 +134,29 @@ void hvac_shutdown_comm()
     ret = HG_Finalize(hg_class);
     assert(ret == HG_SUCCESS);
 
+	if (hg_sm_context == NULL)
+		return;
+    ret = HG_Context_destroy(hg_sm_context);
+    assert(ret == HG_SUCCESS);
+
+    ret = HG_Finalize(hg_sm_class);
+    assert(ret == HG_SUCCESS);
 }
 
+/* args is the context to drive, one thread per class */
 void *hvac_progress_fn(void *args)
 {
 	hg_return_t ret;
 	unsigned int actual_count = 0;
+	hg_context_t *context = args ? (hg_context_t *)args : hg_context;
 
 	while (!hvac_progress_thread_shutdown_flags){
 		do{
-			ret = HG_Trigger(hg_context, 0, 1, &actual_count);
+			ret = HG_Trigger(context, 0, 1, &actual_count);
 		} while (
 			(ret == HG_SUCCESS) && actual_count && !hvac_progress_thread_shutdown_flags);
 		if (!hvac_progress_thread_shutdown_flags)
-			HG_Progress(hg_context,100);
+			HG_Progress(context,100);
 	}
 	
 	return NULL;
@@ -138,23 +166,35 @@ void *hvac_progress_fn(void *args)
 /* There is an expectation that the server will be started in 
  * advance of the clients. Should the servers be started with an
  * argument regarding the number of servers? */
+static void hvac_comm_self_addr(hg_class_t *cls, char *addr_string, hg_size_t addr_string_size)
+{
+    hg_addr_t self_addr;
+
+    HG_Addr_self(cls, &self_addr);
+    HG_Addr_to_string(
+        cls, addr_string, &addr_string_size, self_addr);
+    HG_Addr_free(cls, self_addr);
+}
+
+/* Each line is "rank addr sm_addr host", sm_addr is "-" without na+sm.
+ * Clients on host use sm_addr, everyone else addr. */
 void hvac_comm_list_addr()
 {
 	char self_addr_string[PATH_MAX];
+	char sm_addr_string[PATH_MAX] = "-";
+	char host[HOST_NAME_MAX + 1] = "unknown";
 	char filename[PATH_MAX];
-    hg_addr_t self_addr;
 	FILE *na_config = NULL;
-	hg_size_t self_addr_string_size = PATH_MAX;
 //	char *stepid = getenv("PMIX_NAMESPACE");
 	char *jobid = getenv("SLURM_JOBID");
 	
-	sprintf(filename, "./.ports.cfg.%s", jobid);
+	sprintf(filename, "./.ports.cfg.%s", jobid ? jobid : "0");
 	/* Get self addr to tell client about */
-    HG_Addr_self(hg_class, &self_addr);
-    HG_Addr_to_string(
-        hg_class, self_addr_string, &self_addr_string_size, self_addr);
-    HG_Addr_free(hg_class, self_addr);
-    
+	hvac_comm_self_addr(hg_class, self_addr_string, PATH_MAX);
+	if (hg_sm_class != NULL)
+		hvac_comm_self_addr(hg_sm_class, sm_addr_string, PATH_MAX);
+	gethostname(host, sizeof(host));
+
 
     /* Write addr to a file */
     na_config = fopen(filename, "a+");
@@ -163,33 +203,63 @@ void hvac_comm_list_addr()
             filename);
         exit(0);
     }
-    fprintf(na_config, "%d %s\n", hvac_server_rank, self_addr_string);
+    fprintf(na_config, "%d %s %s %s\n", hvac_server_rank, self_addr_string, sm_addr_string, host);
     fclose(na_config);
 }
 
 
 
-/* callback triggered upon completion of bulk transfer */
-static hg_return_t
-hvac_rpc_handler_bulk_cb(const struct hg_cb_info *info)
+/* Rank 0 turns the posted addresses into the table clients load */
+void hvac_comm_publish_addrs(uint32_t server_count)
 {
-    struct hvac_rpc_state *hvac_rpc_state_p = (struct hvac_rpc_state*)info->arg;
-    int ret;
-    hvac_rpc_out_t out;
-    out.ret = hvac_rpc_state_p->size;
+	if (hvac_server_rank == 0)
+		hvac_bootstrap_publish(server_count);
+}
 
-    assert(info->ret == 0);
+/* Rank 0 takes both down again once the servers stop */
+void hvac_comm_unpublish_addrs()
+{
+	if (hvac_server_rank == 0)
+		hvac_bootstrap_unpublish();
+}
 
+/* Answers a read with ret bytes or -1 and cleans up after it. The client
+ * frees its buffer once it has this answer, never before. */
+static void
+hvac_rpc_handler_respond(struct hvac_rpc_state *hvac_rpc_state_p, ssize_t ret)
+{
+    hvac_rpc_out_t out;
+    out.ret = ret;
+    out.load = hvac_stats_load();
 
-    ret = HG_Respond(hvac_rpc_state_p->handle, NULL, NULL, &out);
-    assert(ret == HG_SUCCESS);        
+    if (HG_Respond(hvac_rpc_state_p->handle, NULL, NULL, &out) != HG_SUCCESS)
+        L4C_ERR("Server Rank %d : Failed to answer a read", server_rank);
 
     HG_Bulk_free(hvac_rpc_state_p->bulk_handle);
 	L4C_INFO("Info Server: Freeing Bulk Handle\n");
+    HG_Free_input(hvac_rpc_state_p->handle, &hvac_rpc_state_p->in);
     HG_Destroy(hvac_rpc_state_p->handle);
     free(hvac_rpc_state_p->buffer);
     free(hvac_rpc_state_p);
-    return (hg_return_t)0;
+    hvac_stats_rpc_end();
+}
+
+/* callback triggered upon completion of bulk transfer */
+static hg_return_t
+hvac_rpc_handler_bulk_cb(const struct hg_cb_info *info)
+{
+    struct hvac_rpc_state *hvac_rpc_state_p = (struct hvac_rpc_state*)info->arg;
+
+    /* A push that did not make it is a failed read, the client falls back */
+    if (info->ret != HG_SUCCESS)
+    {
+        L4C_ERR("Server Rank %d : Push of %lu bytes failed: %d", server_rank,
+                (unsigned long)hvac_rpc_state_p->size, (int)info->ret);
+        hvac_rpc_handler_respond(hvac_rpc_state_p, -1);
+    }
+    else
+        hvac_rpc_handler_respond(hvac_rpc_state_p, hvac_rpc_state_p->size);
+    return HG_SUCCESS;
 }
 
 
@@ -202,6 +272,7 @@ hvac_rpc_handler(hg_handle_t handle)
     const struct hg_info *hgi;
     ssize_t readbytes;
 
+    hvac_stats_rpc_begin();
     hvac_rpc_state_p = (struct hvac_rpc_state*)malloc(sizeof(*hvac_rpc_state_p));
 
     /* decode input */
@@ -223,41 +294,44 @@ hvac_rpc_handler(hg_handle_t handle)
         &hvac_rpc_state_p->bulk_handle);
     assert(ret == 0);
 
-    if (hvac_rpc_state_p->in.offset == -1){
-		auto start = std::chrono::high_resolution_clock::now();
-        readbytes = read(hvac_rpc_state_p->in.accessfd, hvac_rpc_state_p->buffer, hvac_rpc_state_p->size);
-        auto end = std::chrono::high_resolution_clock::now();
-		auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-
-    log_buffer.push_back({"read", duration});
-		L4C_DEBUG("Server Rank %d : Read %ld bytes from file %s", server_rank,readbytes, fd_to_path[hvac_rpc_state_p->in.accessfd].c_str());
-    }else
-    {	
-		auto start = std::chrono::high_resolution_clock::now();
-        readbytes = pread(hvac_rpc_state_p->in.accessfd, hvac_rpc_state_p->buffer, hvac_rpc_state_p->size, hvac_rpc_state_p->in.offset);
-        auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-
-    log_buffer.push_back({"pread", duration});
-		L4C_DEBUG("Server Rank %d : PRead %ld bytes from file %s at offset %ld", server_rank,readbytes, fd_to_path[hvac_rpc_state_p->in.accessfd].c_str(),hvac_rpc_state_p->in.offset );
+    /* Clients track the file position, every read is positional */
+    uint64_t t_start = hvac_trace_now();
+    uint64_t path_id = 0;
+    bool nvme = false;
+    int fd = hvac_open_cache_fd(hvac_rpc_state_p->in.accessfd, &path_id, &nvme);
+    readbytes = -1;
+    if (fd != -1){
+        readbytes = pread(fd, hvac_rpc_state_p->buffer, hvac_rpc_state_p->size, hvac_rpc_state_p->in.offset);
+        hvac_open_cache_release(hvac_rpc_state_p->in.accessfd, NULL);
+    }
+    uint64_t t_end = hvac_trace_now();
+    hvac_trace(HVAC_TRACE_READ, (nvme ? HVAC_TRACE_F_NVME : 0) | (readbytes == -1 ? HVAC_TRACE_F_ERROR : 0),
+               path_id, readbytes == -1 ? 0 : readbytes, t_start, t_end);
+    hvac_stats_record(HVAC_STAT_READ, t_end - t_start);
+    hvac_stats_read(nvme, readbytes);
+	L4C_DEBUG("Server Rank %d : PRead %ld bytes from handle %ld at offset %ld", server_rank,readbytes, hvac_rpc_state_p->in.accessfd,hvac_rpc_state_p->in.offset );
+
+    /* Nothing to push on a failed read or at EOF, tell the client so it
+     * can fall back or stop */
+    if (readbytes <= 0){
+        hvac_rpc_handler_respond(hvac_rpc_state_p, readbytes);
+        return HG_SUCCESS;
     }
-	if (log_buffer.size() >= 10) { // Example condition to flush buffer to file
-    	append_to_file(server_rank);
-	}
 
     //Reduce size of transfer to what was actually read 
     //We may need to revisit this.
-	if(readbytes != -1){
-    	hvac_rpc_state_p->size = readbytes;
-	}
+    hvac_rpc_state_p->size = readbytes;
     /* initiate bulk transfer from client to server */
     ret = HG_Bulk_transfer(hgi->context, hvac_rpc_handler_bulk_cb, hvac_rpc_state_p,
         HG_BULK_PUSH, hgi->addr, hvac_rpc_state_p->in.bulk_handle, 0,
         hvac_rpc_state_p->bulk_handle, 0, hvac_rpc_state_p->size, HG_OP_ID_IGNORE);
-    assert(ret == 0);
-    (void) ret;
+    if (ret != HG_SUCCESS)
+    {
+        L4C_ERR("Server Rank %d : Failed to start a push: %d", server_rank, ret);
+        hvac_rpc_handler_respond(hvac_rpc_state_p, -1);
+    }
 
-    return (hg_return_t)ret;
+    return HG_SUCCESS;
 }
 
 
@@ -268,29 +342,41 @@ hvac_open_rpc_handler(hg_handle_t handle)
 {
     hvac_open_in_t in;
     hvac_open_out_t out;    
+    hvac_stats_rpc_begin();
     int ret = HG_Get_input(handle, &in);
     assert(ret == 0);
     string redir_path = in.path;
+    uint16_t flags = 0;
 
+    pthread_mutex_lock(&data_mutex);
     if (path_cache_map.find(redir_path) != path_cache_map.end())
     {
         L4C_INFO("Server Rank %d : Successful Redirection %s to %s", server_rank, redir_path.c_str(), path_cache_map[redir_path].c_str());
         redir_path = path_cache_map[redir_path];
-    	log_buffer.push_back({"redirect", 0});
+        flags |= HVAC_TRACE_F_NVME;
     }
+    pthread_mutex_unlock(&data_mutex);
     L4C_INFO("Server Rank %d : Successful Open %s", server_rank, in.path);    
-	 auto start = std::chrono::high_resolution_clock::now();
-    out.ret_status = open(redir_path.c_str(),O_RDONLY); 
-	auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
-
-    log_buffer.push_back({"open", duration});
-	
-	 if (log_buffer.size() >= 10) { // Example condition to flush buffer to file
-         append_to_file(server_rank);
-     } 
-    fd_to_path[out.ret_status] = in.path;  
+    uint64_t t_start = hvac_trace_now();
+    /* Shared across clients and epochs, clients get an opaque handle.
+     * The file size comes back so clients answer SEEK_END locally. */
+    out.ret_status = hvac_open_cache_acquire(in.path, redir_path, &out.file_size);
+    uint64_t t_end = hvac_trace_now();
+    bool bcast;
+    out.replicas = hvac_replica_open(in.path, &bcast);
+    out.bcast = bcast;
+    out.load = hvac_stats_load();
+    out.redirect = hvac_peer_redirect(in.path);
+    if (out.ret_status < 0)
+        flags |= HVAC_TRACE_F_ERROR;
+    else
+        hvac_stats_open(flags & HVAC_TRACE_F_NVME);
+    hvac_trace(HVAC_TRACE_OPEN, flags, hvac_trace_path_id(in.path), 0, t_start, t_end);
+    hvac_stats_record(HVAC_STAT_OPEN, t_end - t_start);
     HG_Respond(handle,NULL,NULL,&out);
+    HG_Free_input(handle, &in);
+    HG_Destroy(handle);
+    hvac_stats_rpc_end();
 
     return (hg_return_t)ret;
 
@@ -300,51 +386,213 @@ static hg_return_t
 hvac_close_rpc_handler(hg_handle_t handle)
 {
     hvac_close_in_t in;
+    hvac_stats_rpc_begin();
     int ret = HG_Get_input(handle, &in);
     assert(ret == HG_SUCCESS);
 
-    L4C_INFO("Closing File %d\n",in.fd);
-	auto start = std::chrono::high_resolution_clock::now();
-    ret = close(in.fd);
-	auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    L4C_INFO("Closing File %ld\n",in.fd);
+    string path;
+    uint64_t t_start = hvac_trace_now();
+    /* Only drops the reference, the fd stays cached for the next open */
+    bool valid = hvac_open_cache_release(in.fd, &path);
+    uint64_t t_end = hvac_trace_now();
+    hvac_trace(HVAC_TRACE_CLOSE, valid ? 0 : HVAC_TRACE_F_ERROR,
+               valid ? hvac_trace_path_id(path) : 0, 0, t_start, t_end);
+    hvac_stats_record(HVAC_STAT_CLOSE, t_end - t_start);
+
+    //Signal to the data mover to copy the file - once
+    if (valid)
+        hvac_data_mover_queue(path);
+
+    HG_Free_input(handle, &in);
+    HG_Destroy(handle);
+    hvac_stats_rpc_end();
+    return (hg_return_t)ret;
+}
 
-    log_buffer.push_back({"close", duration});
-    assert(ret == 0);
-	
-	 if (log_buffer.size() >= 10) { // Example condition to flush buffer to file
-         append_to_file(server_rank);
-     }
+static hg_return_t
+hvac_stats_rpc_handler(hg_handle_t handle)
+{
+    /* Too big for the handler stack frame with all the histograms */
+    hvac_stats_out_t *out = (hvac_stats_out_t *)malloc(sizeof(*out));
+    assert(out);
+
+    hvac_stats_snapshot(out);
+    int ret = HG_Respond(handle, NULL, NULL, out);
+    HG_Destroy(handle);
+    free(out);
+    return (hg_return_t)ret;
+}
 
-    //Signal to the data mover to copy the file
-    if (path_cache_map.find(fd_to_path[in.fd]) == path_cache_map.end())
-    {
-        L4C_INFO("Caching %s",fd_to_path[in.fd].c_str());
-        pthread_mutex_lock(&data_mutex);
-        pthread_cond_signal(&data_cond);
-        data_queue.push(fd_to_path[in.fd]);
-        pthread_mutex_unlock(&data_mutex);
-    }
+/* The home server of a hot file asks us to hold a copy as well */
+static hg_return_t
+hvac_replicate_rpc_handler(hg_handle_t handle)
+{
+    hvac_replicate_in_t in;
+    int ret = HG_Get_input(handle, &in);
+    assert(ret == HG_SUCCESS);
+
+    L4C_INFO("Server Rank %d : Replicating %s", server_rank, in.path);
+    hvac_data_mover_queue(in.path);
 
-	fd_to_path.erase(in.fd);
+    HG_Free_input(handle, &in);
+    HG_Destroy(handle);
     return (hg_return_t)ret;
 }
 
+/* Our parent in a broadcast tree has the file, copy it and pass it on */
 static hg_return_t
-hvac_seek_rpc_handler(hg_handle_t handle)
+hvac_bcast_rpc_handler(hg_handle_t handle)
 {
-    hvac_seek_in_t in;
-    hvac_seek_out_t out;    
+    hvac_bcast_in_t in;
     int ret = HG_Get_input(handle, &in);
-    assert(ret == 0);
+    assert(ret == HG_SUCCESS);
 
-    out.ret = lseek64(in.fd, in.offset, in.whence);
-
-    HG_Respond(handle,NULL,NULL,&out);
+    L4C_INFO("Server Rank %d : Broadcast of %s from %d", server_rank, in.path, in.parent);
+    hvac_replica_bcast(in.path, in.root, in.parent);
 
+    HG_Free_input(handle, &in);
+    HG_Destroy(handle);
     return (hg_return_t)ret;
 }
 
+/* State of a push to a peer, the input holds the peer's bulk handle and is
+ * kept until the transfer is done */
+struct hvac_push_state {
+    hg_handle_t handle;
+    void *in;
+    void *buffer;
+    hg_size_t size;
+    hg_bulk_t bulk_handle;
+};
+
+static void hvac_push_respond(hg_handle_t handle, int32_t ret)
+{
+    hvac_rpc_out_t out;
+    out.ret = ret;
+    out.load = hvac_stats_load();
+    HG_Respond(handle, NULL, NULL, &out);
+}
+
+static hg_return_t
+hvac_push_cb(const struct hg_cb_info *info)
+{
+    struct hvac_push_state *push = (struct hvac_push_state *)info->arg;
+
+    hvac_push_respond(push->handle, info->ret == HG_SUCCESS ? (int32_t)push->size : -1);
+    HG_Bulk_free(push->bulk_handle);
+    HG_Free_input(push->handle, push->in);
+    HG_Destroy(push->handle);
+    free(push->in);
+    free(push->buffer);
+    free(push);
+    return HG_SUCCESS;
+}
+
+/* Pushes size bytes of buffer to remote and answers with size. Takes over
+ * in and buffer, answers -1 right away if the transfer cannot start. */
+static hg_return_t hvac_push(hg_handle_t handle, void *in, hg_bulk_t remote, void *buffer, hg_size_t size)
+{
+    const struct hg_info *hgi = HG_Get_info(handle);
+    struct hvac_push_state *push = (struct hvac_push_state *)malloc(sizeof(*push));
+    hg_return_t ret;
+
+    push->handle = handle;
+    push->in = in;
+    push->buffer = buffer;
+    push->size = size;
+    ret = HG_Bulk_create(hgi->hg_class, 1, &push->buffer, &push->size, HG_BULK_READ_ONLY,
+                         &push->bulk_handle);
+    if (ret == HG_SUCCESS)
+    {
+        ret = HG_Bulk_transfer(hgi->context, hvac_push_cb, push, HG_BULK_PUSH, hgi->addr, remote, 0,
+                               push->bulk_handle, 0, size, HG_OP_ID_IGNORE);
+        if (ret == HG_SUCCESS)
+            return ret;
+        HG_Bulk_free(push->bulk_handle);
+    }
+    hvac_push_respond(handle, -1);
+    HG_Free_input(handle, in);
+    HG_Destroy(handle);
+    free(in);
+    free(buffer);
+    free(push);
+    return ret;
+}
+
+/* A peer missed on a file we hold, it gets one chunk of our NVMe copy.
+ * Only the NVMe copy counts, the peer reads the PFS itself otherwise. */
+static hg_return_t
+hvac_fetch_rpc_handler(hg_handle_t handle)
+{
+    hvac_fetch_in_t *in = (hvac_fetch_in_t *)malloc(sizeof(*in));
+    int ret = HG_Get_input(handle, in);
+    assert(ret == HG_SUCCESS);
+
+    string nvme_path;
+    pthread_mutex_lock(&data_mutex);
+    auto it = path_cache_map.find(in->path);
+    if (it != path_cache_map.end())
+        nvme_path = it->second;
+    pthread_mutex_unlock(&data_mutex);
+
+    ssize_t bytes = -1;
+    size_t size = in->size < HVAC_PEER_CHUNK ? in->size : HVAC_PEER_CHUNK;
+    void *buffer = malloc(size);
+    int fd = nvme_path.empty() ? -1 : open(nvme_path.c_str(), O_RDONLY);
+    if (fd != -1 && buffer != NULL)
+    {
+        bytes = pread(fd, buffer, size, in->offset);
+        close(fd);
+    }
+    else if (fd != -1)
+        close(fd);
+    L4C_INFO("Server Rank %d : Peer fetch of %s at %ld, %ld bytes", server_rank, in->path,
+             (long)in->offset, (long)bytes);
+
+    if (bytes < 0)
+    {
+        hvac_push_respond(handle, -1);
+        HG_Free_input(handle, in);
+        HG_Destroy(handle);
+        free(in);
+        free(buffer);
+        return HG_SUCCESS;
+    }
+    hvac_stats_read(true, bytes);
+    return hvac_push(handle, in, in->bulk_handle, buffer, bytes);
+}
+
+/* A peer pulls our bloom filter, nothing is pushed if it is current */
+static hg_return_t
+hvac_bloom_rpc_handler(hg_handle_t handle)
+{
+    hvac_bloom_in_t *in = (hvac_bloom_in_t *)malloc(sizeof(*in));
+    int ret = HG_Get_input(handle, in);
+    assert(ret == HG_SUCCESS);
+
+    void *buffer = malloc(in->size);
+    size_t bytes = buffer ? hvac_peer_filter_copy(in->generation, buffer, in->size) : 0;
+    if (bytes == 0)
+    {
+        hvac_push_respond(handle, 0);
+        HG_Free_input(handle, in);
+        HG_Destroy(handle);
+        free(in);
+        free(buffer);
+        return HG_SUCCESS;
+    }
+    return hvac_push(handle, in, in->bulk_handle, buffer, bytes);
+}
+
+/* Answers right away, clients use it to set up connections ahead of time */
+static hg_return_t
+hvac_ping_rpc_handler(hg_handle_t handle)
+{
+    int ret = HG_Respond(handle, NULL, NULL, NULL);
+    HG_Destroy(handle);
+    return (hg_return_t)ret;
+}
 
 /* register this particular rpc type with Mercury */
 hg_id_t
@@ -354,6 +602,9 @@ hvac_rpc_register(void)
 
     tmp = MERCURY_REGISTER(
         hg_class, "hvac_base_rpc", hvac_rpc_in_t, hvac_rpc_out_t, hvac_rpc_handler);
+    /* Ids are derived from the name, so they match across classes */
+    if (hg_sm_class != NULL)
+        MERCURY_REGISTER(hg_sm_class, "hvac_base_rpc", hvac_rpc_in_t, hvac_rpc_out_t, hvac_rpc_handler);
 
     return tmp;
 }
@@ -365,6 +616,9 @@ hvac_open_rpc_register(void)
 
     tmp = MERCURY_REGISTER(
         hg_class, "hvac_open_rpc", hvac_open_in_t, hvac_open_out_t, hvac_open_rpc_handler);
+    /* Ids are derived from the name, so they match across classes */
+    if (hg_sm_class != NULL)
+        MERCURY_REGISTER(hg_sm_class, "hvac_open_rpc", hvac_open_in_t, hvac_open_out_t, hvac_open_rpc_handler);
 
     return tmp;
 }
@@ -382,37 +636,135 @@ hvac_close_rpc_register(void)
                                            HG_TRUE);                        
     assert(ret == HG_SUCCESS);
 
+    if (hg_sm_class != NULL)
+    {
+        MERCURY_REGISTER(hg_sm_class, "hvac_close_rpc", hvac_close_in_t, void, hvac_close_rpc_handler);
+        ret = HG_Registered_disable_response(hg_sm_class, tmp, HG_TRUE);
+        assert(ret == HG_SUCCESS);
+    }
+
+    return tmp;
+}
+
+hg_id_t
+hvac_stats_rpc_register(void)
+{
+    hg_id_t tmp;
+
+    tmp = MERCURY_REGISTER(
+        hg_class, "hvac_stats_rpc", void, hvac_stats_out_t, hvac_stats_rpc_handler);
+    /* Ids are derived from the name, so they match across classes */
+    if (hg_sm_class != NULL)
+        MERCURY_REGISTER(hg_sm_class, "hvac_stats_rpc", void, hvac_stats_out_t, hvac_stats_rpc_handler);
+
+    return tmp;
+}
+
+hg_id_t
+hvac_ping_rpc_register(void)
+{
+    hg_id_t tmp;
+
+    tmp = MERCURY_REGISTER(
+        hg_class, "hvac_ping_rpc", void, void, hvac_ping_rpc_handler);
+    if (hg_sm_class != NULL)
+        MERCURY_REGISTER(hg_sm_class, "hvac_ping_rpc", void, void, hvac_ping_rpc_handler);
+
     return tmp;
 }
 
-/* register this particular rpc type with Mercury */
 hg_id_t
-hvac_seek_rpc_register(void)
+hvac_replicate_rpc_register(void)
 {
     hg_id_t tmp;
 
     tmp = MERCURY_REGISTER(
-        hg_class, "hvac_seek_rpc", hvac_seek_in_t, hvac_seek_out_t, hvac_seek_rpc_handler);
+        hg_class, "hvac_replicate_rpc", hvac_replicate_in_t, void, hvac_replicate_rpc_handler);
+    int ret = HG_Registered_disable_response(hg_class, tmp, HG_TRUE);
+    assert(ret == HG_SUCCESS);
+
+    if (hg_sm_class != NULL)
+    {
+        MERCURY_REGISTER(hg_sm_class, "hvac_replicate_rpc", hvac_replicate_in_t, void, hvac_replicate_rpc_handler);
+        ret = HG_Registered_disable_response(hg_sm_class, tmp, HG_TRUE);
+        assert(ret == HG_SUCCESS);
+    }
 
     return tmp;
 }
 
-/* Create context even for client */
+hg_id_t
+hvac_bcast_rpc_register(void)
+{
+    hg_id_t tmp;
+
+    tmp = MERCURY_REGISTER(
+        hg_class, "hvac_bcast_rpc", hvac_bcast_in_t, void, hvac_bcast_rpc_handler);
+    int ret = HG_Registered_disable_response(hg_class, tmp, HG_TRUE);
+    assert(ret == HG_SUCCESS);
+
+    if (hg_sm_class != NULL)
+    {
+        MERCURY_REGISTER(hg_sm_class, "hvac_bcast_rpc", hvac_bcast_in_t, void, hvac_bcast_rpc_handler);
+        ret = HG_Registered_disable_response(hg_sm_class, tmp, HG_TRUE);
+        assert(ret == HG_SUCCESS);
+    }
+
+    return tmp;
+}
+
+hg_id_t
+hvac_fetch_rpc_register(void)
+{
+    hg_id_t tmp;
+
+    tmp = MERCURY_REGISTER(
+        hg_class, "hvac_fetch_rpc", hvac_fetch_in_t, hvac_rpc_out_t, hvac_fetch_rpc_handler);
+    if (hg_sm_class != NULL)
+        MERCURY_REGISTER(hg_sm_class, "hvac_fetch_rpc", hvac_fetch_in_t, hvac_rpc_out_t, hvac_fetch_rpc_handler);
+
+    return tmp;
+}
+
+hg_id_t
+hvac_bloom_rpc_register(void)
+{
+    hg_id_t tmp;
+
+    tmp = MERCURY_REGISTER(
+        hg_class, "hvac_bloom_rpc", hvac_bloom_in_t, hvac_rpc_out_t, hvac_bloom_rpc_handler);
+    if (hg_sm_class != NULL)
+        MERCURY_REGISTER(hg_sm_class, "hvac_bloom_rpc", hvac_bloom_in_t, hvac_rpc_out_t, hvac_bloom_rpc_handler);
+
+    return tmp;
+}
+
+/* Create context even for client, addr must come from context's class */
 void
-hvac_comm_create_handle(hg_addr_t addr, hg_id_t id, hg_handle_t *handle)
+hvac_comm_create_handle(hg_context_t *context, hg_addr_t addr, hg_id_t id, hg_handle_t *handle)
 {    
-    hg_return_t ret = HG_Create(hg_context, addr, id, handle);
+    hg_return_t ret = HG_Create(context, addr, id, handle);
     assert(ret==HG_SUCCESS);    
 }
 
 /*Free the addr */
 void 
-hvac_comm_free_addr(hg_addr_t addr)
+hvac_comm_free_addr(hg_context_t *context, hg_addr_t addr)
 {
-    hg_return_t ret = HG_Addr_free(hg_class,addr);
+    hg_return_t ret = HG_Addr_free(HG_Context_get_class(context),addr);
     assert(ret==HG_SUCCESS);
 }
 
+/* In a forked child, drop the parent's state without finalizing it */
+void hvac_comm_forget()
+{
+    hg_class = NULL;
+    hg_context = NULL;
+    hg_sm_class = NULL;
+    hg_sm_context = NULL;
+    hvac_progress_thread_shutdown_flags = 0;
+}
+
 hg_class_t *hvac_comm_get_class()
 {
     return hg_class;
@@ -422,3 +774,8 @@ hg_context_t *hvac_comm_get_context()
 {
     return hg_context;
 }
+
+hg_context_t *hvac_comm_get_sm_context()
+{
+    return hg_sm_context;
+}
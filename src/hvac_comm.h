@@ -8,49 +8,100 @@ extern "C" {
 }
 
 #include <string>
+#include <sys/uio.h>
+#include "hvac_stats.h"
 using namespace std;
 /* visible API for example RPC operation */
 
 //RPC Open Handler
-MERCURY_GEN_PROC(hvac_open_out_t, ((int32_t)(ret_status)))
-MERCURY_GEN_PROC(hvac_open_in_t, ((hg_string_t)(path)))
+//ret_status, accessfd and fd carry opaque server handles, not raw fds
+//replicas is the size of the file's replica set, see hvac_replica.h
+//load is the server's load word, see hvac_stats.h
+//redirect is the peer holding the home server's spilled copy or -1, see hvac_peer.h
+//bcast flags a file every rank reads, see hvac_replica.h
+//The client inputs name the target server in server, only the node
+//aggregator looks at it, see hvac_aggregator.cpp
+MERCURY_GEN_PROC(hvac_open_out_t, ((int64_t)(ret_status))((int64_t)(file_size))((uint32_t)(replicas))((uint32_t)(load))((int32_t)(redirect))((uint32_t)(bcast)))
+MERCURY_GEN_PROC(hvac_open_in_t, ((hg_string_t)(path))((int32_t)(server)))
 
 //BULK Read Handler
-MERCURY_GEN_PROC(hvac_rpc_out_t, ((int32_t)(ret)))
-MERCURY_GEN_PROC(hvac_rpc_in_t, ((int32_t)(input_val))((hg_bulk_t)(bulk_handle))((int32_t)(accessfd))((int64_t)(offset)))
-
-//RPC Seek Handler
-MERCURY_GEN_PROC(hvac_seek_out_t, ((int32_t)(ret)))
-MERCURY_GEN_PROC(hvac_seek_in_t, ((int32_t)(fd))((int32_t)(offset))((int32_t)(whence)))
+MERCURY_GEN_PROC(hvac_rpc_out_t, ((int32_t)(ret))((uint32_t)(load)))
+MERCURY_GEN_PROC(hvac_rpc_in_t, ((int32_t)(input_val))((hg_bulk_t)(bulk_handle))((int64_t)(accessfd))((int64_t)(offset))((int32_t)(server)))
 
 
 //Close Handler input arg
-MERCURY_GEN_PROC(hvac_close_in_t, ((int32_t)(fd)))
+MERCURY_GEN_PROC(hvac_close_in_t, ((int64_t)(fd))((int32_t)(server)))
+
+//Replicate Handler input, one way
+MERCURY_GEN_PROC(hvac_replicate_in_t, ((hg_string_t)(path)))
+
+//Broadcast Handler input, one way. parent has the file on its NVMe
+MERCURY_GEN_PROC(hvac_bcast_in_t, ((hg_string_t)(path))((int32_t)(root))((int32_t)(parent)))
+
+//Peer fill, see hvac_peer.h. Both push into bulk_handle and answer with
+//hvac_rpc_out_t, ret is the bytes pushed or -1
+MERCURY_GEN_PROC(hvac_fetch_in_t, ((hg_string_t)(path))((int64_t)(offset))((uint64_t)(size))((hg_bulk_t)(bulk_handle)))
+MERCURY_GEN_PROC(hvac_bloom_in_t, ((uint64_t)(generation))((uint64_t)(size))((hg_bulk_t)(bulk_handle)))
+
+//Stats Handler output, a fixed size struct sent as raw bytes
+typedef struct hvac_server_stats hvac_stats_out_t;
+static inline hg_return_t hg_proc_hvac_stats_out_t(hg_proc_t proc, void *data)
+{
+    return hg_proc_raw(proc, data, sizeof(hvac_stats_out_t));
+}
 
 
-//General
-void hvac_init_comm(hg_bool_t listen);
+//General, transport overrides HVAC_TRANSPORT
+void hvac_init_comm(hg_bool_t listen, const char *transport = NULL);
 void *hvac_progress_fn(void *args);
 void hvac_comm_list_addr();
-void hvac_comm_create_handle(hg_addr_t addr, hg_id_t id, hg_handle_t *handle);
+void hvac_comm_publish_addrs(uint32_t server_count);
+void hvac_comm_unpublish_addrs();
+void hvac_comm_create_handle(hg_context_t *context, hg_addr_t addr, hg_id_t id, hg_handle_t *handle);
 void hvac_shutdown_comm();
-void hvac_comm_free_addr(hg_addr_t addr);
+void hvac_comm_free_addr(hg_context_t *context, hg_addr_t addr);
+void hvac_comm_forget();
 
 //Retrieve the static variables
 hg_class_t *hvac_comm_get_class();
 hg_context_t *hvac_comm_get_context();
+//NULL unless na+sm is up
+hg_context_t *hvac_comm_get_sm_context();
 
 
 //Client
-void hvac_client_comm_gen_seek_rpc(uint32_t svr_hash, int fd, int offset, int whence);
-void hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int localfd, void* buffer, ssize_t count, off_t offset);
-void hvac_client_comm_gen_open_rpc(uint32_t svr_hash, string path, int fd);
-void hvac_client_comm_gen_close_rpc(uint32_t svr_hash, int fd);
-hg_addr_t hvac_client_comm_lookup_addr(int rank);
+void hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int64_t remote_fd, void* buffer, ssize_t count, off_t offset);
+void hvac_client_comm_gen_readv_rpc(uint32_t svr_hash, int64_t remote_fd, const struct iovec *iov, int iovcnt, off_t offset);
+void hvac_client_comm_gen_open_rpc(uint32_t svr_hash, string path, int64_t *remote_fd, int64_t *file_size,
+                                   uint32_t *replicas = NULL, int32_t *redirect = NULL, uint32_t *bcast = NULL);
+void hvac_client_comm_gen_close_rpc(uint32_t svr_hash, int64_t remote_fd);
+int hvac_client_comm_gen_stats_rpc(uint32_t svr_hash, hvac_stats_out_t *stats);
+hg_addr_t hvac_client_comm_lookup_addr(int rank, hg_context_t **context);
+int hvac_client_comm_node_server();
+bool hvac_client_comm_server_local(uint32_t server);
+//Node aggregator, see hvac_aggregator.cpp. find reads its address before
+//Mercury is up, all RPCs then go through it over na+sm. used tells whether
+//it was reached once the addresses are loaded.
+#define HVAC_AGGREGATOR_FILE "/dev/shm/hvac_agg.%s"
+bool hvac_client_comm_aggregator_find();
+bool hvac_client_comm_aggregator_used();
+void hvac_client_comm_ids(hg_id_t *open_id, hg_id_t *read_id, hg_id_t *close_id);
+//Decaying per-server load view fed by the responses, expected wait in us
+void hvac_client_load_init(uint32_t servers);
+uint64_t hvac_client_load_wait(uint32_t server);
+void hvac_client_comm_load_addrs();
+void hvac_client_comm_ping_all();
+void hvac_client_comm_atfork_prepare();
+void hvac_client_comm_atfork_parent();
+void hvac_client_comm_atfork_child();
 void hvac_client_comm_register_rpc();
 void hvac_client_block();
 ssize_t hvac_read_block();
-ssize_t hvac_seek_block();
+//Hedged reads, see hvac_comm_client.cpp
+bool hvac_client_comm_gen_hedge_rpc(uint32_t svr_hash, int64_t remote_fd, const struct iovec *iov, int iovcnt, off_t offset);
+bool hvac_read_hedge_wait();
+ssize_t hvac_read_block_first();
+void hvac_read_abandon();
 
 
 
@@ -58,6 +109,11 @@ ssize_t hvac_seek_block();
 hg_id_t hvac_rpc_register(void);
 hg_id_t hvac_open_rpc_register(void);
 hg_id_t hvac_close_rpc_register(void);
-hg_id_t hvac_seek_rpc_register(void);
+hg_id_t hvac_stats_rpc_register(void);
+hg_id_t hvac_ping_rpc_register(void);
+hg_id_t hvac_replicate_rpc_register(void);
+hg_id_t hvac_bcast_rpc_register(void);
+hg_id_t hvac_fetch_rpc_register(void);
+hg_id_t hvac_bloom_rpc_register(void);
 #endif
 
@@ -2,67 +2,447 @@
 #include <string>
 #include <iostream>
 #include <map>	
+#include <vector>
+#include <atomic>
+#include <climits>
+#include <algorithm>
+#include <cstring>
 
 #include "hvac_comm.h"
 #include "hvac_data_mover_internal.h"
+#include "hvac_bootstrap.h"
 
 extern "C" {
 #include "hvac_logging.h"
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <cassert>
 #include <unistd.h>
 }
 
-/* RPC Block Constructs */
-static hg_bool_t done = HG_FALSE;
-static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* RPC Block Constructs
+ * Each calling thread blocks on its own completion so that threads issuing
+ * RPCs at the same time do not consume each other's results. Slot 0 is the
+ * request, slot 1 a hedged duplicate of a read. The slot holds a reference
+ * on the handle until the caller has the result, so a late HG_Cancel never
+ * races the callback's HG_Destroy.
+ *
+ * Reads are never cancelled, a cancel does not stop a push the server has
+ * already started. A read the caller gives up on, past its deadline or
+ * beaten by its hedge, is abandoned instead: its callback returns the
+ * bounce buffer the server pushes into once the server has answered. Only
+ * reads of up to HVAC_BOUNCE_SIZE bytes that find a free buffer in the pool
+ * can be given up on, every other read registers the caller's iovec and is
+ * waited for until the server answers.
+ */
+#define HVAC_RPC_SLOT 0
+#define HVAC_HEDGE_SLOT 1
+
+struct hvac_rpc_state;
+struct hvac_rpc_slot {
+    hg_bool_t done;
+    ssize_t ret;
+    hg_handle_t handle;
+    /* The read behind the slot, NULL for other RPCs */
+    struct hvac_rpc_state *read;
+};
+struct hvac_rpc_wait {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct hvac_rpc_slot slot[2];
+};
+static __thread struct hvac_rpc_wait tl_rpc_wait = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    { { HG_TRUE, -1, HG_HANDLE_NULL, NULL }, { HG_TRUE, -1, HG_HANDLE_NULL, NULL } } };
+
+/* Bounce buffers, at most HVAC_BOUNCE_POOL of them allocated */
+#define HVAC_BOUNCE_SIZE (1 << 20)
+#define HVAC_BOUNCE_POOL 64
+static pthread_mutex_t bounce_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<void *> bounce_free;
+static unsigned bounce_allocated = 0;
+
+/* Who a read belongs to, decided once by whichever of the caller and the
+ * callback gets there first */
+#define HVAC_READ_WAITING 0
+#define HVAC_READ_DONE 1
+#define HVAC_READ_ABANDONED 2
+
+/* Deadlines and hedging, set at registration
+ *   HVAC_RPC_TIMEOUT_MS    an RPC still unanswered after this is cancelled and
+ *                          the caller falls back to the PFS (10000), 0 waits forever.
+ *                          A read the server pushes straight into the caller's
+ *                          buffers is waited for regardless, see below.
+ *   HVAC_HEDGE_PERCENTILE  a read slower than this percentile of recent reads
+ *                          gets a duplicate (95), 0 disables hedging
+ *   HVAC_HEDGE_MIN_US      never hedge before this many microseconds (500)
+ * The percentile comes from the last HVAC_HEDGE_WINDOW completed reads and
+ * at most HVAC_HEDGE_BUDGET_PCT percent of reads are hedged, so a slow
+ * cluster is not made slower by duplicates.
+ */
+#define HVAC_HEDGE_WINDOW 1024
+#define HVAC_HEDGE_BUDGET_PCT 5
+
+static uint64_t rpc_timeout_us = 10000000;
+static double hedge_quantile = 0.95;
+static uint64_t hedge_min_us = 500;
+static struct hvac_histogram hedge_lat;
+static std::atomic<uint64_t> hedge_samples(0);
+static std::atomic<uint64_t> hedge_delay_us(0);
+static std::atomic<uint64_t> hedge_reads(0);
+static std::atomic<uint64_t> hedge_sent(0);
 
 /* RPC Globals */
 static hg_id_t hvac_client_rpc_id;
 static hg_id_t hvac_client_open_id;
 static hg_id_t hvac_client_close_id;
-static hg_id_t hvac_client_seek_id;
-ssize_t read_ret = -1;
+static hg_id_t hvac_client_stats_id;
+static hg_id_t hvac_client_ping_id;
+
+/* Mercury Data Caching
+ * local is set when the server shares our host, sm when it does and the
+ * address is its na+sm one. resolved is filled in by the lookups issued at
+ * load time. */
+struct hvac_server_addr {
+    std::string addr;
+    bool local;
+    bool sm;
+    hg_addr_t resolved;
+};
+std::map<int, hvac_server_addr> address_cache;
+static pthread_mutex_t address_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Node aggregator address, empty when we talk to the servers ourselves.
+ * Every rank then resolves to aggregator_resolved. */
+static std::string aggregator_addr;
+static hg_addr_t aggregator_resolved = HG_ADDR_NULL;
+
+/* Per-server load view. Each response replaces a decayed copy of the
+ * previous estimate by a 1/4 weighted average with the new one. Without
+ * responses the estimate halves every HVAC_LOAD_HALFLIFE_NS, so a server we
+ * backed off from is tried again once it had time to drain. */
+#define HVAC_LOAD_HALFLIFE_NS 250000000ULL
+struct hvac_server_load {
+    std::atomic<uint64_t> wait_us;
+    std::atomic<uint64_t> stamp_ns;
+};
+static hvac_server_load *load_view = NULL;
+static uint32_t load_view_size = 0;
+
+static uint64_t hvac_load_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t hvac_load_decayed(hvac_server_load *view, uint64_t now)
+{
+    uint64_t age = now - view->stamp_ns.load(std::memory_order_relaxed);
+    uint64_t halvings = age / HVAC_LOAD_HALFLIFE_NS;
+    return halvings >= 64 ? 0 : view->wait_us.load(std::memory_order_relaxed) >> halvings;
+}
 
-/* Mercury Data Caching */
-std::map<int, std::string> address_cache;
-extern std::map<int, int > fd_redir_map;
+void hvac_client_load_init(uint32_t servers)
+{
+    if (load_view != NULL || servers == 0)
+        return;
+    load_view = new hvac_server_load[servers];
+    for (uint32_t i = 0; i < servers; i++)
+    {
+        load_view[i].wait_us.store(0);
+        load_view[i].stamp_ns.store(0);
+    }
+    load_view_size = servers;
+}
+
+uint64_t hvac_client_load_wait(uint32_t server)
+{
+    if (server >= load_view_size)
+        return 0;
+    return hvac_load_decayed(&load_view[server], hvac_load_now());
+}
 
-/* struct used to carry state of overall operation across callbacks */
+static void hvac_client_load_update(uint32_t server, uint32_t load)
+{
+    if (server >= load_view_size)
+        return;
+    hvac_server_load *view = &load_view[server];
+    uint64_t now = hvac_load_now();
+    uint64_t old = hvac_load_decayed(view, now);
+    uint64_t sample = hvac_load_wait_us(load);
+    /* Racing updates may lose a sample, the view is a hint */
+    view->wait_us.store(old - old / 4 + sample / 4, std::memory_order_relaxed);
+    view->stamp_ns.store(now, std::memory_order_relaxed);
+}
+
+/* struct used to carry state of overall operation across callbacks.
+ * buffer is the bounce buffer the server pushes into, NULL when the bulk
+ * handle describes iov directly. */
 struct hvac_rpc_state {
     uint32_t value;
+    uint32_t server;
+    int slot;
+    uint64_t start_ns;
     hg_size_t size;
     void *buffer;
     hg_bulk_t bulk_handle;
     hg_handle_t handle;
+    struct hvac_rpc_wait *wait;
+    const struct iovec *iov;
+    int iovcnt;
+    int owner;
+};
+
+struct hvac_stats_state{
+    hvac_stats_out_t *stats;
+    struct hvac_rpc_wait *wait;
 };
 
 // Carry CB Information for CB
 struct hvac_open_state{
-    uint32_t local_fd;
+    uint32_t server;
+    int64_t *remote_fd;
+    int64_t *file_size;
+    uint32_t *replicas;
+    int32_t *redirect;
+    uint32_t *bcast;
+    struct hvac_rpc_wait *wait;
 };
 
-static hg_return_t
-hvac_seek_cb(const struct hg_cb_info *info)
+/* A buffer for a read of size bytes, NULL if it is too large or the pool
+ * is used up */
+static void *hvac_bounce_get(hg_size_t size)
 {
-    hvac_seek_out_t out;
-    ssize_t bytes_read = -1;
+    void *buffer = NULL;
+
+    if (size > HVAC_BOUNCE_SIZE)
+        return NULL;
+    pthread_mutex_lock(&bounce_mutex);
+    if (!bounce_free.empty())
+    {
+        buffer = bounce_free.back();
+        bounce_free.pop_back();
+    }
+    else if (bounce_allocated < HVAC_BOUNCE_POOL && (buffer = malloc(HVAC_BOUNCE_SIZE)) != NULL)
+    {
+        /* Returning a buffer never allocates */
+        if (bounce_allocated++ == 0)
+            bounce_free.reserve(HVAC_BOUNCE_POOL);
+    }
+    pthread_mutex_unlock(&bounce_mutex);
+    return buffer;
+}
 
+static void hvac_bounce_put(void *buffer)
+{
+    if (buffer == NULL)
+        return;
+    pthread_mutex_lock(&bounce_mutex);
+    bounce_free.push_back(buffer);
+    pthread_mutex_unlock(&bounce_mutex);
+}
 
-    HG_Get_output(info->info.forward.handle, &out);    
-    //Set the SEEK OUTPUT
-    bytes_read = out.ret;
-    HG_Free_output(info->info.forward.handle, &out);
-    HG_Destroy(info->info.forward.handle);
+/* A request that could not be sent, the caller sees -1 */
+static void hvac_rpc_wait_fail(struct hvac_rpc_wait *wait, int slot)
+{
+    pthread_mutex_lock(&wait->mutex);
+    wait->slot[slot].done = HG_TRUE;
+    wait->slot[slot].ret = -1;
+    wait->slot[slot].handle = HG_HANDLE_NULL;
+    wait->slot[slot].read = NULL;
+    pthread_mutex_unlock(&wait->mutex);
+}
+
+/* Called before HG_Forward */
+static void hvac_rpc_wait_arm(struct hvac_rpc_wait *wait, int slot, hg_handle_t handle,
+                              struct hvac_rpc_state *read = NULL)
+{
+    HG_Ref_incr(handle);
+    pthread_mutex_lock(&wait->mutex);
+    wait->slot[slot].done = HG_FALSE;
+    wait->slot[slot].ret = -1;
+    wait->slot[slot].handle = handle;
+    wait->slot[slot].read = read;
+    pthread_mutex_unlock(&wait->mutex);
+}
+
+/* signal to the caller that we are done */
+static void hvac_rpc_wait_complete(struct hvac_rpc_wait *wait, int slot, ssize_t ret)
+{
+    pthread_mutex_lock(&wait->mutex);
+    wait->slot[slot].done = HG_TRUE;
+    wait->slot[slot].ret = ret;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->mutex);
+}
+
+/* Drops the slot's handle reference, returns its result */
+static ssize_t hvac_rpc_wait_release(struct hvac_rpc_wait *wait, int slot)
+{
+    ssize_t ret = wait->slot[slot].ret;
+    if (wait->slot[slot].handle != HG_HANDLE_NULL)
+    {
+        HG_Destroy(wait->slot[slot].handle);
+        wait->slot[slot].handle = HG_HANDLE_NULL;
+    }
+    return ret;
+}
 
-    /* signal to main() that we are done */
-    pthread_mutex_lock(&done_mutex);
-    done++;
-    read_ret = bytes_read;
-    pthread_cond_signal(&done_cond);
-    pthread_mutex_unlock(&done_mutex);  
-    return HG_SUCCESS;    
+/* Result of a completed read slot, copied out to the caller's iovec if
+ * copy is set. The read state is ours once the callback completed the slot. */
+static ssize_t hvac_rpc_read_finish(struct hvac_rpc_wait *wait, int slot, bool copy)
+{
+    struct hvac_rpc_state *state = wait->slot[slot].read;
+    ssize_t ret = wait->slot[slot].ret;
+
+    if (state != NULL)
+    {
+        if (copy && ret > 0 && state->buffer != NULL)
+        {
+            size_t copied = 0;
+            for (int i = 0; i < state->iovcnt && copied < (size_t)ret; i++)
+            {
+                size_t n = std::min(state->iov[i].iov_len, (size_t)ret - copied);
+                memcpy(state->iov[i].iov_base, (char *)state->buffer + copied, n);
+                copied += n;
+            }
+        }
+        hvac_bounce_put(state->buffer);
+        free(state);
+        wait->slot[slot].read = NULL;
+    }
+    hvac_rpc_wait_release(wait, slot);
+    return ret;
+}
+
+/* Gives up on the read in a slot. Still outstanding, it is left to its
+ * callback, which frees it once the server answered. A read into the
+ * caller's buffers is waited for instead. */
+static void hvac_rpc_read_abandon(struct hvac_rpc_wait *wait, int slot)
+{
+    struct hvac_rpc_state *state = wait->slot[slot].read;
+    int waiting = HVAC_READ_WAITING;
+
+    if (state == NULL)
+    {
+        hvac_rpc_wait_release(wait, slot);
+        return;
+    }
+    if (state->buffer != NULL && __atomic_compare_exchange_n(&state->owner, &waiting, HVAC_READ_ABANDONED, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        wait->slot[slot].read = NULL;
+        hvac_rpc_wait_release(wait, slot);
+        return;
+    }
+    /* The callback got there first and is about to complete the slot, or
+     * the server writes into the caller's buffers */
+    pthread_mutex_lock(&wait->mutex);
+    while (wait->slot[slot].done != HG_TRUE)
+        pthread_cond_wait(&wait->cond, &wait->mutex);
+    pthread_mutex_unlock(&wait->mutex);
+    hvac_rpc_read_finish(wait, slot, false);
+}
+
+/* Cancels the slot if it is still outstanding and waits for its callback.
+ * Not for reads, see hvac_rpc_read_abandon. */
+static ssize_t hvac_rpc_wait_cancel(struct hvac_rpc_wait *wait, int slot)
+{
+    pthread_mutex_lock(&wait->mutex);
+    if (wait->slot[slot].done != HG_TRUE)
+    {
+        HG_Cancel(wait->slot[slot].handle);
+        while (wait->slot[slot].done != HG_TRUE)
+            pthread_cond_wait(&wait->cond, &wait->mutex);
+    }
+    pthread_mutex_unlock(&wait->mutex);
+    return hvac_rpc_wait_release(wait, slot);
+}
+
+static void hvac_rpc_deadline(struct timespec *ts, uint64_t us)
+{
+    /* The condition variables use the default realtime clock */
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/* Waits until one of the slots in mask is done or the deadline passes (us 0
+ * means no deadline). Returns the done slot, -1 on timeout. Called with the
+ * mutex held. */
+static int hvac_rpc_wait_any(struct hvac_rpc_wait *wait, unsigned mask, const struct timespec *deadline)
+{
+    while (1)
+    {
+        for (int slot = 0; slot < 2; slot++)
+            if ((mask & (1u << slot)) && wait->slot[slot].done == HG_TRUE)
+                return slot;
+        if (deadline == NULL)
+            pthread_cond_wait(&wait->cond, &wait->mutex);
+        else if (pthread_cond_timedwait(&wait->cond, &wait->mutex, deadline) == ETIMEDOUT)
+            return -1;
+    }
+}
+
+static ssize_t hvac_rpc_wait_block(struct hvac_rpc_wait *wait)
+{
+    struct timespec deadline;
+    int done;
+
+    hvac_rpc_deadline(&deadline, rpc_timeout_us);
+    pthread_mutex_lock(&wait->mutex);
+    done = hvac_rpc_wait_any(wait, 1u << HVAC_RPC_SLOT, rpc_timeout_us ? &deadline : NULL);
+    pthread_mutex_unlock(&wait->mutex);
+    if (done < 0 && wait->slot[HVAC_RPC_SLOT].read != NULL)
+    {
+        if (wait->slot[HVAC_RPC_SLOT].read->buffer != NULL)
+        {
+            L4C_ERR("Read RPC timed out after %lu ms, leaving it", (unsigned long)(rpc_timeout_us / 1000));
+            hvac_rpc_read_abandon(wait, HVAC_RPC_SLOT);
+            return -1;
+        }
+        /* The server may still push into the caller's buffers */
+        L4C_ERR("Read RPC timed out after %lu ms, waiting for it", (unsigned long)(rpc_timeout_us / 1000));
+        pthread_mutex_lock(&wait->mutex);
+        hvac_rpc_wait_any(wait, 1u << HVAC_RPC_SLOT, NULL);
+        pthread_mutex_unlock(&wait->mutex);
+        done = HVAC_RPC_SLOT;
+    }
+    if (done < 0)
+    {
+        L4C_ERR("RPC timed out after %lu ms, cancelling", (unsigned long)(rpc_timeout_us / 1000));
+        /* A result that raced the cancel is still good */
+        return hvac_rpc_wait_cancel(wait, HVAC_RPC_SLOT);
+    }
+    if (wait->slot[HVAC_RPC_SLOT].read != NULL)
+        return hvac_rpc_read_finish(wait, HVAC_RPC_SLOT, true);
+    return hvac_rpc_wait_release(wait, HVAC_RPC_SLOT);
+}
+
+static uint64_t hvac_rpc_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Completed reads feed the hedge delay, one window at a time so it follows
+ * the current state of the servers */
+static void hvac_hedge_record(uint64_t ns)
+{
+    hvac_hist_record(&hedge_lat, ns);
+    if (hedge_samples.fetch_add(1, std::memory_order_relaxed) % HVAC_HEDGE_WINDOW != HVAC_HEDGE_WINDOW - 1)
+        return;
+    hedge_delay_us.store(hvac_hist_quantile(&hedge_lat, hedge_quantile) / 1000, std::memory_order_relaxed);
+    /* Samples recorded while resetting may be lost, the delay is a hint */
+    hvac_hist_reset(&hedge_lat);
 }
 
 static hg_return_t
@@ -71,23 +451,53 @@ hvac_open_cb(const struct hg_cb_info *info)
     hvac_open_out_t out;
     struct hvac_open_state *open_state = (struct hvac_open_state *)info->arg;    
     
-    assert(info->ret == HG_SUCCESS);
-    HG_Get_output(info->info.forward.handle, &out);    
-    fd_redir_map[open_state->local_fd] = out.ret_status;
-	L4C_INFO("Open RPC Returned FD %d\n",out.ret_status);
-    HG_Free_output(info->info.forward.handle, &out);
+    out.ret_status = -1;
+    if (info->ret == HG_SUCCESS &&
+        HG_Get_output(info->info.forward.handle, &out) == HG_SUCCESS)
+    {
+        *open_state->file_size = out.file_size;
+        if (open_state->replicas != NULL) {
+            *open_state->replicas = out.replicas;
+        }
+        if (open_state->redirect != NULL) {
+            *open_state->redirect = out.redirect;
+        }
+        if (open_state->bcast != NULL) {
+            *open_state->bcast = out.bcast;
+        }
+        hvac_client_load_update(open_state->server, out.load);
+        HG_Free_output(info->info.forward.handle, &out);
+    }
+    *open_state->remote_fd = out.ret_status;
+	L4C_INFO("Open RPC Returned handle %ld\n",out.ret_status);
     HG_Destroy(info->info.forward.handle);
 
-    /* signal to main() that we are done */
-    pthread_mutex_lock(&done_mutex);
-    done++;
-    pthread_cond_signal(&done_cond);
-    pthread_mutex_unlock(&done_mutex);  
+    hvac_rpc_wait_complete(open_state->wait, HVAC_RPC_SLOT, out.ret_status);
+    free(open_state);
     return HG_SUCCESS;
 }
 
-/* callback triggered upon receipt of rpc response */
-/* In this case there is no response since that call was response less */
+static hg_return_t
+hvac_stats_cb(const struct hg_cb_info *info)
+{
+    struct hvac_stats_state *stats_state = (struct hvac_stats_state *)info->arg;
+    ssize_t ret = -1;
+
+    if (info->ret == HG_SUCCESS &&
+        HG_Get_output(info->info.forward.handle, stats_state->stats) == HG_SUCCESS)
+    {
+        ret = (stats_state->stats->version == HVAC_STATS_VERSION) ? 0 : -1;
+        HG_Free_output(info->info.forward.handle, stats_state->stats);
+    }
+    HG_Destroy(info->info.forward.handle);
+
+    hvac_rpc_wait_complete(stats_state->wait, HVAC_RPC_SLOT, ret);
+    free(stats_state);
+    return HG_SUCCESS;
+}
+
+/* callback triggered upon receipt of rpc response. The server pushed
+ * before it answered, nothing writes into the buffer any more. */
 static hg_return_t
 hvac_read_cb(const struct hg_cb_info *info)
 {
@@ -95,261 +505,728 @@ hvac_read_cb(const struct hg_cb_info *info)
     hvac_rpc_out_t out;
     ssize_t bytes_read = -1;
     struct hvac_rpc_state *hvac_rpc_state_p = (hvac_rpc_state *)info->arg;
-
-    assert(info->ret == HG_SUCCESS);
-
-    /* decode response */
-    HG_Get_output(info->info.forward.handle, &out);
-    bytes_read = out.ret;
+    struct hvac_rpc_wait *wait = hvac_rpc_state_p->wait;
+    int slot = hvac_rpc_state_p->slot;
+
+    /* decode response, a cancelled or failed read falls back to the PFS */
+    if (info->ret == HG_SUCCESS &&
+        HG_Get_output(info->info.forward.handle, &out) == HG_SUCCESS)
+    {
+        bytes_read = out.ret;
+        hvac_client_load_update(hvac_rpc_state_p->server, out.load);
+        if (bytes_read >= 0)
+            hvac_hedge_record(hvac_rpc_now() - hvac_rpc_state_p->start_ns);
+        ret = HG_Free_output(info->info.forward.handle, &out);
+        assert(ret == HG_SUCCESS);
+    }
+    else
+    {
+        L4C_ERR("Read RPC to server %u failed: %d", hvac_rpc_state_p->server, (int)info->ret);
+    }
 
     /* clean up resources consumed by this rpc */
     ret = HG_Bulk_free(hvac_rpc_state_p->bulk_handle);
 	assert(ret == HG_SUCCESS);
 	L4C_INFO("INFO: Freeing Bulk Handle"); //Does this deregister memory?
 
-    ret = HG_Free_output(info->info.forward.handle, &out);
-	assert(ret == HG_SUCCESS);
-    
 	ret = HG_Destroy(info->info.forward.handle);
 	assert(ret == HG_SUCCESS);
-    
-	free(hvac_rpc_state_p);
-
-    /* signal to main() that we are done */
-    pthread_mutex_lock(&done_mutex);
-    done++;
-    read_ret=bytes_read;
-    pthread_cond_signal(&done_cond);
-    pthread_mutex_unlock(&done_mutex);  
+
+    /* Nobody waits for an abandoned read, the buffer is ours to free */
+    int waiting = HVAC_READ_WAITING;
+    if (!__atomic_compare_exchange_n(&hvac_rpc_state_p->owner, &waiting, HVAC_READ_DONE, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        L4C_INFO("Abandoned read to server %u finished with %ld", hvac_rpc_state_p->server, (long)bytes_read);
+        hvac_bounce_put(hvac_rpc_state_p->buffer);
+        free(hvac_rpc_state_p);
+        return HG_SUCCESS;
+    }
+
+    /* The caller copies the data out and frees the state */
+    hvac_rpc_wait_complete(wait, slot, bytes_read);
     
     return HG_SUCCESS;
 }
 
 void hvac_client_comm_register_rpc()
 {   
+    const char *timeout_env = getenv("HVAC_RPC_TIMEOUT_MS");
+    const char *quantile_env = getenv("HVAC_HEDGE_PERCENTILE");
+    const char *min_env = getenv("HVAC_HEDGE_MIN_US");
+    if (timeout_env)
+        rpc_timeout_us = strtoull(timeout_env, NULL, 10) * 1000;
+    if (quantile_env)
+        hedge_quantile = atof(quantile_env) / 100;
+    if (min_env)
+        hedge_min_us = strtoull(min_env, NULL, 10);
+
+
     hvac_client_open_id = hvac_open_rpc_register();
     hvac_client_rpc_id = hvac_rpc_register();    
     hvac_client_close_id = hvac_close_rpc_register();
-    hvac_client_seek_id = hvac_seek_rpc_register();
+    hvac_client_stats_id = hvac_stats_rpc_register();
+    hvac_client_ping_id = hvac_ping_rpc_register();
+    hvac_client_comm_load_addrs();
+}
+
+void hvac_client_comm_ids(hg_id_t *open_id, hg_id_t *read_id, hg_id_t *close_id)
+{
+    *open_id = hvac_client_open_id;
+    *read_id = hvac_client_rpc_id;
+    *close_id = hvac_client_close_id;
+}
+
+/* HVAC_AGGREGATOR=1 routes everything through the node aggregator if one
+ * has posted its address, see hvac_aggregator.cpp */
+bool hvac_client_comm_aggregator_find()
+{
+    const char *env = getenv("HVAC_AGGREGATOR");
+    const char *jobid = getenv("SLURM_JOBID");
+    char filename[PATH_MAX];
+    char line[PATH_MAX] = "";
+
+    if (env == NULL || atoi(env) == 0)
+        return false;
+    snprintf(filename, sizeof(filename), HVAC_AGGREGATOR_FILE, jobid ? jobid : "0");
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        L4C_ERR("No aggregator on this node, connecting to the servers directly\n");
+        return false;
+    }
+    /* Address, then the run it serves and its pid */
+    unsigned long run = 0;
+    int pid = 0;
+    if (fgets(line, sizeof(line), file) != NULL)
+        line[strcspn(line, "\n")] = '\0';
+    if (fscanf(file, "%lx %d", &run, &pid) != 2)
+        line[0] = '\0';
+    fclose(file);
+    if (line[0] == '\0')
+        return false;
+    if (kill(pid, 0) != 0 && errno == ESRCH)
+    {
+        L4C_ERR("Aggregator %d is gone, connecting to the servers directly\n", pid);
+        unlink(filename);
+        return false;
+    }
+    if (run == 0 || run != hvac_bootstrap_peek_run())
+    {
+        L4C_ERR("Aggregator %d serves run %016lx, not ours, connecting to the servers directly\n", pid, run);
+        return false;
+    }
+    aggregator_addr = line;
+    L4C_INFO("Using the node aggregator at %s\n", line);
+    return true;
+}
+
+bool hvac_client_comm_aggregator_used()
+{
+    return aggregator_resolved != HG_ADDR_NULL;
 }
 
 void hvac_client_block()
 {
-    /* wait for callbacks to finish */
-    pthread_mutex_lock(&done_mutex);
-    while (done != HG_TRUE)
-        pthread_cond_wait(&done_cond, &done_mutex);
-    pthread_mutex_unlock(&done_mutex);
+    hvac_rpc_wait_block(&tl_rpc_wait);
 }
 
 ssize_t hvac_read_block()
 {
-    ssize_t bytes_read;
-    /* wait for callbacks to finish */
-    pthread_mutex_lock(&done_mutex);
-    while (done != HG_TRUE)
-        pthread_cond_wait(&done_cond, &done_mutex);
-    bytes_read = read_ret;
-    pthread_mutex_unlock(&done_mutex);
-    return bytes_read;
+    return hvac_rpc_wait_block(&tl_rpc_wait);
 }
 
+/* A read can only be given up on with a deadline or a hedge, only then is a
+ * bounce buffer worth its copy */
+static bool hvac_read_bounce()
+{
+    return rpc_timeout_us != 0 || hedge_quantile > 0;
+}
 
-ssize_t hvac_seek_block()
+/* Gives the read in flight until the hedge delay. True when it is still
+ * outstanding then and a hedge fits in the budget, the caller sends one
+ * and finishes with hvac_read_block_first or hvac_read_abandon. */
+bool hvac_read_hedge_wait()
 {
-    ssize_t bytes_read;
-    /* wait for callbacks to finish */
-    pthread_mutex_lock(&done_mutex);
-    while (done != HG_TRUE)
-        pthread_cond_wait(&done_cond, &done_mutex);
-    bytes_read = read_ret;
-    pthread_mutex_unlock(&done_mutex);
-    return bytes_read;
+    struct timespec deadline;
+    uint64_t delay = hedge_delay_us.load(std::memory_order_relaxed);
+    int done;
+
+    /* No estimate before the first window fills. A read into the caller's
+     * buffers cannot lose to its hedge. */
+    struct hvac_rpc_state *read = tl_rpc_wait.slot[HVAC_RPC_SLOT].read;
+    if (hedge_quantile <= 0 || delay == 0 || read == NULL || read->buffer == NULL)
+        return false;
+    if (delay < hedge_min_us)
+        delay = hedge_min_us;
+    if (rpc_timeout_us && delay >= rpc_timeout_us)
+        return false;
+
+    hvac_rpc_deadline(&deadline, delay);
+    pthread_mutex_lock(&tl_rpc_wait.mutex);
+    done = hvac_rpc_wait_any(&tl_rpc_wait, 1u << HVAC_RPC_SLOT, &deadline);
+    pthread_mutex_unlock(&tl_rpc_wait.mutex);
+    if (done >= 0)
+        return false;
+
+    uint64_t reads = hedge_reads.load(std::memory_order_relaxed);
+    if (hedge_sent.load(std::memory_order_relaxed) * 100 >= reads * HVAC_HEDGE_BUDGET_PCT)
+        return false;
+    hedge_sent.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+/* First successful result of the read and its hedge, copied into the
+ * caller's buffer. The other one is abandoned. */
+ssize_t hvac_read_block_first()
+{
+    struct timespec deadline;
+    unsigned pending = (1u << HVAC_RPC_SLOT) | (1u << HVAC_HEDGE_SLOT);
+    ssize_t ret = -1;
+    int done = -1;
+
+    hvac_rpc_deadline(&deadline, rpc_timeout_us);
+    pthread_mutex_lock(&tl_rpc_wait.mutex);
+    while (pending)
+    {
+        done = hvac_rpc_wait_any(&tl_rpc_wait, pending, rpc_timeout_us ? &deadline : NULL);
+        if (done < 0 || tl_rpc_wait.slot[done].ret >= 0)
+            break;
+        pending &= ~(1u << done);
+        done = -1;
+    }
+    pthread_mutex_unlock(&tl_rpc_wait.mutex);
+
+    for (int slot = 0; slot < 2; slot++)
+    {
+        if (slot == done)
+            ret = hvac_rpc_read_finish(&tl_rpc_wait, slot, true);
+        else
+            hvac_rpc_read_abandon(&tl_rpc_wait, slot);
+    }
+    if (done < 0)
+        L4C_ERR("Read and its hedge both failed or timed out");
+    return ret;
+}
+
+/* Gives up on the read in flight, the caller got the data elsewhere */
+void hvac_read_abandon()
+{
+    hvac_rpc_read_abandon(&tl_rpc_wait, HVAC_RPC_SLOT);
 }
 
 
-void hvac_client_comm_gen_close_rpc(uint32_t svr_hash, int fd)
+void hvac_client_comm_gen_close_rpc(uint32_t svr_hash, int64_t remote_fd)
 {   
     hg_addr_t svr_addr; 
+    hg_context_t *context;
     hvac_close_in_t in;
     hg_handle_t handle; 
     int ret;
 
     /* Get address */
-    svr_addr = hvac_client_comm_lookup_addr(svr_hash);        
+    svr_addr = hvac_client_comm_lookup_addr(svr_hash, &context);        
 
     /* create create handle to represent this rpc operation */
-    hvac_comm_create_handle(svr_addr, hvac_client_close_id, &handle);
+    hvac_comm_create_handle(context, svr_addr, hvac_client_close_id, &handle);
 
-    in.fd = fd_redir_map[fd];
+    in.fd = remote_fd;
+    in.server = svr_hash;
 
     ret = HG_Forward(handle, NULL, NULL, &in);
     assert(ret == 0);
 
-    fd_redir_map.erase(fd);
-
     HG_Destroy(handle);
-    hvac_comm_free_addr(svr_addr);
+    hvac_comm_free_addr(context, svr_addr);
 
     return;
 
 }
 
-void hvac_client_comm_gen_open_rpc(uint32_t svr_hash, string path, int fd)
+/* Blocks until the server answers, 0 on success */
+int hvac_client_comm_gen_stats_rpc(uint32_t svr_hash, hvac_stats_out_t *stats)
+{
+    hg_addr_t svr_addr;
+    hg_context_t *context;
+    hg_handle_t handle;
+    struct hvac_stats_state *hvac_stats_state_p;
+    int ret;
+
+    svr_addr = hvac_client_comm_lookup_addr(svr_hash, &context);
+
+    hvac_stats_state_p = (struct hvac_stats_state *)malloc(sizeof(*hvac_stats_state_p));
+    hvac_stats_state_p->stats = stats;
+    hvac_stats_state_p->wait = &tl_rpc_wait;
+
+    hvac_comm_create_handle(context, svr_addr, hvac_client_stats_id, &handle);
+    hvac_rpc_wait_arm(&tl_rpc_wait, HVAC_RPC_SLOT, handle);
+
+    ret = HG_Forward(handle, hvac_stats_cb, hvac_stats_state_p, NULL);
+    assert(ret == 0);
+    hvac_comm_free_addr(context, svr_addr);
+
+    return (int)hvac_rpc_wait_block(&tl_rpc_wait);
+}
+
+void hvac_client_comm_gen_open_rpc(uint32_t svr_hash, string path, int64_t *remote_fd, int64_t *file_size,
+                                   uint32_t *replicas, int32_t *redirect, uint32_t *bcast)
 {
     hg_addr_t svr_addr;
+    hg_context_t *context;
     hvac_open_in_t in;
     hg_handle_t handle;
     struct hvac_open_state *hvac_open_state_p;
     int ret;
-    done = HG_FALSE;
 
     /* Get address */
-    svr_addr = hvac_client_comm_lookup_addr(svr_hash);    
+    svr_addr = hvac_client_comm_lookup_addr(svr_hash, &context);    
 
     /* Allocate args for callback pass through */
     hvac_open_state_p = (struct hvac_open_state *)malloc(sizeof(*hvac_open_state_p));
-    hvac_open_state_p->local_fd = fd;
+    hvac_open_state_p->server = svr_hash;
+    hvac_open_state_p->remote_fd = remote_fd;
+    hvac_open_state_p->file_size = file_size;
+    hvac_open_state_p->replicas = replicas;
+    hvac_open_state_p->redirect = redirect;
+    hvac_open_state_p->bcast = bcast;
+    hvac_open_state_p->wait = &tl_rpc_wait;
 
     /* create create handle to represent this rpc operation */    
-    hvac_comm_create_handle(svr_addr, hvac_client_open_id, &handle);  
+    hvac_comm_create_handle(context, svr_addr, hvac_client_open_id, &handle);  
+    hvac_rpc_wait_arm(&tl_rpc_wait, HVAC_RPC_SLOT, handle);
 
     in.path = (hg_string_t)malloc(strlen(path.c_str()) + 1 );
     sprintf(in.path,"%s",path.c_str());
+    in.server = svr_hash;
     
     
 
     ret = HG_Forward(handle, hvac_open_cb, hvac_open_state_p, &in);
     assert(ret == 0);
 
-    hvac_comm_free_addr(svr_addr);
+    free(in.path);
+    hvac_comm_free_addr(context, svr_addr);
 
     return;
 
 }
 
-void hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int localfd, void *buffer, ssize_t count, off_t offset)
+void hvac_client_comm_gen_read_rpc(uint32_t svr_hash, int64_t remote_fd, void *buffer, ssize_t count, off_t offset)
+{
+    struct iovec iov;
+
+    iov.iov_base = buffer;
+    iov.iov_len = count;
+    hvac_client_comm_gen_readv_rpc(svr_hash, remote_fd, &iov, 1, offset);
+}
+
+/* Vectored reads register every iovec segment in a single bulk handle.
+ * The server still sees one contiguous region of input_val bytes and
+ * pushes it with one transfer, Mercury scatters it across the segments.
+ * A read that can be given up on goes into a bounce buffer instead if one
+ * is free, a hedge is only sent with one. False if nothing was sent.
+ */
+static bool hvac_client_comm_issue_readv(uint32_t svr_hash, int64_t remote_fd, const struct iovec *iov,
+                                         int iovcnt, off_t offset, int slot)
 {
     hg_addr_t svr_addr;
+    hg_context_t *context;
     hvac_rpc_in_t in;
     const struct hg_info *hgi;
     int ret;
     struct hvac_rpc_state *hvac_rpc_state_p;
-    done = HG_FALSE;
-    read_ret = -1;
+    void **seg_ptrs;
+    hg_size_t *seg_sizes;
+    hg_uint32_t seg_count = 0;
+    hg_size_t total = 0;
+
+    /* Mercury does not like zero length segments, drop them here */
+    seg_ptrs = (void **)malloc(sizeof(*seg_ptrs) * iovcnt);
+    seg_sizes = (hg_size_t *)malloc(sizeof(*seg_sizes) * iovcnt);
+    hvac_rpc_state_p = (struct hvac_rpc_state *)malloc(sizeof(*hvac_rpc_state_p));
+    if (seg_ptrs == NULL || seg_sizes == NULL || hvac_rpc_state_p == NULL)
+    {
+        L4C_ERR("Out of memory for a read RPC");
+        free(seg_ptrs);
+        free(seg_sizes);
+        free(hvac_rpc_state_p);
+        hvac_rpc_wait_fail(&tl_rpc_wait, slot);
+        return false;
+    }
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len == 0)
+            continue;
+        seg_ptrs[seg_count] = iov[i].iov_base;
+        seg_sizes[seg_count] = iov[i].iov_len;
+        total += iov[i].iov_len;
+        seg_count++;
+    }
+
+    if (total > INT32_MAX)
+        total = INT32_MAX;
+
+    /* A read we may give up on gets a buffer of its own if one is free,
+     * otherwise the bulk handle describes the caller's buffers directly */
+    void *bounce = hvac_read_bounce() ? hvac_bounce_get(total) : NULL;
+    if (bounce == NULL && slot == HVAC_HEDGE_SLOT)
+    {
+        free(seg_ptrs);
+        free(seg_sizes);
+        free(hvac_rpc_state_p);
+        return false;
+    }
+    if (bounce != NULL)
+    {
+        seg_ptrs[0] = bounce;
+        seg_sizes[0] = total;
+        seg_count = 1;
+    }
+    assert(seg_count > 0);
 
     /* Get address */
-    svr_addr = hvac_client_comm_lookup_addr(svr_hash);
+    svr_addr = hvac_client_comm_lookup_addr(svr_hash, &context);
 
     /* set up state structure */
-    hvac_rpc_state_p = (struct hvac_rpc_state *)malloc(sizeof(*hvac_rpc_state_p));
-    hvac_rpc_state_p->size = count;
-
-
-    /* This includes allocating a src buffer for bulk transfer */
-    hvac_rpc_state_p->buffer = buffer;
-    assert(hvac_rpc_state_p->buffer);
-    //hvac_rpc_state_p->value = 5;
+    hvac_rpc_state_p->size = total;
+    hvac_rpc_state_p->server = svr_hash;
+    hvac_rpc_state_p->slot = slot;
+    hvac_rpc_state_p->start_ns = hvac_rpc_now();
+    hvac_rpc_state_p->wait = &tl_rpc_wait;
+    hvac_rpc_state_p->iov = iov;
+    hvac_rpc_state_p->iovcnt = iovcnt;
+    hvac_rpc_state_p->owner = HVAC_READ_WAITING;
+    hvac_rpc_state_p->buffer = bounce;
 
     /* create create handle to represent this rpc operation */
-    hvac_comm_create_handle(svr_addr, hvac_client_rpc_id, &(hvac_rpc_state_p->handle));
+    hvac_comm_create_handle(context, svr_addr, hvac_client_rpc_id, &(hvac_rpc_state_p->handle));
+    hvac_rpc_wait_arm(&tl_rpc_wait, slot, hvac_rpc_state_p->handle, hvac_rpc_state_p);
 
-    /* register buffer for rdma/bulk access by server */
+    /* register buffers for rdma/bulk access by server */
     hgi = HG_Get_info(hvac_rpc_state_p->handle);
     assert(hgi);
-    ret = HG_Bulk_create(hgi->hg_class, 1, (void**) &(buffer),
-       &(hvac_rpc_state_p->size), HG_BULK_WRITE_ONLY, &(in.bulk_handle));
+    ret = HG_Bulk_create(hgi->hg_class, seg_count, seg_ptrs,
+       seg_sizes, HG_BULK_WRITE_ONLY, &(in.bulk_handle));
 
     hvac_rpc_state_p->bulk_handle = in.bulk_handle;
     assert(ret == HG_SUCCESS);
 
+    /* Segment descriptors are copied into the bulk handle */
+    free(seg_ptrs);
+    free(seg_sizes);
+
     /* Send rpc. Note that we are also transmitting the bulk handle in the
-     * input struct.  It was set above.
+     * input struct.  It was set above. input_val is 32 bit, larger reads
+     * come back short and the caller reads the rest like any short read.
      */
-    in.input_val = count;
-    //Convert FD to remote FD
-    in.accessfd = fd_redir_map[localfd];
+    in.input_val = total;
+    in.accessfd = remote_fd;
     in.offset = offset;
+    in.server = svr_hash;
     
     
     ret = HG_Forward(hvac_rpc_state_p->handle, hvac_read_cb, hvac_rpc_state_p, &in);
     assert(ret == 0);
 
-    hvac_comm_free_addr(svr_addr);
+    hvac_comm_free_addr(context, svr_addr);
 
-    return;
+    return true;
 }
 
-void hvac_client_comm_gen_seek_rpc(uint32_t svr_hash, int fd, int offset, int whence)
+void hvac_client_comm_gen_readv_rpc(uint32_t svr_hash, int64_t remote_fd, const struct iovec *iov, int iovcnt, off_t offset)
 {
-    hg_addr_t svr_addr;
-    hvac_seek_in_t in;
-    hg_handle_t handle;
-    read_ret = -1;
-    int ret;
-    done = HG_FALSE;
+    hedge_reads.fetch_add(1, std::memory_order_relaxed);
+    hvac_client_comm_issue_readv(svr_hash, remote_fd, iov, iovcnt, offset, HVAC_RPC_SLOT);
+}
 
-    /* Get address */
-    svr_addr = hvac_client_comm_lookup_addr(svr_hash);    
+/* Duplicate of the read in flight, whichever answers first fills iov.
+ * False when no bounce buffer is free, the caller then waits for the read. */
+bool hvac_client_comm_gen_hedge_rpc(uint32_t svr_hash, int64_t remote_fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+    return hvac_client_comm_issue_readv(svr_hash, remote_fd, iov, iovcnt, offset, HVAC_HEDGE_SLOT);
+}
 
-    /* Allocate args for callback pass through */    
-    /* create create handle to represent this rpc operation */    
-    hvac_comm_create_handle(svr_addr, hvac_client_seek_id, &handle);  
+/* Keeps the cache consistent across fork, the child starts empty since the
+ * resolved addresses belong to the parent's Mercury class */
+void hvac_client_comm_atfork_prepare()
+{
+    pthread_mutex_lock(&address_cache_mutex);
+    pthread_mutex_lock(&bounce_mutex);
+}
 
-    in.fd = fd_redir_map[fd];
-    in.offset = offset;
-    in.whence = whence;
-    
+void hvac_client_comm_atfork_parent()
+{
+    pthread_mutex_unlock(&bounce_mutex);
+    pthread_mutex_unlock(&address_cache_mutex);
+}
 
-    ret = HG_Forward(handle, hvac_seek_cb, NULL, &in);
-    assert(ret == 0);
+void hvac_client_comm_atfork_child()
+{
+    address_cache.clear();
+    /* Belongs to the parent's class, resolved again with ours */
+    aggregator_resolved = HG_ADDR_NULL;
+    /* Abandoned reads of the parent never come back to us, their buffers
+     * are lost to the pool */
+    pthread_mutex_unlock(&bounce_mutex);
+    pthread_mutex_unlock(&address_cache_mutex);
+}
 
-    
-    hvac_comm_free_addr(svr_addr);
+/* Pick the address and context a server is reached on */
+static hvac_server_addr hvac_client_comm_choose(const struct hvac_addr_entry &entry, const char *host)
+{
+    hvac_server_addr addr;
+    addr.local = strcmp(entry.host, host) == 0;
+    addr.sm = hvac_comm_get_sm_context() != NULL && strcmp(entry.sm_addr, "-") != 0 && addr.local;
+    addr.addr = addr.sm ? entry.sm_addr : entry.addr;
+    addr.resolved = HG_ADDR_NULL;
+    return addr;
+}
 
-    return;
+static hg_context_t *hvac_client_comm_context(const hvac_server_addr &addr)
+{
+    return addr.sm ? hvac_comm_get_sm_context() : hvac_comm_get_context();
+}
+
+/* The server node-local readers go to, one on our host if there is one.
+ * Otherwise the host name spreads the nodes over all servers. */
+int hvac_client_comm_node_server()
+{
+    char host[HOST_NAME_MAX + 1] = "";
+    int server = -1;
+
+    pthread_mutex_lock(&address_cache_mutex);
+    for (auto &it : address_cache)
+        if (it.second.local)
+        {
+            server = it.first;
+            break;
+        }
+    if (server < 0 && !address_cache.empty())
+    {
+        gethostname(host, sizeof(host));
+        server = std::hash<std::string>{}(host) % address_cache.size();
+    }
+    pthread_mutex_unlock(&address_cache_mutex);
+    return server;
+}
 
+/* Whether server runs on our host */
+bool hvac_client_comm_server_local(uint32_t server)
+{
+    pthread_mutex_lock(&address_cache_mutex);
+    auto it = address_cache.find(server);
+    bool local = it != address_cache.end() && it->second.local;
+    pthread_mutex_unlock(&address_cache_mutex);
+    return local;
 }
 
+struct hvac_lookup_wait {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int pending;
+};
+
+struct hvac_lookup_arg {
+    struct hvac_lookup_wait *wait;
+    int rank;
+};
+
+static hg_return_t
+hvac_lookup_cb(const struct hg_cb_info *info)
+{
+    struct hvac_lookup_arg *arg = (struct hvac_lookup_arg *)info->arg;
+
+    if (info->ret == HG_SUCCESS)
+    {
+        pthread_mutex_lock(&address_cache_mutex);
+        address_cache[arg->rank].resolved = info->info.lookup.addr;
+        pthread_mutex_unlock(&address_cache_mutex);
+    }
+    pthread_mutex_lock(&arg->wait->mutex);
+    if (--arg->wait->pending == 0)
+        pthread_cond_signal(&arg->wait->cond);
+    pthread_mutex_unlock(&arg->wait->mutex);
+    return HG_SUCCESS;
+}
+
+/* Load the address table once and resolve every server concurrently,
+ * later lookups only duplicate the resolved address */
+void hvac_client_comm_load_addrs()
+{
+    vector<struct hvac_addr_entry> entries;
+    char host[HOST_NAME_MAX + 1] = "";
+
+    if (hvac_bootstrap_load(entries) != 0)
+    {
+        L4C_ERR("No address table, falling back to scanning the ports file\n");
+        return;
+    }
+    gethostname(host, sizeof(host));
+
+    pthread_mutex_lock(&address_cache_mutex);
+    for (const struct hvac_addr_entry &entry : entries)
+        if (address_cache.find(entry.rank) == address_cache.end())
+            address_cache[entry.rank] = hvac_client_comm_choose(entry, host);
+    pthread_mutex_unlock(&address_cache_mutex);
+
+    /* The table only tells which servers are local, the aggregator has the connections */
+    if (!aggregator_addr.empty())
+    {
+        if (HG_Addr_lookup2(hvac_comm_get_class(), aggregator_addr.c_str(), &aggregator_resolved) == HG_SUCCESS)
+        {
+            L4C_INFO("Loaded %zu server addresses behind the aggregator\n", entries.size());
+            return;
+        }
+        /* The caller brings up the normal transport and loads again */
+        L4C_ERR("Could not reach the node aggregator at %s\n", aggregator_addr.c_str());
+        aggregator_addr.clear();
+        aggregator_resolved = HG_ADDR_NULL;
+        return;
+    }
+
+    struct hvac_lookup_wait wait = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+    vector<struct hvac_lookup_arg> args(entries.size());
+    /* The callbacks take the cache lock too, they run once it is dropped */
+    pthread_mutex_lock(&address_cache_mutex);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const hvac_server_addr &addr = address_cache[entries[i].rank];
+        args[i].wait = &wait;
+        args[i].rank = entries[i].rank;
+        pthread_mutex_lock(&wait.mutex);
+        wait.pending++;
+        pthread_mutex_unlock(&wait.mutex);
+        if (HG_Addr_lookup1(hvac_client_comm_context(addr), hvac_lookup_cb, &args[i],
+                            addr.addr.c_str(), HG_OP_ID_IGNORE) != HG_SUCCESS)
+        {
+            /* Left unresolved, hvac_client_comm_lookup_addr resolves it on use */
+            pthread_mutex_lock(&wait.mutex);
+            wait.pending--;
+            pthread_mutex_unlock(&wait.mutex);
+        }
+    }
+    pthread_mutex_unlock(&address_cache_mutex);
+
+    pthread_mutex_lock(&wait.mutex);
+    while (wait.pending > 0)
+        pthread_cond_wait(&wait.cond, &wait.mutex);
+    pthread_mutex_unlock(&wait.mutex);
+    L4C_INFO("Loaded %zu server addresses\n", entries.size());
+}
+
+static hg_return_t
+hvac_ping_cb(const struct hg_cb_info *info)
+{
+    struct hvac_lookup_wait *wait = (struct hvac_lookup_wait *)info->arg;
+
+    HG_Destroy(info->info.forward.handle);
+    pthread_mutex_lock(&wait->mutex);
+    if (--wait->pending == 0)
+        pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->mutex);
+    return HG_SUCCESS;
+}
+
+/* One ping to every known server at once, so the first real RPC to each
+ * does not pay for connection setup */
+void hvac_client_comm_ping_all()
+{
+    struct hvac_lookup_wait wait = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+    vector<int> ranks;
+
+    pthread_mutex_lock(&address_cache_mutex);
+    for (auto &it : address_cache)
+        ranks.push_back(it.first);
+    pthread_mutex_unlock(&address_cache_mutex);
+    /* One connection to set up, the aggregator keeps the server ones warm */
+    if (aggregator_resolved != HG_ADDR_NULL && ranks.size() > 1)
+        ranks.resize(1);
+
+    for (int rank : ranks)
+    {
+        hg_context_t *context;
+        hg_handle_t handle;
+        hg_addr_t svr_addr = hvac_client_comm_lookup_addr(rank, &context);
+        if (svr_addr == HG_ADDR_NULL)
+            continue;
+        hvac_comm_create_handle(context, svr_addr, hvac_client_ping_id, &handle);
+        pthread_mutex_lock(&wait.mutex);
+        wait.pending++;
+        pthread_mutex_unlock(&wait.mutex);
+        if (HG_Forward(handle, hvac_ping_cb, &wait, NULL) != HG_SUCCESS)
+        {
+            HG_Destroy(handle);
+            pthread_mutex_lock(&wait.mutex);
+            wait.pending--;
+            pthread_mutex_unlock(&wait.mutex);
+        }
+        hvac_comm_free_addr(context, svr_addr);
+    }
+
+    pthread_mutex_lock(&wait.mutex);
+    while (wait.pending > 0)
+        pthread_cond_wait(&wait.cond, &wait.mutex);
+    pthread_mutex_unlock(&wait.mutex);
+    L4C_INFO("Pinged %zu servers\n", ranks.size());
+}
 
 //We've converted the filename to a rank
 //Using standard c++ hashing modulo servers
-//Find the address
-hg_addr_t hvac_client_comm_lookup_addr(int rank)
+//Find the address, and the context it has to be used with
+hg_addr_t hvac_client_comm_lookup_addr(int rank, hg_context_t **context)
 {
-	if (address_cache.find(rank) != address_cache.end())
+	hg_addr_t target_server = HG_ADDR_NULL;
+
+	*context = hvac_comm_get_context();
+	if (aggregator_resolved != HG_ADDR_NULL)
 	{
-        hg_addr_t target_server;
-        HG_Addr_lookup2(hvac_comm_get_class(), address_cache[rank].c_str(), &target_server);
+		HG_Addr_dup(hvac_comm_get_class(), aggregator_resolved, &target_server);
 		return target_server;
 	}
-
-	/* The hardway */
-	char filename[PATH_MAX];
-	char svr_str[PATH_MAX];
-	int svr_rank = -1;
-	char *jobid = getenv("SLURM_JOBID");
-	hg_addr_t target_server;
-	bool svr_found = false;
-	FILE *na_config = NULL;
-	sprintf(filename, "./.ports.cfg.%s", jobid);
-	na_config = fopen(filename,"r+");
-    
-
-	while (fscanf(na_config, "%d %s\n",&svr_rank, svr_str) == 2)
+    pthread_mutex_lock(&address_cache_mutex);
+	if (address_cache.find(rank) == address_cache.end())
 	{
-		if (svr_rank == rank){
-			L4C_INFO("Connecting to %s %d\n", svr_str, svr_rank);            
-			svr_found = true;
-            break;
+		/* The hardway, only when the address table could not be loaded */
+		char filename[PATH_MAX];
+		char line[3 * PATH_MAX];
+		char host[HOST_NAME_MAX + 1] = "";
+		char *jobid = getenv("SLURM_JOBID");
+		FILE *na_config = NULL;
+		sprintf(filename, "./.ports.cfg.%s", jobid ? jobid : "0");
+		na_config = fopen(filename,"r");
+		if (na_config == NULL){
+			L4C_ERR("Could not open config file %s\n", filename);
+			pthread_mutex_unlock(&address_cache_mutex);
+			return target_server;
+		}
+		gethostname(host, sizeof(host));
+
+		while (fgets(line, sizeof(line), na_config))
+		{
+			struct hvac_addr_entry entry;
+			if (!hvac_bootstrap_parse_line(line, &entry) || entry.rank != rank)
+				continue;
+			address_cache[rank] = hvac_client_comm_choose(entry, host);
+			break;
 		}
+		fclose(na_config);
 	}
 
-	if (svr_found){
-		//Do something
-        address_cache[rank] = svr_str;
-        HG_Addr_lookup2(hvac_comm_get_class(),svr_str,&target_server);		
+	auto it = address_cache.find(rank);
+	if (it != address_cache.end())
+	{
+		*context = hvac_client_comm_context(it->second);
+		hg_class_t *cls = HG_Context_get_class(*context);
+		if (it->second.resolved != HG_ADDR_NULL)
+			HG_Addr_dup(cls, it->second.resolved, &target_server);
+		else
+		{
+			L4C_INFO("Connecting to %s %d%s\n", it->second.addr.c_str(), rank,
+			         it->second.sm ? " over shared memory" : "");
+			HG_Addr_lookup2(cls, it->second.addr.c_str(), &target_server);
+		}
 	}
+    pthread_mutex_unlock(&address_cache_mutex);
 
 	return target_server;
 }
@@ -11,15 +11,84 @@
 
 #include "hvac_logging.h"
 #include "hvac_data_mover_internal.h"
+#include "hvac_open_cache.h"
+#include "hvac_telemetry.h"
+#include "hvac_stats.h"
+#include "hvac_peer.h"
+#include "hvac_replica.h"
 using namespace std;
 namespace fs = std::filesystem;
 
 pthread_cond_t data_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-map<int,string> fd_to_path;
 map<string, string> path_cache_map;
 queue<string> data_queue;
+set<string> data_queued;
+map<string, int> data_source;
+
+/* Paths whose copy failed and when to try again, so a full NVMe does not
+ * turn every close into another copy from the PFS. Guarded by data_mutex. */
+#define HVAC_DATA_RETRY_NS (60 * 1000000000ULL)
+#define HVAC_DATA_FAILED_MAX 65536
+static map<string, uint64_t> data_failed;
+
+void hvac_data_mover_queue(const string &path, int source)
+{
+    /* A peer holds our copy, opens are redirected there */
+    if (hvac_peer_redirect(path) >= 0)
+        return;
+    pthread_mutex_lock(&data_mutex);
+    auto failed = data_failed.find(path);
+    if (failed != data_failed.end())
+    {
+        if (hvac_trace_now() < failed->second)
+        {
+            pthread_mutex_unlock(&data_mutex);
+            return;
+        }
+        data_failed.erase(failed);
+    }
+    if (source >= 0)
+        data_source[path] = source;
+    if (path_cache_map.find(path) == path_cache_map.end() &&
+        data_queued.find(path) == data_queued.end())
+    {
+        L4C_INFO("Caching %s",path.c_str());
+        data_queued.insert(path);
+        data_queue.push(path);
+        hvac_stats_mover(1);
+        pthread_cond_signal(&data_cond);
+    }
+    pthread_mutex_unlock(&data_mutex);
+}
+
+/* The copy did not land here, forget it was queued so it can be retried */
+static void hvac_data_mover_unqueue(const string &path)
+{
+    pthread_mutex_lock(&data_mutex);
+    data_queued.erase(path);
+    pthread_mutex_unlock(&data_mutex);
+}
+
+/* Neither here nor on a peer, retried once HVAC_DATA_RETRY_NS passed */
+static void hvac_data_mover_fail(const string &path)
+{
+    uint64_t now = hvac_trace_now();
+
+    pthread_mutex_lock(&data_mutex);
+    data_queued.erase(path);
+    if (data_failed.size() >= HVAC_DATA_FAILED_MAX)
+    {
+        for (auto it = data_failed.begin(); it != data_failed.end();)
+            it = now >= it->second ? data_failed.erase(it) : next(it);
+        /* All of them recent, the oldest failures are retried early */
+        if (data_failed.size() >= HVAC_DATA_FAILED_MAX)
+            data_failed.clear();
+    }
+    data_failed[path] = now + HVAC_DATA_RETRY_NS;
+    pthread_mutex_unlock(&data_mutex);
+}
 
 void *hvac_data_mover_fn(void *args)
 {
@@ -33,33 +102,80 @@ void *hvac_data_mover_fn(void *args)
 
     while (1) {
         pthread_mutex_lock(&data_mutex);
-        pthread_cond_wait(&data_cond, &data_mutex);
+        while (data_queue.empty())
+            pthread_cond_wait(&data_cond, &data_mutex);
         
         /* We can do stuff here when signaled */
         while (!data_queue.empty()){
             local_list.push(data_queue.front());
             data_queue.pop();
         }
+        map<string, int> sources;
+        sources.swap(data_source);
 
         pthread_mutex_unlock(&data_mutex);
 
         /* Now we copy the local list to the NVMes*/
         while (!local_list.empty())
         {
+            std::error_code ec;
+            uint64_t size = fs::file_size(local_list.front(), ec);
+            /* No room here, a peer with space caches our share instead. With
+             * no peer either the copy would only fail, leave it on the PFS. */
+            if (!ec && !hvac_peer_has_room(size))
+            {
+                if (hvac_peer_spill(local_list.front(), size) >= 0)
+                    hvac_data_mover_unqueue(local_list.front());
+                else
+                {
+                    L4C_INFO("No room for %s here or on a peer", local_list.front().c_str());
+                    hvac_data_mover_fail(local_list.front());
+                }
+                local_list.pop();
+                hvac_stats_mover(-1);
+                continue;
+            }
+
             char *newdir = (char *)malloc(strlen(nvmepath.c_str())+1);
             strcpy(newdir,nvmepath.c_str());
             mkdtemp(newdir);
             string dirpath = newdir;
             string filename = dirpath + string("/") + fs::path(local_list.front().c_str()).filename().string();
 
+            uint64_t t_start = hvac_trace_now();
             try{
-            fs::copy(local_list.front(), filename);
+            /* A peer's NVMe copy spares the PFS, broadcast files name theirs */
+            auto source = sources.find(local_list.front());
+            if (!(source != sources.end() && hvac_peer_fetch_from(source->second, local_list.front(), filename)) &&
+                !hvac_peer_fetch(local_list.front(), filename))
+                fs::copy(local_list.front(), filename);
+            uint64_t t_end = hvac_trace_now();
+            uint64_t copied = fs::file_size(filename);
+            hvac_trace(HVAC_TRACE_COPY, HVAC_TRACE_F_NVME, hvac_trace_path_id(local_list.front()),
+                       copied, t_start, t_end);
+            hvac_stats_record(HVAC_STAT_COPY, t_end - t_start);
+            hvac_stats_copy(copied);
+            pthread_mutex_lock(&data_mutex);
             path_cache_map[local_list.front()] = filename;
+            pthread_mutex_unlock(&data_mutex);
+            hvac_peer_cached(local_list.front());
+            hvac_replica_landed(local_list.front());
+            /* Open handles still point at the PFS copy */
+            hvac_open_cache_invalidate(local_list.front());
             } catch (...)
             {
                 L4C_INFO("Failed to copy %s to %s\n",local_list.front().c_str(), filename.c_str());
+                hvac_trace(HVAC_TRACE_COPY, HVAC_TRACE_F_ERROR, hvac_trace_path_id(local_list.front()),
+                           0, t_start, hvac_trace_now());
+                /* Most likely the NVMe filled up under us, drop the partial copy */
+                fs::remove_all(dirpath, ec);
+                if (size > 0 && hvac_peer_spill(local_list.front(), size) >= 0)
+                    hvac_data_mover_unqueue(local_list.front());
+                else
+                    hvac_data_mover_fail(local_list.front());
             }        
             local_list.pop();
+            hvac_stats_mover(-1);
         }
     }
     return NULL;
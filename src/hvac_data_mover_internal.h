@@ -3,6 +3,8 @@
 
 #include <queue>
 #include <map>
+#include <set>
+#include <string>
 
 using namespace std;
 /*Data Mover */
@@ -10,8 +12,16 @@ using namespace std;
 extern pthread_cond_t data_cond;
 extern pthread_mutex_t data_mutex;
 extern queue<string> data_queue;
-extern map<int, string> fd_to_path;
+/* Paths handed to the data mover, so each file is copied once */
+extern set<string> data_queued;
+/* PFS path -> NVMe copy, guarded by data_mutex */
 extern map<string, string> path_cache_map;
+/* Queued paths to fill from a given peer, guarded by data_mutex */
+extern map<string, int> data_source;
+
+/* Hand a file to the data mover unless it is cached or queued already.
+ * source is the peer to copy it from, -1 looks for one or uses the PFS. */
+void hvac_data_mover_queue(const string &path, int source = -1);
 
 
 void *hvac_data_mover_fn(void *args);
@@ -0,0 +1,291 @@
+/* Local fd handoff, see hvac_handoff.h */
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#include "hvac_logging.h"
+#include "hvac_open_cache.h"
+#include "hvac_handoff.h"
+
+using namespace std;
+
+#define HVAC_HANDOFF_GET 1
+#define HVAC_HANDOFF_PUT 2
+/* A server slower than this to answer is not worth waiting for */
+#define HVAC_HANDOFF_TIMEOUT_S 5
+
+/* One message per request, GET is answered with status and the fd */
+struct hvac_handoff_msg {
+    int32_t op;
+    int32_t status;
+    int64_t handle;
+};
+
+static bool hvac_handoff_enabled()
+{
+    const char *env = getenv("HVAC_HANDOFF");
+    return env == NULL || atoi(env) != 0;
+}
+
+/* Abstract name, nothing to clean up when the server goes away */
+static socklen_t hvac_handoff_addr(int rank, struct sockaddr_un *addr)
+{
+    const char *jobid = getenv("SLURM_JOBID");
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "hvac_fd.%s.%d",
+                       jobid ? jobid : "0", rank);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/* Server */
+
+static int handoff_listen_fd = -1;
+
+static void hvac_handoff_send(int conn, int32_t status, int fd)
+{
+    struct hvac_handoff_msg reply = { HVAC_HANDOFF_GET, status, 0 };
+    struct iovec iov = { &reply, sizeof(reply) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    sendmsg(conn, &msg, MSG_NOSIGNAL);
+}
+
+/* One thread for all local clients, handoffs only happen at open */
+static void *hvac_handoff_fn(void *args)
+{
+    vector<struct pollfd> fds;
+    /* Handles pinned on behalf of each connection */
+    map<int, multiset<int64_t>> pins;
+
+    fds.push_back({ handoff_listen_fd, POLLIN, 0 });
+    while (1)
+    {
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            L4C_PERROR("Handoff poll failed");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            int conn = accept4(handoff_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            struct ucred cred;
+            socklen_t len = sizeof(cred);
+            /* Our user only, the fds give access to the whole cached file */
+            if (conn >= 0 && (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+                              cred.uid != getuid()))
+            {
+                L4C_ERR("Refused handoff connection from another user");
+                close(conn);
+            }
+            else if (conn >= 0)
+                fds.push_back({ conn, POLLIN, 0 });
+        }
+
+        for (size_t i = fds.size() - 1; i >= 1; i--)
+        {
+            if (fds[i].revents == 0)
+                continue;
+            int conn = fds[i].fd;
+            struct hvac_handoff_msg msg;
+            if (recv(conn, &msg, sizeof(msg), 0) != sizeof(msg))
+            {
+                /* Gone, whatever it still held is unpinned */
+                for (int64_t handle : pins[conn])
+                    hvac_open_cache_release(handle, NULL);
+                pins.erase(conn);
+                close(conn);
+                fds.erase(fds.begin() + i);
+                continue;
+            }
+            if (msg.op == HVAC_HANDOFF_GET)
+            {
+                int fd = hvac_open_cache_pin(msg.handle);
+                hvac_handoff_send(conn, fd >= 0 ? 0 : -1, fd);
+                if (fd >= 0)
+                {
+                    pins[conn].insert(msg.handle);
+                    close(fd);
+                }
+            }
+            else if (msg.op == HVAC_HANDOFF_PUT)
+            {
+                auto it = pins[conn].find(msg.handle);
+                if (it != pins[conn].end())
+                {
+                    pins[conn].erase(it);
+                    hvac_open_cache_release(msg.handle, NULL);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void hvac_handoff_init(int rank)
+{
+    struct sockaddr_un addr;
+    pthread_t tid;
+
+    if (!hvac_handoff_enabled())
+        return;
+    socklen_t len = hvac_handoff_addr(rank, &addr);
+    handoff_listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (handoff_listen_fd < 0 || bind(handoff_listen_fd, (struct sockaddr *)&addr, len) != 0 ||
+        listen(handoff_listen_fd, 64) != 0)
+    {
+        L4C_PERROR("Local fd handoff unavailable");
+        if (handoff_listen_fd >= 0)
+            close(handoff_listen_fd);
+        handoff_listen_fd = -1;
+        return;
+    }
+    if (pthread_create(&tid, NULL, hvac_handoff_fn, NULL) != 0)
+    {
+        L4C_ERR("Failed to start the handoff thread");
+        close(handoff_listen_fd);
+        handoff_listen_fd = -1;
+        return;
+    }
+    pthread_detach(tid);
+    L4C_INFO("Local fd handoff listening as hvac_fd.%d", rank);
+}
+
+/* Client */
+
+/* Connection per local server, -1 once it could not be reached */
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<uint32_t, int> handoff_conns;
+
+/* Called with handoff_mutex held */
+static int hvac_handoff_conn(uint32_t server)
+{
+    auto it = handoff_conns.find(server);
+    if (it != handoff_conns.end())
+        return it->second;
+
+    struct sockaddr_un addr;
+    socklen_t len = hvac_handoff_addr(server, &addr);
+    struct timeval timeout = { HVAC_HANDOFF_TIMEOUT_S, 0 };
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn >= 0 && (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+                      connect(conn, (struct sockaddr *)&addr, len) != 0))
+    {
+        L4C_INFO("No local fd handoff from server %u", server);
+        close(conn);
+        conn = -1;
+    }
+    else if (conn < 0)
+    {
+        L4C_PERROR("Handoff socket");
+    }
+    handoff_conns[server] = conn;
+    return conn;
+}
+
+int hvac_handoff_get(uint32_t server, int64_t handle)
+{
+    static int enabled = -1;
+    struct hvac_handoff_msg msg = { HVAC_HANDOFF_GET, 0, handle };
+    struct hvac_handoff_msg reply;
+    char control[CMSG_SPACE(sizeof(int))];
+    int fd = -1;
+
+    if (enabled < 0)
+        enabled = hvac_handoff_enabled();
+    if (!enabled || handle < 0)
+        return -1;
+
+    pthread_mutex_lock(&handoff_mutex);
+    int conn = hvac_handoff_conn(server);
+    if (conn >= 0)
+    {
+        struct iovec iov = { &reply, sizeof(reply) };
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        if (send(conn, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) ||
+            recvmsg(conn, &hdr, MSG_CMSG_CLOEXEC) != sizeof(reply))
+        {
+            /* A late reply would answer the next request, start over. The
+             * server unpins whatever it handed out on this connection. */
+            close(conn);
+            handoff_conns.erase(server);
+        }
+        else if (reply.status == 0)
+        {
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+            if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    pthread_mutex_unlock(&handoff_mutex);
+    return fd;
+}
+
+void hvac_handoff_put(uint32_t server, int64_t handle)
+{
+    struct hvac_handoff_msg msg = { HVAC_HANDOFF_PUT, 0, handle };
+
+    pthread_mutex_lock(&handoff_mutex);
+    /* Never connects, a server we have no connection to holds no pin of ours */
+    auto it = handoff_conns.find(server);
+    if (it != handoff_conns.end() && it->second >= 0)
+        send(it->second, &msg, sizeof(msg), MSG_NOSIGNAL);
+    pthread_mutex_unlock(&handoff_mutex);
+}
+
+void hvac_handoff_atfork_prepare()
+{
+    pthread_mutex_lock(&handoff_mutex);
+}
+
+void hvac_handoff_atfork_parent()
+{
+    pthread_mutex_unlock(&handoff_mutex);
+}
+
+void hvac_handoff_atfork_child()
+{
+    /* Our copies of the sockets, closing them leaves the parent's alone */
+    for (auto &it : handoff_conns)
+        if (it.second >= 0)
+            close(it.second);
+    handoff_conns.clear();
+    pthread_mutex_unlock(&handoff_mutex);
+}
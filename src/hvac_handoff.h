@@ -0,0 +1,34 @@
+#ifndef __HVAC_HANDOFF_H__
+#define __HVAC_HANDOFF_H__
+
+#include <stdint.h>
+
+/* Local fd handoff
+ *
+ * Every server listens on the abstract UNIX socket hvac_fd.<jobid>.<rank>
+ * and only accepts processes of its own user. A client that opened a file
+ * on a server of its own node asks there for the fd behind its handle. If
+ * the server has the file open from its NVMe copy it pins the open cache
+ * entry and passes a duplicate of the fd with SCM_RIGHTS, the client then
+ * reads it with pread and no RPC. The pin is dropped when the client closes
+ * the file or its connection closes. Files still read from the PFS are
+ * refused and go through the read RPC as before.
+ *
+ * Environment
+ *   HVAC_HANDOFF   0 turns the handoff off, on both sides
+ */
+
+/* Server, starts the listener */
+void hvac_handoff_init(int rank);
+
+/* Client, the fd behind handle on server or -1 */
+int hvac_handoff_get(uint32_t server, int64_t handle);
+/* Client, unpins handle. The fd stays readable, the caller closes it once
+ * no read can be using it any more. */
+void hvac_handoff_put(uint32_t server, int64_t handle);
+/* The parent's connections are not ours */
+void hvac_handoff_atfork_prepare();
+void hvac_handoff_atfork_parent();
+void hvac_handoff_atfork_child();
+
+#endif
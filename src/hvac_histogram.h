@@ -0,0 +1,119 @@
+#ifndef __HVAC_HISTOGRAM_H__
+#define __HVAC_HISTOGRAM_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/* Log-linear latency histogram
+ *
+ * Values below 2^HVAC_HIST_SUB_BITS get a bucket each, above that every
+ * power of two is split into 2^HVAC_HIST_SUB_BITS linear buckets, so the
+ * relative error is bounded by 1/8 across the whole range (HDR style with
+ * one significant digit). The bucket layout is fixed, histograms from
+ * different threads or servers merge by adding the counts.
+ * Values are nanoseconds, anything above 2^HVAC_HIST_MAX_BITS (~68s) lands
+ * in the last bucket.
+ */
+#define HVAC_HIST_SUB_BITS 3
+#define HVAC_HIST_SUB (1 << HVAC_HIST_SUB_BITS)
+#define HVAC_HIST_MAX_BITS 36
+#define HVAC_HIST_BUCKETS ((HVAC_HIST_MAX_BITS - HVAC_HIST_SUB_BITS + 1) * HVAC_HIST_SUB)
+
+struct hvac_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HVAC_HIST_BUCKETS];
+};
+
+static inline uint32_t hvac_hist_index(uint64_t v)
+{
+    if (v < HVAC_HIST_SUB)
+        return (uint32_t)v;
+    uint32_t e = 63 - __builtin_clzll(v);
+    if (e >= HVAC_HIST_MAX_BITS)
+        return HVAC_HIST_BUCKETS - 1;
+    uint32_t sub = (uint32_t)(v >> (e - HVAC_HIST_SUB_BITS)) & (HVAC_HIST_SUB - 1);
+    return (e - HVAC_HIST_SUB_BITS + 1) * HVAC_HIST_SUB + sub;
+}
+
+/* Smallest value that maps to bucket idx */
+static inline uint64_t hvac_hist_lower(uint32_t idx)
+{
+    if (idx < HVAC_HIST_SUB)
+        return idx;
+    uint32_t e = idx / HVAC_HIST_SUB + HVAC_HIST_SUB_BITS - 1;
+    uint64_t sub = idx % HVAC_HIST_SUB;
+    return (HVAC_HIST_SUB + sub) << (e - HVAC_HIST_SUB_BITS);
+}
+
+/* Safe against concurrent recorders, readers may see a torn but consistent-enough view */
+static inline void hvac_hist_record(struct hvac_histogram *h, uint64_t v)
+{
+    __atomic_fetch_add(&h->buckets[hvac_hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    uint64_t cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (v > cur && !__atomic_compare_exchange_n(&h->max, &cur, v, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/* Single writer version for per-thread histograms */
+static inline void hvac_hist_add(struct hvac_histogram *h, uint64_t v)
+{
+    h->buckets[hvac_hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+static inline void hvac_hist_reset(struct hvac_histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+static inline void hvac_hist_snapshot(struct hvac_histogram *dst, const struct hvac_histogram *src)
+{
+    dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    for (int i = 0; i < HVAC_HIST_BUCKETS; i++)
+        dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+static inline void hvac_hist_merge(struct hvac_histogram *dst, const struct hvac_histogram *src)
+{
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (int i = 0; i < HVAC_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+/* q in [0,1]. Reports the lower bound of the bucket holding the quantile */
+static inline uint64_t hvac_hist_quantile(const struct hvac_histogram *h, double q)
+{
+    uint64_t total = 0, seen = 0, rank;
+    for (int i = 0; i < HVAC_HIST_BUCKETS; i++)
+        total += h->buckets[i];
+    if (total == 0)
+        return 0;
+    rank = (uint64_t)(q * (total - 1));
+    for (int i = 0; i < HVAC_HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return hvac_hist_lower(i);
+    }
+    return h->max;
+}
+
+static inline double hvac_hist_mean(const struct hvac_histogram *h)
+{
+    return h->count ? (double)h->sum / h->count : 0;
+}
+
+#endif
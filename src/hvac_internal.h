@@ -87,12 +87,30 @@ FILE *WRAP_DECL(fopen)(const char *path, const char *mode);
 REAL_DECL(fopen64, FILE *, (const char *path, const char *mode)) 
 FILE *WRAP_DECL(fopen64)(const char *path, const char *mode);
 
+REAL_DECL(fileno, int, (FILE *stream))
+extern int WRAP_DECL(fileno)(FILE *stream);
+
+REAL_DECL(fileno_unlocked, int, (FILE *stream))
+extern int WRAP_DECL(fileno_unlocked)(FILE *stream);
+
 REAL_DECL(pread, ssize_t, (int fd, void *buf, size_t count, off_t offset))
 extern ssize_t WRAP_DECL(pread)(int fd, void *buf, size_t count, off_t offset);
 
+REAL_DECL(pread64, ssize_t, (int fd, void *buf, size_t count, off64_t offset))
+extern ssize_t WRAP_DECL(pread64)(int fd, void *buf, size_t count, off64_t offset);
+
 REAL_DECL(readv, ssize_t, (int fd, const struct iovec *iov, int iovcnt))
 extern ssize_t WRAP_DECL(readv)(int fd, const struct iovec *iov, int iovcnt);
 
+REAL_DECL(preadv, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset))
+extern ssize_t WRAP_DECL(preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+
+REAL_DECL(preadv64, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset))
+extern ssize_t WRAP_DECL(preadv64)(int fd, const struct iovec *iov, int iovcnt, off64_t offset);
+
+REAL_DECL(preadv2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags))
+extern ssize_t WRAP_DECL(preadv2)(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags);
+
 
 REAL_DECL(write, ssize_t, (int fd, const void *buf, size_t count))
 extern ssize_t WRAP_DECL(write)(int fd, const void *buf, size_t count);
@@ -119,10 +137,21 @@ extern off_t WRAP_DECL(lseek)(int fd, off_t offset, int whence);
 REAL_DECL(lseek64, off64_t, (int fd, off64_t offset, int whence))
 extern off64_t WRAP_DECL(lseek64)(int fd, off64_t offset, int whence);
 
-/*
-REAL_DECL(mmap, void*, (void *addr, ssize_t length, int prot, int flags, int fd, off_t offset))
-extern void* WRAP_DECL(mmap)(void *addr, ssize_t length, int prot, int flags, int fd, off_t offset);
-*/
+REAL_DECL(mmap, void*, (void *addr, size_t length, int prot, int flags, int fd, off_t offset))
+extern void* WRAP_DECL(mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+
+REAL_DECL(mmap64, void*, (void *addr, size_t length, int prot, int flags, int fd, off64_t offset))
+extern void* WRAP_DECL(mmap64)(void *addr, size_t length, int prot, int flags, int fd, off64_t offset);
+
+/* Mappings of tracked files are filled from HVAC in chunks of this size */
+#define HVAC_MMAP_CHUNK (64 * 1024 * 1024)
+
+/* Mappings larger than this many MiB are left to the file system, they are
+ * copied in full at mmap() time. HVAC_MMAP_MAX_MB overrides, 0 never maps. */
+#define HVAC_MMAP_MAX_MB 1024
+
+/* Stream buffer for fopen'd tracked files, each refill is one remote read */
+#define HVAC_STDIO_BUFSIZE (4 * 1024 * 1024)
 
 
 
@@ -138,6 +167,23 @@ extern int WRAP_DECL(fdatasync)(int fd);
 
 
 #endif
+/* Client latency histograms, see hvac_client_stats.cpp */
+enum hvac_cstat_op {
+	HVAC_CSTAT_OPEN = 0,
+	HVAC_CSTAT_READ,
+	HVAC_CSTAT_PREAD,
+	HVAC_CSTAT_SEEK,
+	HVAC_CSTAT_CLOSE,
+	HVAC_CSTAT_OPS
+};
+
+enum hvac_cstat_outcome {
+	HVAC_CSTAT_REMOTE = 0,		/* served by HVAC */
+	HVAC_CSTAT_FALLBACK,		/* tracked, but went to the PFS */
+	HVAC_CSTAT_UNTRACKED,
+	HVAC_CSTAT_OUTCOMES
+};
+
 /* HVAC Internal API */
 #ifdef __cplusplus
 extern "C" bool hvac_track_file(const char* path, int flags, int fd);
@@ -145,9 +191,15 @@ extern "C" const char * hvac_get_path(int fd);
 extern "C" bool  hvac_remove_fd(int fd);
 extern "C" ssize_t hvac_remote_read(int fd, void *buf, size_t count);
 extern "C" ssize_t hvac_remote_pread(int fd, void *buf, size_t count, off_t offset);
-extern "C" ssize_t hvac_remote_lseek(int fd, int offset, int whence);
+extern "C" ssize_t hvac_remote_readv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+extern "C" off64_t hvac_remote_lseek(int fd, off64_t offset, int whence);
+extern "C" off64_t hvac_get_offset(int fd);
+extern "C" void hvac_set_offset(int fd, off64_t offset);
 extern "C" void hvac_remote_close(int fd);
 extern "C" bool hvac_file_tracked(int fd);
+extern "C" uint64_t hvac_cstat_begin(void);
+extern "C" void hvac_cstat_end(int op, int outcome, uint64_t t_start);
+extern "C" int hvac_cstat_open_outcome(bool tracked);
 #endif
 
 extern bool hvac_track_file(const char* path, int flags, int fd);
@@ -155,9 +207,17 @@ extern const char * hvac_get_path(int fd);
 extern bool  hvac_remove_fd(int fd);
 extern ssize_t hvac_remote_read(int fd, void *buf, size_t count);
 extern ssize_t hvac_remote_pread(int fd, void *buf, size_t count, off_t offset);
-extern ssize_t hvac_remote_lseek(int fd, int offset, int whence);
+extern ssize_t hvac_remote_readv(int fd, const struct iovec *iov, int iovcnt, off_t offset);
+extern off64_t hvac_remote_lseek(int fd, off64_t offset, int whence);
+extern off64_t hvac_get_offset(int fd);
+extern void hvac_set_offset(int fd, off64_t offset);
 extern void hvac_remote_close(int fd);
 extern bool hvac_file_tracked(int fd);
+/* 0 when client stats are off, hvac_cstat_end ignores those */
+extern uint64_t hvac_cstat_begin(void);
+extern void hvac_cstat_end(int op, int outcome, uint64_t t_start);
+/* Outcome of the hvac_track_file call this thread just made */
+extern int hvac_cstat_open_outcome(bool tracked);
 
 
 #endif
@@ -0,0 +1,304 @@
+/* Shared open file handle cache for the HVAC server.
+ * See hvac_open_cache.h for the handle contract.
+ */
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+
+#include <pthread.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "hvac_logging.h"
+#include "hvac_open_cache.h"
+#include "hvac_telemetry.h"
+
+using namespace std;
+
+/* Keep some fds back for sockets, logs and the data mover */
+#define HVAC_OPEN_CACHE_RESERVE 64
+#define HVAC_OPEN_CACHE_MIN 16
+
+struct hvac_open_entry {
+    string path;
+    int fd;
+    uint32_t gen;
+    uint32_t refs;
+    int64_t size;
+    uint64_t path_id;
+    /* Opened from the NVMe copy */
+    bool nvme;
+    /* The path was cached on the NVMe after we opened it */
+    bool stale;
+    bool in_use;
+    /* Position on the idle list, valid while refs == 0 */
+    list<uint32_t>::iterator lru;
+};
+
+static pthread_mutex_t open_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<hvac_open_entry> open_slots;
+static vector<uint32_t> open_free_slots;
+static unordered_map<string, uint32_t> open_by_path;
+/* Idle entries, most recently released at the front */
+static list<uint32_t> open_idle;
+static size_t open_count = 0;
+static size_t open_budget = 1024;
+/* Bumped by every invalidate, tells an unlocked open it may be stale */
+static uint64_t open_invalidations = 0;
+
+static inline int64_t hvac_open_make_handle(uint32_t slot, uint32_t gen)
+{
+    return ((int64_t)(gen & 0x7fffffff) << 32) | slot;
+}
+
+/* Called with open_cache_mutex held */
+static hvac_open_entry *hvac_open_lookup(int64_t handle)
+{
+    if (handle < 0)
+        return NULL;
+    uint32_t slot = (uint32_t)(handle & 0xffffffff);
+    uint32_t gen = (uint32_t)(handle >> 32);
+    if (slot >= open_slots.size())
+        return NULL;
+    hvac_open_entry *entry = &open_slots[slot];
+    if (!entry->in_use || (entry->gen & 0x7fffffff) != gen)
+        return NULL;
+    return entry;
+}
+
+/* Called with open_cache_mutex held */
+static void hvac_open_free_slot(uint32_t slot)
+{
+    hvac_open_entry *entry = &open_slots[slot];
+    auto it = open_by_path.find(entry->path);
+    if (it != open_by_path.end() && it->second == slot)
+        open_by_path.erase(it);
+    close(entry->fd);
+    entry->fd = -1;
+    entry->in_use = false;
+    entry->gen++;
+    entry->path.clear();
+    open_free_slots.push_back(slot);
+    open_count--;
+}
+
+/* Called with open_cache_mutex held */
+static void hvac_open_trim(size_t want)
+{
+    while (open_count + want > open_budget && !open_idle.empty())
+    {
+        uint32_t slot = open_idle.back();
+        open_idle.pop_back();
+        L4C_DEBUG("Open cache closing idle %s", open_slots[slot].path.c_str());
+        hvac_open_free_slot(slot);
+    }
+}
+
+void hvac_open_cache_init(void)
+{
+    struct rlimit rl;
+
+    /* Take all the fds we are allowed, the cache is sized from them */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        if (rl.rlim_cur < rl.rlim_max)
+        {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > HVAC_OPEN_CACHE_RESERVE + HVAC_OPEN_CACHE_MIN)
+            open_budget = rl.rlim_cur - HVAC_OPEN_CACHE_RESERVE;
+        else if (rl.rlim_cur != RLIM_INFINITY)
+            open_budget = HVAC_OPEN_CACHE_MIN;
+        else
+            open_budget = 1 << 20;
+    }
+    L4C_INFO("Open handle cache budget %ld fds", open_budget);
+}
+
+/* Called with open_cache_mutex held, takes a client reference */
+static int64_t hvac_open_ref(uint32_t slot, int64_t *file_size)
+{
+    hvac_open_entry *entry = &open_slots[slot];
+    if (entry->refs++ == 0)
+        open_idle.erase(entry->lru);
+    *file_size = entry->size;
+    return hvac_open_make_handle(slot, entry->gen);
+}
+
+/* The open runs without the lock, a slow PFS open must not hold up reads
+ * of files that are already open. Two clients opening the same path at
+ * once both open it, the later one closes its fd and shares the entry. */
+int64_t hvac_open_cache_acquire(const string &path, const string &open_path, int64_t *file_size)
+{
+    int64_t handle = -1;
+    struct stat st;
+
+    pthread_mutex_lock(&open_cache_mutex);
+    auto it = open_by_path.find(path);
+    if (it != open_by_path.end())
+    {
+        handle = hvac_open_ref(it->second, file_size);
+        pthread_mutex_unlock(&open_cache_mutex);
+        return handle;
+    }
+    uint64_t invalidations = open_invalidations;
+    pthread_mutex_unlock(&open_cache_mutex);
+
+    int fd = open(open_path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        L4C_PERROR("Open cache failed to open file");
+        return -1;
+    }
+    int64_t size = (fstat(fd, &st) == 0) ? st.st_size : -1;
+
+    pthread_mutex_lock(&open_cache_mutex);
+    it = open_by_path.find(path);
+    if (it != open_by_path.end())
+    {
+        handle = hvac_open_ref(it->second, file_size);
+        pthread_mutex_unlock(&open_cache_mutex);
+        close(fd);
+        return handle;
+    }
+
+    hvac_open_trim(1);
+    uint32_t slot;
+    if (!open_free_slots.empty())
+    {
+        slot = open_free_slots.back();
+        open_free_slots.pop_back();
+    }
+    else
+    {
+        slot = open_slots.size();
+        open_slots.emplace_back();
+        open_slots[slot].gen = 0;
+    }
+
+    hvac_open_entry *entry = &open_slots[slot];
+    entry->path = path;
+    entry->fd = fd;
+    entry->refs = 1;
+    entry->size = size;
+    entry->path_id = hvac_trace_path_id(path);
+    entry->nvme = (open_path != path);
+    /* Cached on the NVMe while we opened the PFS copy, serve this client
+     * from it but do not share it */
+    entry->stale = !entry->nvme && invalidations != open_invalidations;
+    entry->in_use = true;
+    if (!entry->stale)
+        open_by_path[path] = slot;
+    open_count++;
+
+    *file_size = entry->size;
+    handle = hvac_open_make_handle(slot, entry->gen);
+    pthread_mutex_unlock(&open_cache_mutex);
+    return handle;
+}
+
+int hvac_open_cache_fd(int64_t handle, uint64_t *path_id, bool *nvme)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&open_cache_mutex);
+    hvac_open_entry *entry = hvac_open_lookup(handle);
+    if (entry)
+    {
+        /* An invalidate or the last release would close it under the read */
+        if (entry->refs++ == 0)
+            open_idle.erase(entry->lru);
+        fd = entry->fd;
+        *path_id = entry->path_id;
+        *nvme = entry->nvme;
+    }
+    pthread_mutex_unlock(&open_cache_mutex);
+    return fd;
+}
+
+int hvac_open_cache_pin(int64_t handle)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&open_cache_mutex);
+    hvac_open_entry *entry = hvac_open_lookup(handle);
+    /* The caller holds a reference, the entry cannot be idle */
+    if (entry && entry->nvme && entry->refs > 0)
+    {
+        fd = fcntl(entry->fd, F_DUPFD_CLOEXEC, 0);
+        if (fd != -1)
+            entry->refs++;
+    }
+    pthread_mutex_unlock(&open_cache_mutex);
+    return fd;
+}
+
+bool hvac_open_cache_release(int64_t handle, string *path)
+{
+    pthread_mutex_lock(&open_cache_mutex);
+    hvac_open_entry *entry = hvac_open_lookup(handle);
+    if (entry == NULL || entry->refs == 0)
+    {
+        pthread_mutex_unlock(&open_cache_mutex);
+        return false;
+    }
+
+    if (path)
+        *path = entry->path;
+
+    uint32_t slot = (uint32_t)(handle & 0xffffffff);
+    if (--entry->refs == 0)
+    {
+        if (entry->stale)
+        {
+            hvac_open_free_slot(slot);
+        }
+        else
+        {
+            open_idle.push_front(slot);
+            entry->lru = open_idle.begin();
+            hvac_open_trim(0);
+        }
+    }
+    pthread_mutex_unlock(&open_cache_mutex);
+    return true;
+}
+
+void hvac_open_cache_invalidate(const string &path)
+{
+    pthread_mutex_lock(&open_cache_mutex);
+    open_invalidations++;
+    auto it = open_by_path.find(path);
+    if (it != open_by_path.end())
+    {
+        uint32_t slot = it->second;
+        hvac_open_entry *entry = &open_slots[slot];
+        open_by_path.erase(it);
+        if (entry->refs == 0)
+        {
+            open_idle.erase(entry->lru);
+            hvac_open_free_slot(slot);
+        }
+        else
+        {
+            /* Still in use, close once the last client lets go */
+            entry->stale = true;
+        }
+    }
+    pthread_mutex_unlock(&open_cache_mutex);
+}
+
+size_t hvac_open_cache_count(void)
+{
+    size_t count;
+    pthread_mutex_lock(&open_cache_mutex);
+    count = open_count;
+    pthread_mutex_unlock(&open_cache_mutex);
+    return count;
+}
@@ -0,0 +1,42 @@
+#ifndef __HVAC_OPEN_CACHE_H__
+#define __HVAC_OPEN_CACHE_H__
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+/* Server side open file handle cache
+ *
+ * Every client open of a path shares one server fd. Clients get an opaque
+ * handle (slot | generation << 32) instead of the raw fd, a stale handle
+ * simply fails the read and the client falls back to the PFS. Entries that
+ * no client holds stay open on an LRU so the next epoch opens for free,
+ * they are closed once the cache grows past a budget derived from
+ * RLIMIT_NOFILE.
+ */
+
+void hvac_open_cache_init(void);
+
+/* Returns a handle for path, opening open_path if the path is not open yet. -1 on error */
+int64_t hvac_open_cache_acquire(const string &path, const string &open_path, int64_t *file_size);
+
+/* Looks up the fd behind a handle, -1 if the handle is stale. Takes a
+ * reference so the fd stays open, the caller drops it with
+ * hvac_open_cache_release once done with the fd.
+ * path_id and nvme describe the entry for telemetry. */
+int hvac_open_cache_fd(int64_t handle, uint64_t *path_id, bool *nvme);
+
+/* Takes a client reference for a handle opened from the NVMe copy and
+ * returns a duplicate of its fd, -1 otherwise. hvac_open_cache_release unpins. */
+int hvac_open_cache_pin(int64_t handle);
+
+/* Drops one client reference. Returns false for stale handles */
+bool hvac_open_cache_release(int64_t handle, string *path);
+
+/* path was just copied to the NVMe, stop handing out the PFS fd for it */
+void hvac_open_cache_invalidate(const string &path);
+
+/* Number of fds the cache currently holds open */
+size_t hvac_open_cache_count(void);
+
+#endif
@@ -0,0 +1,450 @@
+/* Bloom filter directory and peer cache fill, server side.
+ * See hvac_peer.h for the protocol.
+ */
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+#include "hvac_logging.h"
+#include "hvac_comm.h"
+#include "hvac_peer.h"
+
+using namespace std;
+
+#define HVAC_PEER_TIMEOUT_S 30
+
+static int peer_rank = -1;
+static uint32_t peer_server_count = 0;
+static unsigned peer_interval = 5;
+static uint32_t peer_log2_bits = 20;
+static hg_id_t peer_fetch_id;
+static hg_id_t peer_bloom_id;
+static hg_id_t peer_replicate_id;
+static uint64_t peer_reserve = 1024ULL << 20;
+static bool peer_enabled = false;
+
+/* Our filter, and the last one pulled from every peer */
+struct hvac_bloom {
+    uint64_t generation;
+    vector<uint64_t> words;
+};
+static pthread_mutex_t peer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static hvac_bloom local_filter;
+static vector<hvac_bloom> peer_filters;
+/* Free NVMe bytes each peer reported, less what we spilled there since */
+static vector<uint64_t> peer_free;
+/* Files we are home for and spilled, path -> peer */
+static unordered_map<string, uint32_t> peer_spilled;
+
+static uint64_t hvac_peer_free_bytes()
+{
+    struct statvfs st;
+    const char *bbpath = getenv("BBPATH");
+    if (bbpath == NULL || statvfs(bbpath, &st) != 0)
+        return 0;
+    return (uint64_t)st.f_bavail * st.f_frsize;
+}
+
+static uint64_t hvac_bloom_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Double hashing, bit i is h1 + i * h2 */
+static void hvac_bloom_bits(const string &path, uint64_t *bits)
+{
+    uint64_t h1 = std::hash<string>{}(path);
+    uint64_t h2 = hvac_bloom_mix(h1) | 1;
+    uint64_t mask = (1ULL << peer_log2_bits) - 1;
+    for (int i = 0; i < HVAC_PEER_HASHES; i++)
+        bits[i] = (h1 + i * h2) & mask;
+}
+
+static bool hvac_bloom_test(const hvac_bloom &filter, const uint64_t *bits)
+{
+    if (filter.words.empty())
+        return false;
+    for (int i = 0; i < HVAC_PEER_HASHES; i++)
+        if (!(filter.words[bits[i] / 64] & (1ULL << (bits[i] % 64))))
+            return false;
+    return true;
+}
+
+void hvac_peer_cached(const string &path)
+{
+    uint64_t bits[HVAC_PEER_HASHES];
+
+    if (!peer_enabled)
+        return;
+    hvac_bloom_bits(path, bits);
+    pthread_mutex_lock(&peer_mutex);
+    for (int i = 0; i < HVAC_PEER_HASHES; i++)
+        local_filter.words[bits[i] / 64] |= 1ULL << (bits[i] % 64);
+    local_filter.generation++;
+    pthread_mutex_unlock(&peer_mutex);
+}
+
+size_t hvac_peer_filter_copy(uint64_t generation, void *buf, size_t size)
+{
+    hvac_bloom_hdr hdr;
+    size_t bytes;
+
+    hdr.free_bytes = hvac_peer_free_bytes();
+    pthread_mutex_lock(&peer_mutex);
+    bytes = sizeof(hdr) + local_filter.words.size() * sizeof(uint64_t);
+    if (generation == local_filter.generation)
+        bytes = sizeof(hdr);
+    if (!peer_enabled || size < bytes)
+    {
+        pthread_mutex_unlock(&peer_mutex);
+        return 0;
+    }
+    hdr.generation = local_filter.generation;
+    hdr.log2_bits = peer_log2_bits;
+    hdr.hashes = HVAC_PEER_HASHES;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy((char *)buf + sizeof(hdr), local_filter.words.data(), bytes - sizeof(hdr));
+    pthread_mutex_unlock(&peer_mutex);
+    return bytes;
+}
+
+/* Completion of one peer RPC, waited on by the calling thread */
+struct hvac_peer_wait {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    ssize_t ret;
+};
+
+static hg_return_t
+hvac_peer_cb(const struct hg_cb_info *info)
+{
+    struct hvac_peer_wait *wait = (struct hvac_peer_wait *)info->arg;
+    hvac_rpc_out_t out;
+    ssize_t ret = -1;
+
+    if (info->ret == HG_SUCCESS &&
+        HG_Get_output(info->info.forward.handle, &out) == HG_SUCCESS)
+    {
+        ret = out.ret;
+        HG_Free_output(info->info.forward.handle, &out);
+    }
+    pthread_mutex_lock(&wait->mutex);
+    wait->done = true;
+    wait->ret = ret;
+    pthread_cond_signal(&wait->cond);
+    pthread_mutex_unlock(&wait->mutex);
+    return HG_SUCCESS;
+}
+
+/* Sends id to server and waits for the bytes it pushed into buf, -1 on any
+ * failure. bulk_field is the bulk handle member of in. */
+static ssize_t hvac_peer_call(uint32_t server, hg_id_t id, void *in, hg_bulk_t *bulk_field,
+                              void *buf, size_t size)
+{
+    struct hvac_peer_wait wait = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, -1 };
+    hg_size_t bulk_size = size;
+    hg_context_t *context;
+    hg_handle_t handle;
+    struct timespec deadline;
+
+    hg_addr_t addr = hvac_client_comm_lookup_addr(server, &context);
+    if (addr == HG_ADDR_NULL)
+        return -1;
+    hvac_comm_create_handle(context, addr, id, &handle);
+    if (HG_Bulk_create(HG_Context_get_class(context), 1, &buf, &bulk_size, HG_BULK_WRITE_ONLY,
+                       bulk_field) != HG_SUCCESS)
+    {
+        HG_Destroy(handle);
+        hvac_comm_free_addr(context, addr);
+        return -1;
+    }
+
+    if (HG_Forward(handle, hvac_peer_cb, &wait, in) != HG_SUCCESS)
+        wait.done = true;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += HVAC_PEER_TIMEOUT_S;
+    pthread_mutex_lock(&wait.mutex);
+    while (!wait.done)
+    {
+        /* The callback still runs after a cancel, buf must outlive it */
+        if (pthread_cond_timedwait(&wait.cond, &wait.mutex, &deadline) == ETIMEDOUT)
+        {
+            HG_Cancel(handle);
+            while (!wait.done)
+                pthread_cond_wait(&wait.cond, &wait.mutex);
+        }
+    }
+    pthread_mutex_unlock(&wait.mutex);
+
+    HG_Bulk_free(*bulk_field);
+    HG_Destroy(handle);
+    hvac_comm_free_addr(context, addr);
+    return wait.ret;
+}
+
+static void hvac_peer_pull(uint32_t server, vector<char> &buf)
+{
+    hvac_bloom_in_t in;
+    hvac_bloom_hdr hdr;
+
+    pthread_mutex_lock(&peer_mutex);
+    in.generation = peer_filters[server].generation;
+    pthread_mutex_unlock(&peer_mutex);
+    in.size = buf.size();
+
+    ssize_t bytes = hvac_peer_call(server, peer_bloom_id, &in, &in.bulk_handle, buf.data(), buf.size());
+    if (bytes < (ssize_t)sizeof(hdr))
+        return;
+    memcpy(&hdr, buf.data(), sizeof(hdr));
+    /* Every server of a job runs with the same settings */
+    if (hdr.log2_bits != peer_log2_bits || hdr.hashes != HVAC_PEER_HASHES ||
+        ((size_t)bytes != buf.size() && (size_t)bytes != sizeof(hdr)))
+    {
+        L4C_ERR("Server %u sent a filter we cannot use", server);
+        return;
+    }
+
+    pthread_mutex_lock(&peer_mutex);
+    peer_free[server] = hdr.free_bytes;
+    if ((size_t)bytes == sizeof(hdr))
+    {
+        /* Unchanged filter */
+        pthread_mutex_unlock(&peer_mutex);
+        return;
+    }
+    hvac_bloom &filter = peer_filters[server];
+    filter.generation = hdr.generation;
+    filter.words.resize((buf.size() - sizeof(hdr)) / sizeof(uint64_t));
+    memcpy(filter.words.data(), buf.data() + sizeof(hdr), buf.size() - sizeof(hdr));
+    pthread_mutex_unlock(&peer_mutex);
+}
+
+static void *hvac_peer_fn(void *args)
+{
+    vector<char> buf(sizeof(hvac_bloom_hdr) + (1ULL << peer_log2_bits) / 8);
+
+    /* Peers post their addresses around the same time we do */
+    sleep(peer_interval);
+    hvac_client_comm_load_addrs();
+    while (1)
+    {
+        for (uint32_t server = 0; server < peer_server_count; server++)
+            if (server != (uint32_t)peer_rank)
+                hvac_peer_pull(server, buf);
+        sleep(peer_interval);
+    }
+    return NULL;
+}
+
+void hvac_peer_init(int rank, uint32_t server_count, uint64_t fetch_id, uint64_t bloom_id,
+                    uint64_t replicate_id)
+{
+    const char *interval_env = getenv("HVAC_PEER_INTERVAL");
+    const char *bits_env = getenv("HVAC_PEER_BLOOM_BITS");
+    const char *reserve_env = getenv("HVAC_NVME_RESERVE_MB");
+    pthread_t tid;
+
+    if (reserve_env)
+        peer_reserve = strtoull(reserve_env, NULL, 10) << 20;
+    if (interval_env)
+        peer_interval = atoi(interval_env);
+    if (bits_env)
+        peer_log2_bits = atoi(bits_env);
+    if (peer_log2_bits < 10)
+        peer_log2_bits = 10;
+    if (peer_log2_bits > 28)
+        peer_log2_bits = 28;
+
+    /* Named fetches work without the filters */
+    peer_rank = rank;
+    peer_server_count = server_count;
+    peer_fetch_id = fetch_id;
+    peer_bloom_id = bloom_id;
+    peer_replicate_id = replicate_id;
+    if (peer_interval == 0 || server_count < 2 || rank < 0)
+        return;
+
+    pthread_mutex_lock(&peer_mutex);
+    local_filter.generation = 1;
+    local_filter.words.assign((1ULL << peer_log2_bits) / 64, 0);
+    peer_filters.assign(server_count, hvac_bloom{0, vector<uint64_t>()});
+    /* Nothing is spilled to a peer before it has reported */
+    peer_free.assign(server_count, 0);
+    pthread_mutex_unlock(&peer_mutex);
+
+    if (pthread_create(&tid, NULL, hvac_peer_fn, NULL) != 0)
+    {
+        L4C_ERR("Failed to start the peer filter thread, not filling from peers");
+        return;
+    }
+    pthread_detach(tid);
+    peer_enabled = true;
+}
+
+/* Copies the file chunk by chunk, a short chunk is the end of it */
+static bool hvac_peer_copy(uint32_t server, const string &path, const string &dst, char *buf)
+{
+    hvac_fetch_in_t in;
+    int64_t offset = 0;
+    ssize_t bytes;
+
+    int fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return false;
+    in.path = (hg_string_t)path.c_str();
+    in.size = HVAC_PEER_CHUNK;
+    do
+    {
+        in.offset = offset;
+        bytes = hvac_peer_call(server, peer_fetch_id, &in, &in.bulk_handle, buf, HVAC_PEER_CHUNK);
+        if (bytes < 0 || pwrite(fd, buf, bytes, offset) != bytes)
+        {
+            close(fd);
+            unlink(dst.c_str());
+            return false;
+        }
+        offset += bytes;
+    } while (bytes == HVAC_PEER_CHUNK);
+    close(fd);
+    return true;
+}
+
+bool hvac_peer_fetch_from(int server, const string &path, const string &dst)
+{
+    if (peer_rank < 0 || server == peer_rank || server < 0 || (uint32_t)server >= peer_server_count)
+        return false;
+    char *buf = (char *)malloc(HVAC_PEER_CHUNK);
+    if (buf == NULL)
+        return false;
+    bool ok = hvac_peer_copy(server, path, dst, buf);
+    free(buf);
+    if (ok)
+        L4C_INFO("Filled %s from server %d", path.c_str(), server);
+    return ok;
+}
+
+bool hvac_peer_fetch(const string &path, const string &dst)
+{
+    uint64_t bits[HVAC_PEER_HASHES];
+    vector<uint32_t> candidates;
+
+    if (!peer_enabled)
+        return false;
+    hvac_bloom_bits(path, bits);
+    pthread_mutex_lock(&peer_mutex);
+    /* Start after our own rank so requesters spread over the holders */
+    for (uint32_t i = 1; i < peer_server_count; i++)
+    {
+        uint32_t server = (peer_rank + i) % peer_server_count;
+        if (hvac_bloom_test(peer_filters[server], bits))
+            candidates.push_back(server);
+    }
+    pthread_mutex_unlock(&peer_mutex);
+    if (candidates.empty())
+        return false;
+
+    char *buf = (char *)malloc(HVAC_PEER_CHUNK);
+    if (buf == NULL)
+        return false;
+    bool ok = false;
+    for (uint32_t server : candidates)
+    {
+        if ((ok = hvac_peer_copy(server, path, dst, buf)))
+        {
+            L4C_INFO("Filled %s from server %u", path.c_str(), server);
+            break;
+        }
+        L4C_INFO("Server %u does not have %s after all", server, path.c_str());
+    }
+    free(buf);
+    return ok;
+}
+
+bool hvac_peer_has_room(uint64_t size)
+{
+    return hvac_peer_free_bytes() >= size + peer_reserve;
+}
+
+int hvac_peer_spill(const string &path, uint64_t size)
+{
+    int best = -1;
+
+    if (!peer_enabled)
+        return -1;
+    /* Only our own share is spilled, copies held for others are not chained on */
+    if (std::hash<string>{}(path) % peer_server_count != (uint32_t)peer_rank)
+        return -1;
+
+    pthread_mutex_lock(&peer_mutex);
+    /* Already placed, asking again would charge a peer twice or point the
+     * redirect at one without a copy */
+    auto spilled = peer_spilled.find(path);
+    if (spilled != peer_spilled.end())
+    {
+        best = spilled->second;
+        pthread_mutex_unlock(&peer_mutex);
+        return best;
+    }
+    for (uint32_t server = 0; server < peer_server_count; server++)
+        if (server != (uint32_t)peer_rank && peer_free[server] >= size + peer_reserve &&
+            (best < 0 || peer_free[server] > peer_free[best]))
+            best = server;
+    if (best >= 0)
+    {
+        /* Until its next report, so concurrent spills do not all pick it */
+        peer_free[best] -= size;
+        peer_spilled[path] = best;
+    }
+    pthread_mutex_unlock(&peer_mutex);
+    if (best < 0)
+        return -1;
+
+    hvac_replicate_in_t in;
+    hg_context_t *context;
+    hg_handle_t handle;
+    hg_addr_t addr = hvac_client_comm_lookup_addr(best, &context);
+    if (addr == HG_ADDR_NULL)
+    {
+        pthread_mutex_lock(&peer_mutex);
+        peer_spilled.erase(path);
+        pthread_mutex_unlock(&peer_mutex);
+        return -1;
+    }
+    in.path = (hg_string_t)path.c_str();
+    hvac_comm_create_handle(context, addr, peer_replicate_id, &handle);
+    if (HG_Forward(handle, NULL, NULL, &in) != HG_SUCCESS)
+        L4C_ERR("Could not ask server %d to hold %s", best, path.c_str());
+    HG_Destroy(handle);
+    hvac_comm_free_addr(context, addr);
+    L4C_INFO("No room for %s, spilled to server %d", path.c_str(), best);
+    return best;
+}
+
+int hvac_peer_redirect(const string &path)
+{
+    int server = -1;
+
+    if (!peer_enabled)
+        return -1;
+    pthread_mutex_lock(&peer_mutex);
+    auto it = peer_spilled.find(path);
+    if (it != peer_spilled.end())
+        server = it->second;
+    pthread_mutex_unlock(&peer_mutex);
+    return server;
+}
@@ -0,0 +1,65 @@
+#ifndef __HVAC_PEER_H__
+#define __HVAC_PEER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/* Peer cache fill
+ *
+ * Every server keeps a bloom filter of the files on its NVMe and bumps a
+ * generation whenever the data mover adds one. A background thread pulls
+ * the filters of all peers every HVAC_PEER_INTERVAL seconds, a peer whose
+ * generation did not change sends its header only. Before the data mover copies a
+ * file from the PFS it asks the peers whose filter holds the path for
+ * their NVMe copy, HVAC_PEER_CHUNK bytes per fetch RPC pushed over RDMA.
+ * A false positive answers -1 and the next candidate is tried, the PFS
+ * only when no peer has the file.
+ *
+ * Capacity pooling
+ * The filter header also carries the free NVMe space of its server and is
+ * sent even when the filter did not change. A home server without room
+ * for a file asks the peer with the most free space to cache it through
+ * the replicate RPC and keeps a forwarding record, its open responses
+ * then redirect clients to that peer. Files a server caches for others
+ * are never spilled on, a full peer just leaves them on the PFS.
+ *
+ * Environment
+ *   HVAC_PEER_INTERVAL     seconds between filter pulls (5), 0 disables peer fill
+ *   HVAC_PEER_BLOOM_BITS   log2 of the filter size in bits (20, 128KiB)
+ *   HVAC_NVME_RESERVE_MB   NVMe space kept free on every server (1024)
+ */
+#define HVAC_PEER_CHUNK (4 << 20)
+#define HVAC_PEER_HASHES 4
+
+/* Filter as it travels, the bits follow the header */
+struct hvac_bloom_hdr {
+    uint64_t generation;
+    uint64_t free_bytes;
+    uint32_t log2_bits;
+    uint32_t hashes;
+};
+
+void hvac_peer_init(int rank, uint32_t server_count, uint64_t fetch_id, uint64_t bloom_id,
+                    uint64_t replicate_id);
+/* The data mover has put path on the NVMe */
+void hvac_peer_cached(const std::string &path);
+
+/* Bloom RPC, copies our filter into buf, only the header when the caller
+ * has generation already. Returns the bytes copied, 0 if buf is too small. */
+size_t hvac_peer_filter_copy(uint64_t generation, void *buf, size_t size);
+
+/* Data mover, copies path from a peer's NVMe to dst. False leaves the PFS. */
+bool hvac_peer_fetch(const std::string &path, const std::string &dst);
+/* Same from a given server, works with the filters off */
+bool hvac_peer_fetch_from(int server, const std::string &path, const std::string &dst);
+
+/* Data mover, whether size more bytes fit on our NVMe */
+bool hvac_peer_has_room(uint64_t size);
+/* Data mover, places a file we are home for on a peer. Returns the peer or
+ * -1, the peer it was placed on before if it was */
+int hvac_peer_spill(const std::string &path, uint64_t size);
+/* Open handler, the peer holding our spilled copy of path or -1 */
+int hvac_peer_redirect(const std::string &path);
+
+#endif
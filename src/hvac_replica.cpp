@@ -0,0 +1,373 @@
+/* Popularity tracking, replication of hot files and broadcast of files
+ * every rank reads, server side. See hvac_replica.h for the placement rules.
+ */
+#include <string>
+#include <queue>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fnmatch.h>
+
+#include "hvac_logging.h"
+#include "hvac_comm.h"
+#include "hvac_replica.h"
+#include "hvac_data_mover_internal.h"
+
+using namespace std;
+
+static int replica_rank = -1;
+static uint32_t replica_server_count = 0;
+/* Stays 1, replication off, until hvac_replica_init */
+static uint32_t replica_count = 1;
+static uint32_t replica_threshold = 64;
+static uint64_t replica_window_ns = 60000000000ULL;
+static hg_id_t replica_rpc_id;
+static hg_id_t replica_bcast_id;
+static bool replica_thread = false;
+
+/* Broadcast detection */
+static uint32_t bcast_opens = 16;
+static uint64_t bcast_window_ns = 1000000000ULL;
+static vector<string> bcast_patterns;
+
+/* Servers to tell about path, root >= 0 makes it a broadcast */
+struct hvac_replica_job {
+    string path;
+    int root;
+    vector<uint32_t> targets;
+};
+
+/* Recent opens of a path this server is home for. opens halves every
+ * replica_window_ns since stamp_ns, bcast_opens counts the opens of the
+ * broadcast window that started at bcast_start_ns. */
+struct hvac_popularity {
+    uint64_t stamp_ns;
+    uint32_t opens;
+    uint64_t bcast_start_ns;
+    uint32_t bcast_opens;
+    list<string>::iterator lru;
+};
+
+/* Popularity of the paths this server is home for, most recently opened
+ * first on popularity_lru, and the hot ones */
+static pthread_mutex_t replica_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replica_cond = PTHREAD_COND_INITIALIZER;
+static unordered_map<string, hvac_popularity> popularity;
+static list<string> popularity_lru;
+static unordered_set<string> replica_hot;
+static queue<hvac_replica_job> replica_queue;
+/* Broadcast files and the tree children waiting for our copy to land */
+static unordered_set<string> bcast_files;
+static unordered_map<string, hvac_replica_job> bcast_pending;
+
+static uint64_t hvac_replica_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Forwards from its own thread, the progress thread runs the open handler
+ * and must not wait on address loading or file I/O */
+static void *hvac_replica_fn(void *args)
+{
+    bool loaded = false;
+
+    while (1)
+    {
+        pthread_mutex_lock(&replica_mutex);
+        while (replica_queue.empty())
+            pthread_cond_wait(&replica_cond, &replica_mutex);
+        hvac_replica_job job = replica_queue.front();
+        replica_queue.pop();
+        pthread_mutex_unlock(&replica_mutex);
+
+        if (!loaded)
+        {
+            hvac_client_comm_load_addrs();
+            loaded = true;
+        }
+
+        for (uint32_t server : job.targets)
+        {
+            hg_context_t *context;
+            hg_handle_t handle;
+            hg_return_t ret;
+            hg_addr_t addr = hvac_client_comm_lookup_addr(server, &context);
+            if (addr == HG_ADDR_NULL)
+            {
+                L4C_ERR("No address for replica server %u", server);
+                continue;
+            }
+            if (job.root < 0)
+            {
+                hvac_replicate_in_t in;
+                in.path = (hg_string_t)job.path.c_str();
+                hvac_comm_create_handle(context, addr, replica_rpc_id, &handle);
+                ret = HG_Forward(handle, NULL, NULL, &in);
+            }
+            else
+            {
+                hvac_bcast_in_t in;
+                in.path = (hg_string_t)job.path.c_str();
+                in.root = job.root;
+                in.parent = replica_rank;
+                hvac_comm_create_handle(context, addr, replica_bcast_id, &handle);
+                ret = HG_Forward(handle, NULL, NULL, &in);
+            }
+            if (ret != HG_SUCCESS)
+                L4C_ERR("Could not ask server %u to copy %s", server, job.path.c_str());
+            HG_Destroy(handle);
+            hvac_comm_free_addr(context, addr);
+        }
+        L4C_INFO("Sent %s to %zu servers%s", job.path.c_str(), job.targets.size(),
+                 job.root < 0 ? "" : " down the broadcast tree");
+    }
+    return NULL;
+}
+
+void hvac_replica_init(int rank, uint32_t server_count, uint64_t replicate_id, uint64_t bcast_id)
+{
+    const char *count_env = getenv("HVAC_REPLICAS");
+    const char *threshold_env = getenv("HVAC_REPLICATE_OPENS");
+    const char *replica_window_env = getenv("HVAC_REPLICATE_WINDOW_MS");
+    const char *bcast_env = getenv("HVAC_BCAST_OPENS");
+    const char *window_env = getenv("HVAC_BCAST_WINDOW_MS");
+    const char *patterns_env = getenv("HVAC_BCAST_PATHS");
+    pthread_t tid;
+
+    replica_rank = rank;
+    replica_server_count = server_count;
+    replica_rpc_id = replicate_id;
+    replica_bcast_id = bcast_id;
+    replica_count = count_env ? atoi(count_env) : 3;
+    if (threshold_env)
+        replica_threshold = atoi(threshold_env);
+    if (replica_window_env)
+        replica_window_ns = strtoull(replica_window_env, NULL, 10) * 1000000ULL;
+    if (bcast_env)
+        bcast_opens = atoi(bcast_env);
+    if (window_env)
+        bcast_window_ns = strtoull(window_env, NULL, 10) * 1000000ULL;
+    if (patterns_env)
+    {
+        string patterns = patterns_env;
+        size_t start = 0, end;
+        while ((end = patterns.find(':', start)) != string::npos)
+        {
+            if (end > start)
+                bcast_patterns.push_back(patterns.substr(start, end - start));
+            start = end + 1;
+        }
+        if (start < patterns.size())
+            bcast_patterns.push_back(patterns.substr(start));
+    }
+    if (replica_count > HVAC_MAX_REPLICAS)
+        replica_count = HVAC_MAX_REPLICAS;
+    if (replica_count > server_count)
+        replica_count = server_count;
+    if (replica_count < 1)
+        replica_count = 1;
+    if (server_count < 2 || rank < 0)
+    {
+        replica_count = 1;
+        return;
+    }
+
+    if (pthread_create(&tid, NULL, hvac_replica_fn, NULL) != 0)
+    {
+        L4C_ERR("Failed to start the replication thread, not replicating");
+        replica_count = 1;
+        return;
+    }
+    pthread_detach(tid);
+    replica_thread = true;
+}
+
+/* Binomial tree over positions relative to the root, v gets the file from
+ * v minus its highest bit and passes it on to v + 2^k for every 2^k > v */
+static vector<uint32_t> hvac_bcast_children(int root)
+{
+    vector<uint32_t> children;
+    uint32_t n = replica_server_count;
+    uint32_t v = (replica_rank - root + n) % n;
+    uint32_t step = 1;
+
+    while (step <= v)
+        step <<= 1;
+    for (; v + step < n; step <<= 1)
+        children.push_back((root + v + step) % n);
+    return children;
+}
+
+/* Called without replica_mutex, our copy may already be there */
+static void hvac_bcast_start(const string &path, int root, int parent)
+{
+    hvac_replica_job job;
+    job.path = path;
+    job.root = root;
+    job.targets = hvac_bcast_children(root);
+
+    pthread_mutex_lock(&replica_mutex);
+    bcast_files.insert(path);
+    if (!job.targets.empty())
+        bcast_pending[path] = job;
+    pthread_mutex_unlock(&replica_mutex);
+
+    hvac_data_mover_queue(path, parent);
+    pthread_mutex_lock(&data_mutex);
+    bool cached = path_cache_map.find(path) != path_cache_map.end();
+    pthread_mutex_unlock(&data_mutex);
+    if (cached)
+        hvac_replica_landed(path);
+}
+
+/* Called with replica_mutex held, the entry of path moved to the front */
+static hvac_popularity &hvac_popularity_touch(const string &path, uint64_t now)
+{
+    auto it = popularity.find(path);
+    if (it != popularity.end())
+    {
+        popularity_lru.splice(popularity_lru.begin(), popularity_lru, it->second.lru);
+        return it->second;
+    }
+
+    if (popularity.size() >= HVAC_POPULARITY_MAX)
+    {
+        popularity.erase(popularity_lru.back());
+        popularity_lru.pop_back();
+    }
+    popularity_lru.push_front(path);
+    hvac_popularity &pop = popularity[path];
+    pop.stamp_ns = now;
+    pop.opens = 0;
+    pop.bcast_start_ns = now;
+    pop.bcast_opens = 0;
+    pop.lru = popularity_lru.begin();
+    return pop;
+}
+
+/* Counts an open after the halvings due since the last one, returns the count */
+static uint32_t hvac_popularity_open(hvac_popularity &pop, uint64_t now)
+{
+    uint64_t halvings = replica_window_ns ? (now - pop.stamp_ns) / replica_window_ns : 0;
+    if (halvings > 0)
+    {
+        pop.opens = halvings >= 32 ? 0 : pop.opens >> halvings;
+        pop.stamp_ns += halvings * replica_window_ns;
+    }
+    return ++pop.opens;
+}
+
+static bool hvac_bcast_matches(const string &path)
+{
+    for (const string &pattern : bcast_patterns)
+        if (fnmatch(pattern.c_str(), path.c_str(), 0) == 0)
+            return true;
+    return false;
+}
+
+uint32_t hvac_replica_open(const string &path, bool *bcast)
+{
+    *bcast = false;
+    if (!replica_thread)
+        return 1;
+    /* Replicas see opens too, only the home server counts */
+    if (std::hash<string>{}(path) % replica_server_count != (uint32_t)replica_rank)
+    {
+        pthread_mutex_lock(&replica_mutex);
+        *bcast = bcast_files.count(path) > 0;
+        pthread_mutex_unlock(&replica_mutex);
+        return 1;
+    }
+
+    uint32_t replicas = 1;
+    bool start = false;
+    uint64_t now = hvac_replica_now();
+    pthread_mutex_lock(&replica_mutex);
+    bool known_bcast = bcast_files.count(path) > 0;
+    bool hot = replica_hot.count(path) > 0;
+    /* Paths already broadcast and hot have nothing left to count */
+    hvac_popularity *pop = NULL;
+    if ((!known_bcast && bcast_opens > 0) || (!hot && replica_count > 1))
+        pop = &hvac_popularity_touch(path, now);
+
+    if (known_bcast)
+        *bcast = true;
+    else if (hvac_bcast_matches(path))
+        *bcast = start = true;
+    else if (bcast_opens > 0)
+    {
+        /* Many opens in a short window are ranks reading it all at once */
+        if (now - pop->bcast_start_ns > bcast_window_ns)
+        {
+            pop->bcast_start_ns = now;
+            pop->bcast_opens = 0;
+        }
+        if (++pop->bcast_opens >= bcast_opens)
+        {
+            pop->bcast_opens = 0;
+            *bcast = start = true;
+        }
+    }
+    if (replica_count > 1)
+    {
+        if (hot)
+            replicas = replica_count;
+        else if (hvac_popularity_open(*pop, now) >= replica_threshold)
+        {
+            pop->opens = 0;
+            replica_hot.insert(path);
+            hvac_replica_job job;
+            job.path = path;
+            job.root = -1;
+            for (uint32_t i = 1; i < replica_count; i++)
+                job.targets.push_back(hvac_replica_server(replica_rank, i, replica_server_count));
+            replica_queue.push(job);
+            pthread_cond_signal(&replica_cond);
+            /* Until the copies land, replicas read the PFS, which still spreads the load */
+            replicas = replica_count;
+        }
+    }
+    if (start)
+        bcast_files.insert(path);
+    pthread_mutex_unlock(&replica_mutex);
+
+    if (start)
+    {
+        L4C_INFO("Broadcasting %s to all servers", path.c_str());
+        hvac_bcast_start(path, replica_rank, -1);
+    }
+    return replicas;
+}
+
+void hvac_replica_bcast(const string &path, int root, int parent)
+{
+    if (!replica_thread || root < 0 || (uint32_t)root >= replica_server_count)
+        return;
+    pthread_mutex_lock(&replica_mutex);
+    bool known = bcast_files.count(path) > 0;
+    pthread_mutex_unlock(&replica_mutex);
+    if (!known)
+        hvac_bcast_start(path, root, parent);
+}
+
+void hvac_replica_landed(const string &path)
+{
+    pthread_mutex_lock(&replica_mutex);
+    auto it = bcast_pending.find(path);
+    if (it != bcast_pending.end())
+    {
+        replica_queue.push(it->second);
+        bcast_pending.erase(it);
+        pthread_cond_signal(&replica_cond);
+    }
+    pthread_mutex_unlock(&replica_mutex);
+}
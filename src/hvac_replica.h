@@ -0,0 +1,56 @@
+#ifndef __HVAC_REPLICA_H__
+#define __HVAC_REPLICA_H__
+
+#include <stdint.h>
+#include <string>
+
+/* Hot file replication
+ *
+ * A file lives on its home server, hash(path) % server_count. The home
+ * server counts opens per path in a counter that halves every
+ * HVAC_REPLICATE_WINDOW_MS, once a path reaches HVAC_REPLICATE_OPENS
+ * it asks the next HVAC_REPLICAS - 1 servers to cache it as well and
+ * reports the replica count in every following open response. Clients
+ * derive the replica set from that count, replica i of a file is
+ * hvac_replica_server(home, i, server_count), replica 0 is the home.
+ *
+ * Broadcast files are read whole by many ranks at once, checkpoints or
+ * model weights. A file opened HVAC_BCAST_OPENS times within
+ * HVAC_BCAST_WINDOW_MS at its home, or matching HVAC_BCAST_PATHS, is
+ * copied to every server along a binomial tree rooted at the home: each
+ * server fills from its tree parent's NVMe and passes the file on once its
+ * own copy landed, so no server sends more than log2(server_count) copies.
+ * Open responses flag the file, clients then read it once per node, see
+ * hvac_bcast.h.
+ *
+ * Environment
+ *   HVAC_REPLICAS          copies of a hot file including the home (3), 1 disables
+ *   HVAC_REPLICATE_OPENS   opens after which a file counts as hot (64)
+ *   HVAC_REPLICATE_WINDOW_MS  half life of the open counts (60000), a file
+ *                          read once per epoch never becomes hot
+ *   HVAC_BCAST_OPENS       opens within the window that make a broadcast (16), 0 disables detection
+ *   HVAC_BCAST_WINDOW_MS   detection window (1000)
+ *   HVAC_BCAST_PATHS       colon separated fnmatch patterns that are always broadcast
+ *
+ * The counts of at most HVAC_POPULARITY_MAX paths are kept, the least
+ * recently opened ones are forgotten first.
+ */
+#define HVAC_MAX_REPLICAS 8
+#define HVAC_POPULARITY_MAX 65536
+
+static inline uint32_t hvac_replica_server(uint32_t home, uint32_t i, uint32_t server_count)
+{
+    return (home + i) % server_count;
+}
+
+/* Server side */
+void hvac_replica_init(int rank, uint32_t server_count, uint64_t replicate_id, uint64_t bcast_id);
+/* Records an open, returns the replica count to advertise (1 until hot)
+ * and whether the file is broadcast */
+uint32_t hvac_replica_open(const std::string &path, bool *bcast);
+/* Broadcast RPC, our parent in root's tree has path on its NVMe */
+void hvac_replica_bcast(const std::string &path, int root, int parent);
+/* Data mover, path is on our NVMe */
+void hvac_replica_landed(const std::string &path);
+
+#endif
@@ -0,0 +1,337 @@
+/* hvac_rpc_bench - fixed cost of each HVAC RPC
+ *
+ * Hosts the server handlers in-process (or attaches to a running server)
+ * and times open, read, close and stats round trips through the same
+ * client calls libhvac_client uses.
+ *
+ * hvac_rpc_bench [-T transport] [-n iters] [-t threads] [-s min] [-S max]
+ *                [-f file] [-a rank] [-l label] [-o text|json|csv]
+ *   -T  Mercury transport, e.g. na+sm or ofi+tcp://127.0.0.1 (na+sm)
+ *   -n  iterations per test, large reads are capped at 1 GiB moved (2000)
+ *   -t  threads issuing RPCs concurrently (1)
+ *   -s  smallest read, k/m suffixes allowed (1k)
+ *   -S  largest read, sizes go up by 4x (64m)
+ *   -f  file to read, created with the largest read size if missing
+ *       (./hvac_rpc_bench.dat)
+ *   -a  attach to server rank of $SLURM_JOBID instead of hosting one
+ *   -l  label copied into every result, e.g. a commit id
+ *
+ * Seeks have no RPC, file positions are kept by the client. close is a one
+ * way RPC, its latency is the cost of posting it.
+ */
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hvac_comm.h"
+#include "hvac_histogram.h"
+#include "hvac_open_cache.h"
+#include "hvac_internal.h"
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+using namespace std;
+
+/* Referenced by the logging code */
+__thread bool tl_disable_redirect = false;
+
+enum rpc_bench_op { RPC_BENCH_OPEN, RPC_BENCH_READ, RPC_BENCH_CLOSE, RPC_BENCH_STATS };
+static const char *rpc_bench_names[] = { "open", "read", "close", "stats" };
+
+static string transport = "na+sm";
+static string label;
+static string format = "text";
+static string filename = "./hvac_rpc_bench.dat";
+static int iters = 2000;
+static int nthreads = 1;
+static uint64_t min_size = 1024;
+static uint64_t max_size = 64 << 20;
+static int server_rank = 0;
+static bool attach = false;
+
+struct rpc_bench_thread {
+    pthread_t tid;
+    int op;
+    uint64_t size;
+    int iters;
+    int64_t handle;
+    struct hvac_histogram lat;
+    int errors;
+};
+
+static uint64_t rpc_bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t rpc_bench_parse_size(const char *str)
+{
+    char *end;
+    uint64_t v = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'm': case 'M': v <<= 10; /* fall through */
+    case 'k': case 'K': v <<= 10;
+    }
+    return v;
+}
+
+static int64_t rpc_bench_open(int64_t *file_size)
+{
+    int64_t handle = -1;
+    hvac_client_comm_gen_open_rpc(server_rank, filename, &handle, file_size);
+    hvac_client_block();
+    return handle;
+}
+
+static void *rpc_bench_thread_fn(void *args)
+{
+    rpc_bench_thread *t = (rpc_bench_thread *)args;
+    void *buf = NULL;
+    int64_t file_size;
+    hvac_stats_out_t *stats = NULL;
+
+    if (t->op == RPC_BENCH_READ)
+        buf = malloc(t->size);
+    if (t->op == RPC_BENCH_STATS)
+        stats = (hvac_stats_out_t *)malloc(sizeof(*stats));
+
+    for (int i = 0; i < t->iters; i++)
+    {
+        uint64_t start = rpc_bench_now();
+        switch (t->op) {
+        case RPC_BENCH_OPEN:
+        {
+            /* Each open takes a reference, hand it straight back outside the timing */
+            int64_t handle = rpc_bench_open(&file_size);
+            hvac_hist_add(&t->lat, rpc_bench_now() - start);
+            if (handle < 0)
+                t->errors++;
+            else
+                hvac_client_comm_gen_close_rpc(server_rank, handle);
+            continue;
+        }
+        case RPC_BENCH_READ:
+        {
+            hvac_client_comm_gen_read_rpc(server_rank, t->handle, buf, t->size, 0);
+            if (hvac_read_block() != (ssize_t)t->size)
+                t->errors++;
+            break;
+        }
+        case RPC_BENCH_CLOSE:
+        {
+            /* Pair every close with an untimed open so the server refcount stays sane */
+            int64_t handle = rpc_bench_open(&file_size);
+            start = rpc_bench_now();
+            hvac_client_comm_gen_close_rpc(server_rank, handle);
+            break;
+        }
+        case RPC_BENCH_STATS:
+            if (hvac_client_comm_gen_stats_rpc(server_rank, stats) != 0)
+                t->errors++;
+            break;
+        }
+        hvac_hist_add(&t->lat, rpc_bench_now() - start);
+    }
+
+    free(buf);
+    free(stats);
+    return NULL;
+}
+
+static void rpc_bench_report(int op, uint64_t size, int count, uint64_t wall_ns,
+                             struct hvac_histogram *lat, int errors)
+{
+    double secs = wall_ns / 1e9;
+    double rate = secs > 0 ? lat->count / secs : 0;
+    double mbs = (op == RPC_BENCH_READ && secs > 0) ? (double)size * lat->count / secs / 1e6 : 0;
+    double p50 = hvac_hist_quantile(lat, 0.5) / 1e3;
+    double p99 = hvac_hist_quantile(lat, 0.99) / 1e3;
+
+    if (format == "json")
+    {
+        printf("{\"label\": \"%s\", \"version\": \"%s\", \"transport\": \"%s\", \"op\": \"%s\", "
+               "\"size\": %lu, \"threads\": %d, \"count\": %lu, \"errors\": %d, \"mean_us\": %.2f, "
+               "\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, \"ops_per_s\": %.1f, \"MB_per_s\": %.1f}\n",
+               label.c_str(), HVAC_VERSION, transport.c_str(), rpc_bench_names[op], (unsigned long)size,
+               nthreads, (unsigned long)lat->count, errors, hvac_hist_mean(lat) / 1e3, p50, p99,
+               lat->max / 1e3, rate, mbs);
+    }
+    else if (format == "csv")
+    {
+        printf("%s,%s,%s,%s,%lu,%d,%lu,%d,%.2f,%.2f,%.2f,%.2f,%.1f,%.1f\n", label.c_str(), HVAC_VERSION,
+               transport.c_str(), rpc_bench_names[op], (unsigned long)size, nthreads,
+               (unsigned long)lat->count, errors, hvac_hist_mean(lat) / 1e3, p50, p99, lat->max / 1e3,
+               rate, mbs);
+    }
+    else
+    {
+        printf("%-6s %10lu %8lu %6d %10.2f %10.2f %10.2f %10.2f %12.1f %10.1f\n", rpc_bench_names[op],
+               (unsigned long)size, (unsigned long)lat->count, errors, hvac_hist_mean(lat) / 1e3,
+               p50, p99, lat->max / 1e3, rate, mbs);
+    }
+    fflush(stdout);
+}
+
+static void rpc_bench_run(int op, uint64_t size, int count, int64_t handle)
+{
+    vector<rpc_bench_thread> threads(nthreads);
+    struct hvac_histogram lat;
+    int errors = 0;
+
+    /* Warm up connections and registrations outside the measurement */
+    for (rpc_bench_thread &t : threads)
+    {
+        memset(&t.lat, 0, sizeof(t.lat));
+        t.op = op;
+        t.size = size;
+        t.iters = min(count, 10);
+        t.handle = handle;
+        t.errors = 0;
+        rpc_bench_thread_fn(&t);
+        memset(&t.lat, 0, sizeof(t.lat));
+        t.errors = 0;
+        t.iters = count;
+    }
+
+    uint64_t start = rpc_bench_now();
+    for (rpc_bench_thread &t : threads)
+        pthread_create(&t.tid, NULL, rpc_bench_thread_fn, &t);
+    memset(&lat, 0, sizeof(lat));
+    for (rpc_bench_thread &t : threads)
+    {
+        pthread_join(t.tid, NULL);
+        hvac_hist_merge(&lat, &t.lat);
+        errors += t.errors;
+    }
+    rpc_bench_report(op, size, count, rpc_bench_now() - start, &lat, errors);
+}
+
+static void rpc_bench_make_file()
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st) == 0 && (uint64_t)st.st_size >= max_size)
+        return;
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror(filename.c_str());
+        exit(1);
+    }
+    vector<char> buf(1 << 20, 'h');
+    for (uint64_t done = 0; done < max_size; done += buf.size())
+    {
+        if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size())
+        {
+            perror(filename.c_str());
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    char jobid[64];
+    char real[PATH_MAX];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "T:n:t:s:S:f:a:l:o:")) != -1)
+    {
+        switch (opt) {
+        case 'T': transport = optarg; break;
+        case 'n': iters = atoi(optarg); break;
+        case 't': nthreads = max(1, atoi(optarg)); break;
+        case 's': min_size = rpc_bench_parse_size(optarg); break;
+        case 'S': max_size = rpc_bench_parse_size(optarg); break;
+        case 'f': filename = optarg; break;
+        case 'a': attach = true; server_rank = atoi(optarg); break;
+        case 'l': label = optarg; break;
+        case 'o': format = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-T transport] [-n iters] [-t threads] [-s min] [-S max] "
+                            "[-f file] [-a rank] [-l label] [-o text|json|csv]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    rpc_bench_make_file();
+    /* The server opens by path, make it independent of its cwd */
+    if (realpath(filename.c_str(), real))
+        filename = real;
+
+    setenv("HVAC_TRANSPORT", transport.c_str(), 1);
+    /* Otherwise a same host server is always reached over na+sm, whatever -T says */
+    setenv("HVAC_SM", "0", 0);
+    hvac_init_logging();
+    if (attach)
+    {
+        if (getenv("SLURM_JOBID") == NULL)
+        {
+            fprintf(stderr, "-a needs SLURM_JOBID to find the server\n");
+            return 1;
+        }
+        hvac_init_comm(false);
+    }
+    else
+    {
+        /* Host the handlers ourselves and talk to our own address */
+        snprintf(jobid, sizeof(jobid), "hvac_rpc_bench.%d", (int)getpid());
+        setenv("SLURM_JOBID", jobid, 1);
+        setenv("PMI_RANK", "0", 1);
+        setenv("HVAC_TRACE", "0", 0);
+        hvac_open_cache_init();
+        hvac_init_comm(true);
+        hvac_comm_list_addr();
+        hvac_comm_publish_addrs(1);
+    }
+    /* Registers the server handlers too, so the in-process server answers */
+    hvac_client_comm_register_rpc();
+
+    if (format == "csv")
+        printf("label,version,transport,op,size,threads,count,errors,mean_us,p50_us,p99_us,max_us,ops_per_s,MB_per_s\n");
+    else if (format == "text")
+        printf("%-6s %10s %8s %6s %10s %10s %10s %10s %12s %10s\n", "op", "size", "count", "errors",
+               "mean_us", "p50_us", "p99_us", "max_us", "ops/s", "MB/s");
+
+    rpc_bench_run(RPC_BENCH_STATS, sizeof(hvac_stats_out_t), iters, -1);
+    rpc_bench_run(RPC_BENCH_OPEN, 0, iters, -1);
+    rpc_bench_run(RPC_BENCH_CLOSE, 0, iters, -1);
+
+    int64_t file_size;
+    int64_t handle = rpc_bench_open(&file_size);
+    if (handle < 0)
+    {
+        fprintf(stderr, "Server could not open %s\n", filename.c_str());
+        return 1;
+    }
+    for (uint64_t size = min_size; size <= max_size; size *= 4)
+    {
+        /* Keep the data moved per size bounded */
+        int count = (int)min((uint64_t)iters, max((uint64_t)20, (uint64_t)(1ULL << 30) / size));
+        rpc_bench_run(RPC_BENCH_READ, size, count, handle);
+    }
+    hvac_client_comm_gen_close_rpc(server_rank, handle);
+
+    if (!attach)
+    {
+        unlink((string("./.ports.cfg.") + jobid).c_str());
+        unlink((string("./.ports.tbl.") + jobid).c_str());
+        shm_unlink((string("/hvac_addr.") + jobid).c_str());
+    }
+    return 0;
+}
@@ -2,8 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include "hvac_comm.h"
 #include "hvac_data_mover_internal.h"
+#include "hvac_open_cache.h"
+#include "hvac_replica.h"
+#include "hvac_peer.h"
+#include "hvac_handoff.h"
+#include "hvac_telemetry.h"
 
 
 #define HVAC_SERVER 1
@@ -14,6 +20,9 @@ extern "C" {
 
 __thread bool tl_disable_redirect = false;
 uint32_t hvac_server_count = 0;
+/* Set by SIGTERM/SIGINT, the job scheduler stops servers that way */
+static volatile sig_atomic_t hvac_server_done = 0;
+static void hvac_server_stop(int sig);
 
 struct hvac_lookup_arg {
 	hg_class_t *hg_class;
@@ -24,8 +33,18 @@ struct hvac_lookup_arg {
 
 int hvac_start_comm_server(void)
 {
+    struct sigaction sa;
+
     HG_Set_log_level("DEBUG");
 
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = hvac_server_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    hvac_open_cache_init();
+
     /* Start the data mover before anything else */
     pthread_t hvac_data_mover_tid;
     if (pthread_create(&hvac_data_mover_tid, NULL, hvac_data_mover_fn, NULL) != 0){
@@ -35,23 +54,42 @@ int hvac_start_comm_server(void)
     /* True means we're a listener */
     hvac_init_comm(true);
 
-    /* Post our address */
-    hvac_comm_list_addr();
-
     /* Register basic RPC */
     hvac_rpc_register();
     hvac_open_rpc_register();
     hvac_close_rpc_register();
-    hvac_seek_rpc_register();
+    hvac_stats_rpc_register();
+    hvac_ping_rpc_register();
+    hg_id_t replicate_id = hvac_replicate_rpc_register();
+    hg_id_t bcast_id = hvac_bcast_rpc_register();
+    hvac_replica_init(atoi(getenv("PMI_RANK")), hvac_server_count, replicate_id, bcast_id);
+    hg_id_t fetch_id = hvac_fetch_rpc_register();
+    hg_id_t bloom_id = hvac_bloom_rpc_register();
+    hvac_peer_init(atoi(getenv("PMI_RANK")), hvac_server_count, fetch_id, bloom_id, replicate_id);
+    hvac_handoff_init(atoi(getenv("PMI_RANK")));
+
+    /* Post our address only once we can answer on it */
+    hvac_comm_list_addr();
+    hvac_comm_publish_addrs(hvac_server_count);
 
 
 
-    while (1)
+    while (!hvac_server_done)
         sleep(1);
 
+    L4C_INFO("Server stopping on signal");
+    /* A later run must not find our addresses */
+    hvac_comm_unpublish_addrs();
+    /* The last records are still in the rings */
+    hvac_telemetry_shutdown();
     return EXIT_SUCCESS;
 }
 
+static void hvac_server_stop(int sig)
+{
+    hvac_server_done = 1;
+}
+
 
 
 int main(int argc, char **argv)
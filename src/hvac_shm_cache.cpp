@@ -0,0 +1,425 @@
+/* Node-shared block cache, see hvac_shm_cache.h */
+#include <string>
+#include <algorithm>
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "hvac_logging.h"
+#include "hvac_bootstrap.h"
+#include "hvac_shm_cache.h"
+
+#define HVAC_SHM_MAGIC 0x324b4c4243415648ULL /* "HVACBLK2" */
+#define HVAC_SHM_WAIT_US 30000000
+#define HVAC_SHM_PAGE 4096
+
+#define HVAC_SHM_EMPTY 0
+#define HVAC_SHM_FILLING 1
+#define HVAC_SHM_READY 2
+
+/* Segment layout: header page, shards, block records, buckets, then the
+ * blocks page aligned. magic is stored last by the creator. */
+struct hvac_shm_hdr {
+    uint64_t magic;
+    uint64_t run_id;
+    uint32_t nshards;
+    uint32_t nblocks;
+    uint32_t nbuckets;
+    int32_t users;
+};
+
+/* Blocks first .. first + count - 1 and their buckets belong to the shard */
+struct hvac_shm_shard {
+    pthread_mutex_t lock;
+    uint32_t first;
+    uint32_t count;
+    uint32_t hand;
+};
+
+/* refs is changed with atomics, everything else under the shard lock */
+struct hvac_shm_block {
+    struct hvac_shm_key key;
+    int64_t block;
+    int32_t next;
+    uint32_t state;
+    int32_t refs;
+    uint32_t referenced;
+    int64_t len;
+    pid_t filler;
+};
+
+static pthread_once_t shm_once = PTHREAD_ONCE_INIT;
+static struct hvac_shm_hdr *shm_hdr = NULL;
+static struct hvac_shm_shard *shm_shards;
+static struct hvac_shm_block *shm_blocks;
+static int32_t *shm_buckets;
+static char *shm_data;
+static char shm_name[NAME_MAX];
+/* The process counted in users, fork children only share the mapping */
+static pid_t shm_pid = 0;
+
+static size_t hvac_shm_layout(uint32_t nshards, uint32_t nblocks, uint32_t nbuckets, size_t *data_off)
+{
+    size_t off = HVAC_SHM_PAGE;
+    off += (size_t)nshards * sizeof(struct hvac_shm_shard);
+    off += (size_t)nblocks * sizeof(struct hvac_shm_block);
+    off += (size_t)nshards * nbuckets * sizeof(int32_t);
+    off = (off + HVAC_SHM_PAGE - 1) / HVAC_SHM_PAGE * HVAC_SHM_PAGE;
+    *data_off = off;
+    return off + (size_t)nblocks * HVAC_SHM_BLOCK;
+}
+
+static void hvac_shm_map(void *base, size_t data_off)
+{
+    shm_hdr = (struct hvac_shm_hdr *)base;
+    shm_shards = (struct hvac_shm_shard *)((char *)base + HVAC_SHM_PAGE);
+    shm_blocks = (struct hvac_shm_block *)(shm_shards + shm_hdr->nshards);
+    shm_buckets = (int32_t *)(shm_blocks + shm_hdr->nblocks);
+    shm_data = (char *)base + data_off;
+}
+
+static uint64_t hvac_shm_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Creator, sets up the index in a zero filled segment */
+static bool hvac_shm_create(int fd, uint32_t nblocks, uint64_t run_id)
+{
+    uint32_t nshards = std::min<uint32_t>(HVAC_SHM_SHARDS, nblocks);
+    uint32_t per_shard = nblocks / nshards;
+    uint32_t nbuckets = per_shard * 2;
+    size_t data_off;
+    size_t len = hvac_shm_layout(nshards, nblocks, nbuckets, &data_off);
+
+    /* Reserve all of it now, a full /dev/shm would otherwise SIGBUS a reader */
+    if (ftruncate(fd, len) != 0 || posix_fallocate(fd, 0, len) != 0)
+        return false;
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return false;
+
+    struct hvac_shm_hdr *hdr = (struct hvac_shm_hdr *)base;
+    hdr->run_id = run_id;
+    hdr->nshards = nshards;
+    hdr->nblocks = nblocks;
+    hdr->nbuckets = nbuckets;
+    hvac_shm_map(base, data_off);
+
+    /* Robust, a process dying with a shard locked does not wedge the node */
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (uint32_t s = 0; s < nshards; s++)
+    {
+        pthread_mutex_init(&shm_shards[s].lock, &attr);
+        shm_shards[s].first = s * per_shard;
+        /* The last shard takes the remainder */
+        shm_shards[s].count = s + 1 == nshards ? nblocks - s * per_shard : per_shard;
+        shm_shards[s].hand = 0;
+    }
+    pthread_mutexattr_destroy(&attr);
+    for (uint32_t i = 0; i < nblocks; i++)
+        shm_blocks[i].next = -1;
+    for (size_t i = 0; i < (size_t)nshards * nbuckets; i++)
+        shm_buckets[i] = -1;
+    __atomic_store_n(&shm_hdr->magic, HVAC_SHM_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Everyone else, waits for the creator to finish */
+static bool hvac_shm_open(int fd, uint64_t run_id)
+{
+    struct stat st;
+    uint64_t deadline = hvac_shm_now() + HVAC_SHM_WAIT_US;
+
+    while (fstat(fd, &st) == 0 && st.st_size == 0 && hvac_shm_now() < deadline)
+        usleep(1000);
+    if (st.st_size < HVAC_SHM_PAGE)
+        return false;
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        return false;
+    struct hvac_shm_hdr *hdr = (struct hvac_shm_hdr *)base;
+    while (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != HVAC_SHM_MAGIC && hvac_shm_now() < deadline)
+        usleep(1000);
+
+    size_t data_off;
+    if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != HVAC_SHM_MAGIC || hdr->run_id != run_id ||
+        hvac_shm_layout(hdr->nshards, hdr->nblocks, hdr->nbuckets, &data_off) != (size_t)st.st_size)
+    {
+        munmap(base, st.st_size);
+        return false;
+    }
+    hvac_shm_map(base, data_off);
+    return true;
+}
+
+static void hvac_shm_attach()
+{
+    const char *env = getenv("HVAC_SHM_CACHE_MB");
+    const char *jobid = getenv("SLURM_JOBID");
+    uint64_t mb = env ? strtoull(env, NULL, 10) : 0;
+    uint32_t nblocks = (uint32_t)std::min<uint64_t>(mb * (1 << 20) / HVAC_SHM_BLOCK, INT32_MAX);
+    uint64_t run_id = hvac_bootstrap_run();
+    bool ok;
+
+    /* Without a run id a segment of an earlier run could pass for ours */
+    if (nblocks == 0 || run_id == 0)
+        return;
+    snprintf(shm_name, sizeof(shm_name), "/hvac_blk.%s.%016lx", jobid ? jobid : "0", (unsigned long)run_id);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+    {
+        ok = hvac_shm_create(fd, nblocks, run_id);
+        if (!ok)
+            shm_unlink(shm_name);
+    }
+    else if (errno == EEXIST && (fd = shm_open(shm_name, O_RDWR, 0600)) >= 0)
+        ok = hvac_shm_open(fd, run_id);
+    else
+        ok = false;
+    if (fd >= 0)
+        close(fd);
+    if (!ok)
+    {
+        L4C_ERR("Node block cache %s unavailable", shm_name);
+        shm_hdr = NULL;
+        return;
+    }
+    __atomic_add_fetch(&shm_hdr->users, 1, __ATOMIC_ACQ_REL);
+    shm_pid = getpid();
+    L4C_INFO("Node block cache %s, %u blocks", shm_name, shm_hdr->nblocks);
+}
+
+static inline uint64_t hvac_shm_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+struct hvac_shm_key hvac_shm_cache_key(const std::string &path, int64_t size)
+{
+    struct hvac_shm_key key;
+    /* FNV-1a and std::hash, 128 bits make a collision a non-issue */
+    key.h1 = 0xcbf29ce484222325ULL;
+    for (unsigned char c : path)
+        key.h1 = (key.h1 ^ c) * 0x100000001b3ULL;
+    key.h2 = std::hash<std::string>{}(path) ^ hvac_shm_mix((uint64_t)size);
+    return key;
+}
+
+static inline struct hvac_shm_shard *hvac_shm_shard_of(const struct hvac_shm_key &key, int64_t block)
+{
+    return &shm_shards[hvac_shm_mix(key.h1 ^ (uint64_t)block) % shm_hdr->nshards];
+}
+
+static inline int32_t *hvac_shm_bucket(struct hvac_shm_shard *shard, const struct hvac_shm_key &key, int64_t block)
+{
+    uint64_t b = hvac_shm_mix(key.h2 + (uint64_t)block) % shm_hdr->nbuckets;
+    return &shm_buckets[(size_t)(shard - shm_shards) * shm_hdr->nbuckets + b];
+}
+
+static void hvac_shm_lock(struct hvac_shm_shard *shard)
+{
+    /* The owner died, at worst a chain lost a block until it is reused */
+    if (pthread_mutex_lock(&shard->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&shard->lock);
+}
+
+static int32_t hvac_shm_find(struct hvac_shm_shard *shard, const struct hvac_shm_key &key, int64_t block)
+{
+    for (int32_t i = *hvac_shm_bucket(shard, key, block); i >= 0; i = shm_blocks[i].next)
+    {
+        struct hvac_shm_block *b = &shm_blocks[i];
+        if (b->block == block && b->key.h1 == key.h1 && b->key.h2 == key.h2)
+            return i;
+    }
+    return -1;
+}
+
+static void hvac_shm_unlink(struct hvac_shm_shard *shard, int32_t idx)
+{
+    struct hvac_shm_block *b = &shm_blocks[idx];
+    for (int32_t *link = hvac_shm_bucket(shard, b->key, b->block); *link >= 0; link = &shm_blocks[*link].next)
+        if (*link == idx)
+        {
+            *link = b->next;
+            break;
+        }
+    b->next = -1;
+    b->state = HVAC_SHM_EMPTY;
+}
+
+/* CLOCK over the shard, -1 if every block is pinned or being filled */
+static int32_t hvac_shm_evict(struct hvac_shm_shard *shard)
+{
+    for (uint32_t step = 0; step < 2 * shard->count; step++)
+    {
+        int32_t idx = shard->first + shard->hand;
+        struct hvac_shm_block *b = &shm_blocks[idx];
+        shard->hand = (shard->hand + 1) % shard->count;
+        if (b->state == HVAC_SHM_FILLING || __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) > 0)
+            continue;
+        if (b->state == HVAC_SHM_READY && b->referenced)
+        {
+            b->referenced = 0;
+            continue;
+        }
+        if (b->state == HVAC_SHM_READY)
+            hvac_shm_unlink(shard, idx);
+        return idx;
+    }
+    return -1;
+}
+
+static void hvac_shm_unpin(int32_t idx)
+{
+    __atomic_sub_fetch(&shm_blocks[idx].refs, 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the block pinned and ready, -1 to read remotely */
+static int32_t hvac_shm_pin(const struct hvac_shm_key &key, int64_t block, int64_t size, bool fill,
+                            hvac_shm_fetch_fn fetch, void *arg)
+{
+    struct hvac_shm_shard *shard = hvac_shm_shard_of(key, block);
+    uint64_t deadline = 0;
+    useconds_t backoff = 50;
+
+    while (1)
+    {
+        hvac_shm_lock(shard);
+        int32_t idx = hvac_shm_find(shard, key, block);
+        if (idx >= 0 && shm_blocks[idx].state == HVAC_SHM_READY)
+        {
+            __atomic_add_fetch(&shm_blocks[idx].refs, 1, __ATOMIC_ACQ_REL);
+            shm_blocks[idx].referenced = 1;
+            pthread_mutex_unlock(&shard->lock);
+            return idx;
+        }
+        if (idx >= 0)
+        {
+            /* Another rank is fetching it */
+            pid_t filler = shm_blocks[idx].filler;
+            if (kill(filler, 0) != 0 && errno == ESRCH)
+            {
+                /* Its pin died with it */
+                __atomic_store_n(&shm_blocks[idx].refs, 0, __ATOMIC_RELEASE);
+                hvac_shm_unlink(shard, idx);
+                pthread_mutex_unlock(&shard->lock);
+                continue;
+            }
+            pthread_mutex_unlock(&shard->lock);
+            uint64_t now = hvac_shm_now();
+            if (deadline == 0)
+                deadline = now + HVAC_SHM_WAIT_US;
+            if (now >= deadline)
+                return -1;
+            usleep(backoff);
+            if (backoff < 10000)
+                backoff *= 2;
+            continue;
+        }
+        if (!fill || (idx = hvac_shm_evict(shard)) < 0)
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return -1;
+        }
+        struct hvac_shm_block *b = &shm_blocks[idx];
+        int32_t *bucket = hvac_shm_bucket(shard, key, block);
+        b->key = key;
+        b->block = block;
+        b->state = HVAC_SHM_FILLING;
+        b->filler = getpid();
+        b->referenced = 1;
+        b->len = 0;
+        __atomic_store_n(&b->refs, 1, __ATOMIC_RELEASE);
+        b->next = *bucket;
+        *bucket = idx;
+        pthread_mutex_unlock(&shard->lock);
+
+        int64_t want = std::min<int64_t>(HVAC_SHM_BLOCK, size - block * HVAC_SHM_BLOCK);
+        int64_t got = 0;
+        while (got < want)
+        {
+            ssize_t ret = fetch(arg, shm_data + (size_t)idx * HVAC_SHM_BLOCK + got, want - got,
+                                block * HVAC_SHM_BLOCK + got);
+            if (ret <= 0)
+                break;
+            got += ret;
+        }
+
+        hvac_shm_lock(shard);
+        if (got == want)
+        {
+            b->len = got;
+            b->state = HVAC_SHM_READY;
+        }
+        else
+            hvac_shm_unlink(shard, idx);
+        pthread_mutex_unlock(&shard->lock);
+        if (got != want)
+        {
+            hvac_shm_unpin(idx);
+            return -1;
+        }
+        return idx;
+    }
+}
+
+ssize_t hvac_shm_cache_read(const struct hvac_shm_key &key, int64_t size, void *buf, size_t count,
+                            off_t offset, hvac_shm_fetch_fn fetch, void *arg)
+{
+    pthread_once(&shm_once, hvac_shm_attach);
+    if (shm_hdr == NULL || size <= 0 || offset < 0)
+        return -1;
+    if (offset >= size)
+        return 0;
+    int64_t end = std::min<int64_t>(offset + (int64_t)count, size);
+    int64_t first = offset / HVAC_SHM_BLOCK;
+    int64_t last = (end - 1) / HVAC_SHM_BLOCK;
+    bool fill = last - first < HVAC_SHM_FILL_BLOCKS;
+    char *out = (char *)buf;
+
+    for (int64_t block = first; block <= last; block++)
+    {
+        int32_t idx = hvac_shm_pin(key, block, size, fill, fetch, arg);
+        if (idx < 0)
+            return -1;
+        int64_t start = block * HVAC_SHM_BLOCK;
+        int64_t from = std::max<int64_t>(offset, start);
+        int64_t to = std::min<int64_t>(end, start + HVAC_SHM_BLOCK);
+        memcpy(out, shm_data + (size_t)idx * HVAC_SHM_BLOCK + (from - start), to - from);
+        out += to - from;
+        hvac_shm_unpin(idx);
+    }
+    return end - offset;
+}
+
+void hvac_shm_cache_detach()
+{
+    /* A fork child's copy of the mapping is not counted, it may exec and
+     * never get here */
+    if (shm_hdr == NULL || shm_pid != getpid())
+        return;
+    /* Last process on the node */
+    if (__atomic_sub_fetch(&shm_hdr->users, 1, __ATOMIC_ACQ_REL) == 0)
+        shm_unlink(shm_name);
+}
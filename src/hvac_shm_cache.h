@@ -0,0 +1,52 @@
+#ifndef __HVAC_SHM_CACHE_H__
+#define __HVAC_SHM_CACHE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+
+/* Node-shared block cache, client side
+ *
+ * Every client process on a node maps the shared memory segment
+ * /hvac_blk.<jobid>.<run>, the first one creates it. <run> is the run id of
+ * the server address table, blocks cached for an earlier run of the same
+ * job are never served. Files are cached in
+ * HVAC_SHM_BLOCK sized blocks keyed by a hash of the path and size and the
+ * block number. The index is split into HVAC_SHM_SHARDS shards, each owns a
+ * fixed range of blocks, a bucket array and a process shared robust mutex,
+ * so a lookup, insert or eviction only locks one shard. A reader pins the
+ * block under the shard lock and copies it out after dropping the lock,
+ * eviction is CLOCK over the shard's blocks and skips pinned ones.
+ *
+ * A read that finds all its blocks costs one copy per block and no RPC.
+ * Missing blocks of reads up to HVAC_SHM_FILL_BLOCKS blocks are fetched
+ * whole through the fetch callback straight into the segment, larger reads
+ * only use blocks already there. Other ranks wanting a block being filled
+ * wait for it instead of fetching it again. The segment is unlinked by the
+ * last process to unload the library. Forked children share their parent's
+ * count, a process killed by a signal leaves its count behind and with it
+ * the segment until /dev/shm is cleaned.
+ *
+ * Environment
+ *   HVAC_SHM_CACHE_MB   segment size, 0 disables the cache (0)
+ */
+#define HVAC_SHM_BLOCK (1 << 20)
+#define HVAC_SHM_SHARDS 64
+#define HVAC_SHM_FILL_BLOCKS 4
+
+struct hvac_shm_key {
+    uint64_t h1;
+    uint64_t h2;
+};
+
+/* Reads len bytes at offset of the file into dst, bytes read or -1 */
+typedef ssize_t (*hvac_shm_fetch_fn)(void *arg, void *dst, size_t len, off_t offset);
+
+struct hvac_shm_key hvac_shm_cache_key(const std::string &path, int64_t size);
+/* All of the request or -1, the caller then reads remotely */
+ssize_t hvac_shm_cache_read(const struct hvac_shm_key &key, int64_t size, void *buf, size_t count,
+                            off_t offset, hvac_shm_fetch_fn fetch, void *arg);
+/* Library unload, drops our use of the segment */
+void hvac_shm_cache_detach();
+
+#endif
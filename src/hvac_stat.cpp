@@ -0,0 +1,189 @@
+/* hvac_stat - poll the stats RPC of every server listed in .ports.cfg
+ *
+ * hvac_stat [-j jobid] [-i seconds] [-n count]
+ *   -j  job whose ./.ports.cfg.<jobid> to read (default $SLURM_JOBID)
+ *   -i  repeat every so many seconds, rates are computed between polls
+ *   -n  stop after this many polls
+ *
+ * Run it from the directory the servers were started in.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "hvac_comm.h"
+#include "hvac_stats.h"
+#include "hvac_bootstrap.h"
+
+extern "C" {
+#include "hvac_logging.h"
+}
+
+using namespace std;
+
+/* Referenced by the logging code */
+__thread bool tl_disable_redirect = false;
+
+static const char *op_names[HVAC_STAT_OPS] = { "open", "read", "close", "copy" };
+
+static vector<int> hvac_stat_ranks(const char *jobid)
+{
+    char filename[PATH_MAX];
+    char line[3 * PATH_MAX];
+    int rank;
+    set<int> ranks;
+
+    snprintf(filename, sizeof(filename), "./.ports.cfg.%s", jobid);
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return vector<int>();
+    }
+    /* Lines are "rank addr [sm_addr host]" */
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "%d", &rank) == 1)
+            ranks.insert(rank);
+    fclose(fp);
+    return vector<int>(ranks.begin(), ranks.end());
+}
+
+static double pct(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0;
+}
+
+static void hvac_stat_print(map<int, hvac_server_stats> &cur, map<int, hvac_server_stats> &prev,
+                            double interval)
+{
+    hvac_server_stats total;
+    memset(&total, 0, sizeof(total));
+
+    printf("%5s %9s %9s %6s %11s %11s %9s %6s %6s %7s %5s %9s %9s\n", "rank", "opens",
+           "reads", "hit%", "nvme_MB", "pfs_MB", "MB/s", "queue", "cached", "handles", "infl",
+           "rd_p50us", "rd_p99us");
+    for (auto &it : cur)
+    {
+        hvac_server_stats &s = it.second;
+        uint64_t reads = s.read_hits + s.read_misses;
+        double rate = 0;
+
+        auto p = prev.find(it.first);
+        if (interval > 0 && p != prev.end())
+            rate = ((s.bytes_nvme + s.bytes_pfs) -
+                    (p->second.bytes_nvme + p->second.bytes_pfs)) / interval / 1e6;
+
+        printf("%5d %9lu %9lu %6.1f %11.1f %11.1f %9.1f %6lu %6lu %7lu %5lu %9.1f %9.1f\n",
+               s.rank, (unsigned long)(s.open_hits + s.open_misses), (unsigned long)reads,
+               pct(s.read_hits, reads), s.bytes_nvme / 1e6, s.bytes_pfs / 1e6, rate,
+               (unsigned long)s.mover_queue, (unsigned long)s.mover_cached,
+               (unsigned long)s.open_handles, (unsigned long)s.inflight,
+               hvac_hist_quantile(&s.lat[HVAC_STAT_READ], 0.5) / 1e3,
+               hvac_hist_quantile(&s.lat[HVAC_STAT_READ], 0.99) / 1e3);
+
+        total.open_hits += s.open_hits;
+        total.open_misses += s.open_misses;
+        total.read_hits += s.read_hits;
+        total.read_misses += s.read_misses;
+        total.read_errors += s.read_errors;
+        total.bytes_nvme += s.bytes_nvme;
+        total.bytes_pfs += s.bytes_pfs;
+        total.bytes_copied += s.bytes_copied;
+        for (int i = 0; i < HVAC_STAT_OPS; i++)
+            hvac_hist_merge(&total.lat[i], &s.lat[i]);
+    }
+
+    uint64_t reads = total.read_hits + total.read_misses;
+    printf("\nall: open hit %.1f%%, read hit %.1f%%, %lu read errors, %.1f MB copied to NVMe\n",
+           pct(total.open_hits, total.open_hits + total.open_misses), pct(total.read_hits, reads),
+           (unsigned long)total.read_errors, total.bytes_copied / 1e6);
+    printf("%-6s %10s %10s %10s %10s %10s %10s\n", "op", "count", "mean_us", "p50_us", "p90_us",
+           "p99_us", "max_us");
+    for (int i = 0; i < HVAC_STAT_OPS; i++)
+    {
+        hvac_histogram *h = &total.lat[i];
+        printf("%-6s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_names[i],
+               (unsigned long)h->count, hvac_hist_mean(h) / 1e3,
+               hvac_hist_quantile(h, 0.5) / 1e3, hvac_hist_quantile(h, 0.9) / 1e3,
+               hvac_hist_quantile(h, 0.99) / 1e3, h->max / 1e3);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    const char *jobid = getenv("SLURM_JOBID");
+    int interval = 0;
+    int count = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:i:n:")) != -1)
+    {
+        switch (opt) {
+        case 'j':
+            jobid = optarg;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-j jobid] [-i seconds] [-n count]\n", argv[0]);
+            return 1;
+        }
+    }
+    /* Without -n, poll once, or until interrupted with -i */
+    if (count < 0)
+        count = interval > 0 ? 0 : 1;
+    if (jobid == NULL)
+    {
+        fprintf(stderr, "No job id, set SLURM_JOBID or pass -j\n");
+        return 1;
+    }
+    /* The address lookup reads the ports file of $SLURM_JOBID */
+    setenv("SLURM_JOBID", jobid, 1);
+
+    vector<int> ranks = hvac_stat_ranks(jobid);
+    if (ranks.empty())
+    {
+        fprintf(stderr, "No servers listed for job %s\n", jobid);
+        return 1;
+    }
+
+    hvac_init_logging();
+    hvac_init_comm(false);
+    hvac_client_comm_register_rpc();
+
+    map<int, hvac_server_stats> prev, cur;
+    for (int iter = 0; count == 0 || iter < count; iter++)
+    {
+        if (iter > 0)
+            sleep(interval);
+        cur.clear();
+        for (int rank : ranks)
+        {
+            hvac_server_stats s;
+            if (hvac_client_comm_gen_stats_rpc(rank, &s) == 0)
+                cur[rank] = s;
+            else
+                fprintf(stderr, "rank %d: no stats (version mismatch?)\n", rank);
+        }
+        if (iter > 0)
+            printf("\n");
+        hvac_stat_print(cur, prev, iter > 0 ? interval : 0);
+        prev.swap(cur);
+    }
+
+    hvac_bootstrap_detach();
+    hvac_shutdown_comm();
+    return 0;
+}
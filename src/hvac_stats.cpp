@@ -0,0 +1,135 @@
+/* Server counters behind the stats RPC.
+ * Recording is a handful of relaxed atomic adds, the snapshot is taken
+ * without stopping the handlers.
+ */
+#include <atomic>
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "hvac_stats.h"
+#include "hvac_telemetry.h"
+#include "hvac_open_cache.h"
+#include "hvac_data_mover_internal.h"
+
+using namespace std;
+
+static int stats_rank = -1;
+static uint64_t stats_start_ns = 0;
+
+static std::atomic<uint64_t> stat_open_hits(0);
+static std::atomic<uint64_t> stat_open_misses(0);
+static std::atomic<uint64_t> stat_read_hits(0);
+static std::atomic<uint64_t> stat_read_misses(0);
+static std::atomic<uint64_t> stat_read_errors(0);
+static std::atomic<uint64_t> stat_bytes_nvme(0);
+static std::atomic<uint64_t> stat_bytes_pfs(0);
+static std::atomic<uint64_t> stat_bytes_copied(0);
+static std::atomic<uint64_t> stat_inflight(0);
+static std::atomic<uint64_t> stat_mover_queue(0);
+/* Moving average of pread time, 1/8 weight per sample */
+static std::atomic<uint64_t> stat_read_avg_ns(0);
+static struct hvac_histogram stat_lat[HVAC_STAT_OPS];
+
+void hvac_stats_init(int rank)
+{
+    stats_rank = rank;
+    stats_start_ns = hvac_trace_now();
+}
+
+void hvac_stats_record(int op, uint64_t ns)
+{
+    hvac_hist_record(&stat_lat[op], ns);
+    if (op == HVAC_STAT_READ)
+    {
+        /* Lossy under concurrent readers, good enough for a load hint */
+        int64_t avg = stat_read_avg_ns.load(std::memory_order_relaxed);
+        stat_read_avg_ns.store(avg + ((int64_t)ns - avg) / 8, std::memory_order_relaxed);
+    }
+}
+
+void hvac_stats_open(bool nvme)
+{
+    if (nvme)
+        stat_open_hits.fetch_add(1, std::memory_order_relaxed);
+    else
+        stat_open_misses.fetch_add(1, std::memory_order_relaxed);
+}
+
+void hvac_stats_read(bool nvme, ssize_t bytes)
+{
+    if (bytes < 0)
+    {
+        stat_read_errors.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (nvme)
+    {
+        stat_read_hits.fetch_add(1, std::memory_order_relaxed);
+        stat_bytes_nvme.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    else
+    {
+        stat_read_misses.fetch_add(1, std::memory_order_relaxed);
+        stat_bytes_pfs.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+void hvac_stats_copy(uint64_t bytes)
+{
+    stat_bytes_copied.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void hvac_stats_rpc_begin()
+{
+    stat_inflight.fetch_add(1, std::memory_order_relaxed);
+}
+
+void hvac_stats_rpc_end()
+{
+    stat_inflight.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void hvac_stats_mover(int delta)
+{
+    stat_mover_queue.fetch_add(delta, std::memory_order_relaxed);
+}
+
+uint32_t hvac_stats_load()
+{
+    uint64_t inflight = stat_inflight.load(std::memory_order_relaxed);
+    uint64_t mover = stat_mover_queue.load(std::memory_order_relaxed);
+    uint64_t svc_us = stat_read_avg_ns.load(std::memory_order_relaxed) / 1000;
+    uint32_t svc_log2 = svc_us ? 64 - __builtin_clzll(svc_us) : 0;
+
+    return (uint32_t)(inflight < 0xffff ? inflight : 0xffff) |
+           (uint32_t)(mover < 0xff ? mover : 0xff) << 16 |
+           svc_log2 << 24;
+}
+
+void hvac_stats_snapshot(struct hvac_server_stats *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->version = HVAC_STATS_VERSION;
+    out->rank = stats_rank;
+    out->uptime_ns = hvac_trace_now() - stats_start_ns;
+    out->open_hits = stat_open_hits.load(std::memory_order_relaxed);
+    out->open_misses = stat_open_misses.load(std::memory_order_relaxed);
+    out->read_hits = stat_read_hits.load(std::memory_order_relaxed);
+    out->read_misses = stat_read_misses.load(std::memory_order_relaxed);
+    out->read_errors = stat_read_errors.load(std::memory_order_relaxed);
+    out->bytes_nvme = stat_bytes_nvme.load(std::memory_order_relaxed);
+    out->bytes_pfs = stat_bytes_pfs.load(std::memory_order_relaxed);
+    out->bytes_copied = stat_bytes_copied.load(std::memory_order_relaxed);
+    out->inflight = stat_inflight.load(std::memory_order_relaxed);
+    out->open_handles = hvac_open_cache_count();
+
+    pthread_mutex_lock(&data_mutex);
+    out->mover_queue = data_queue.size();
+    out->mover_cached = path_cache_map.size();
+    pthread_mutex_unlock(&data_mutex);
+
+    for (int i = 0; i < HVAC_STAT_OPS; i++)
+        hvac_hist_snapshot(&out->lat[i], &stat_lat[i]);
+}
@@ -0,0 +1,72 @@
+#ifndef __HVAC_STATS_H__
+#define __HVAC_STATS_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hvac_histogram.h"
+
+/* Live server counters, returned whole by the stats RPC and printed by hvac_stat.
+ * The struct travels as raw bytes, servers and clients of one job are
+ * expected to share an architecture. Bump HVAC_STATS_VERSION on any change.
+ */
+#define HVAC_STATS_VERSION 1
+
+enum hvac_stat_op {
+    HVAC_STAT_OPEN = 0,
+    HVAC_STAT_READ,
+    HVAC_STAT_CLOSE,
+    HVAC_STAT_COPY,
+    HVAC_STAT_OPS
+};
+
+struct hvac_server_stats {
+    uint32_t version;
+    int32_t rank;
+    uint64_t uptime_ns;
+    /* Opens and reads answered from the NVMe copy (hits) or the PFS (misses) */
+    uint64_t open_hits;
+    uint64_t open_misses;
+    uint64_t read_hits;
+    uint64_t read_misses;
+    uint64_t read_errors;
+    uint64_t bytes_nvme;
+    uint64_t bytes_pfs;
+    uint64_t bytes_copied;
+    /* Files waiting for the data mover, files already on the NVMe */
+    uint64_t mover_queue;
+    uint64_t mover_cached;
+    uint64_t open_handles;
+    uint64_t inflight;
+    struct hvac_histogram lat[HVAC_STAT_OPS];
+};
+
+void hvac_stats_init(int rank);
+void hvac_stats_record(int op, uint64_t ns);
+void hvac_stats_open(bool nvme);
+void hvac_stats_read(bool nvme, ssize_t bytes);
+void hvac_stats_copy(uint64_t bytes);
+void hvac_stats_rpc_begin();
+void hvac_stats_rpc_end();
+void hvac_stats_mover(int delta);
+void hvac_stats_snapshot(struct hvac_server_stats *out);
+
+/* Load word carried by every open and read response
+ *   bits  0-15  RPCs in flight
+ *   bits 16-23  files queued for the data mover, they compete for the NVMe
+ *   bits 24-31  recent pread service time, log2 of microseconds
+ */
+uint32_t hvac_stats_load();
+
+#define HVAC_LOAD_INFLIGHT(load) ((load) & 0xffff)
+#define HVAC_LOAD_MOVER(load) (((load) >> 16) & 0xff)
+#define HVAC_LOAD_SVC_LOG2(load) ((load) >> 24)
+
+/* Expected wait for a new request in microseconds: everything in flight
+ * ahead of it at the current service time, stretched by copy traffic */
+static inline uint64_t hvac_load_wait_us(uint32_t load)
+{
+    uint64_t svc_us = 1ULL << (HVAC_LOAD_SVC_LOG2(load) < 40 ? HVAC_LOAD_SVC_LOG2(load) : 40);
+    return (uint64_t)HVAC_LOAD_INFLIGHT(load) * svc_us * (8 + HVAC_LOAD_MOVER(load)) / 8;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/* Per thread telemetry rings and the background flusher.
+ * See hvac_telemetry.h for the record and file formats.
+ */
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <atomic>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "hvac_logging.h"
+#include "hvac_telemetry.h"
+
+using namespace std;
+
+#define HVAC_TRACE_RING_SIZE 8192   /* records, power of two */
+#define HVAC_TRACE_FLUSH_US 100000
+
+struct hvac_trace_ring {
+    std::atomic<uint64_t> head;     /* written by the owning thread */
+    std::atomic<uint64_t> tail;     /* written by the flusher */
+    std::atomic<uint64_t> dropped;
+    hvac_trace_rec recs[HVAC_TRACE_RING_SIZE];
+};
+
+static bool trace_enabled = false;
+static volatile bool trace_shutdown = false;
+static FILE *trace_file = NULL;
+static pthread_t trace_tid;
+
+/* Rings are registered once per thread and never freed */
+static pthread_mutex_t trace_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<hvac_trace_ring *> trace_rings;
+static __thread hvac_trace_ring *tl_trace_ring = NULL;
+
+/* Path names are written once, the records carry the hash */
+static pthread_mutex_t trace_path_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unordered_set<uint64_t> trace_path_seen;
+static vector<pair<uint64_t, string>> trace_path_pending;
+
+static hvac_trace_ring *hvac_trace_get_ring()
+{
+    if (tl_trace_ring == NULL)
+    {
+        hvac_trace_ring *ring = new hvac_trace_ring;
+        ring->head.store(0);
+        ring->tail.store(0);
+        ring->dropped.store(0);
+        pthread_mutex_lock(&trace_ring_mutex);
+        trace_rings.push_back(ring);
+        pthread_mutex_unlock(&trace_ring_mutex);
+        tl_trace_ring = ring;
+    }
+    return tl_trace_ring;
+}
+
+void hvac_trace(uint16_t op, uint16_t flags, uint64_t path_id, uint64_t bytes,
+                uint64_t t_start, uint64_t t_end)
+{
+    if (!trace_enabled)
+        return;
+
+    hvac_trace_ring *ring = hvac_trace_get_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= HVAC_TRACE_RING_SIZE)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    hvac_trace_rec *rec = &ring->recs[head & (HVAC_TRACE_RING_SIZE - 1)];
+    rec->t_start = t_start;
+    rec->t_end = t_end;
+    rec->path_id = path_id;
+    rec->bytes = bytes;
+    rec->op = op;
+    rec->flags = flags;
+    rec->pad = 0;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+uint64_t hvac_trace_path_id(const string &path)
+{
+    /* FNV-1a */
+    uint64_t id = 14695981039346656037ULL;
+    for (unsigned char c : path)
+    {
+        id ^= c;
+        id *= 1099511628211ULL;
+    }
+
+    if (trace_enabled)
+    {
+        pthread_mutex_lock(&trace_path_mutex);
+        if (trace_path_seen.insert(id).second)
+            trace_path_pending.push_back(make_pair(id, path));
+        pthread_mutex_unlock(&trace_path_mutex);
+    }
+    return id;
+}
+
+static void hvac_trace_write_block(uint32_t type, const void *data, uint32_t length)
+{
+    hvac_trace_block_hdr hdr;
+    hdr.type = type;
+    hdr.length = length;
+    fwrite(&hdr, sizeof(hdr), 1, trace_file);
+    fwrite(data, 1, length, trace_file);
+}
+
+static void hvac_trace_flush()
+{
+    vector<pair<uint64_t, string>> paths;
+    vector<hvac_trace_ring *> rings;
+    uint64_t dropped = 0;
+
+    pthread_mutex_lock(&trace_path_mutex);
+    paths.swap(trace_path_pending);
+    pthread_mutex_unlock(&trace_path_mutex);
+
+    for (auto &p : paths)
+    {
+        vector<char> buf(sizeof(uint64_t) + p.second.size());
+        memcpy(buf.data(), &p.first, sizeof(uint64_t));
+        memcpy(buf.data() + sizeof(uint64_t), p.second.data(), p.second.size());
+        hvac_trace_write_block(HVAC_TRACE_BLOCK_PATH, buf.data(), buf.size());
+    }
+
+    pthread_mutex_lock(&trace_ring_mutex);
+    rings = trace_rings;
+    pthread_mutex_unlock(&trace_ring_mutex);
+
+    for (hvac_trace_ring *ring : rings)
+    {
+        uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+
+        /* Contiguous runs, the ring may wrap once */
+        while (tail != head)
+        {
+            uint64_t idx = tail & (HVAC_TRACE_RING_SIZE - 1);
+            uint64_t run = head - tail;
+            if (run > HVAC_TRACE_RING_SIZE - idx)
+                run = HVAC_TRACE_RING_SIZE - idx;
+            hvac_trace_write_block(HVAC_TRACE_BLOCK_RECS, &ring->recs[idx],
+                                   run * sizeof(hvac_trace_rec));
+            tail += run;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+        dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+    }
+
+    if (dropped)
+        hvac_trace_write_block(HVAC_TRACE_BLOCK_DROPS, &dropped, sizeof(dropped));
+    fflush(trace_file);
+}
+
+static void *hvac_trace_flush_fn(void *args)
+{
+    while (!trace_shutdown)
+    {
+        usleep(HVAC_TRACE_FLUSH_US);
+        hvac_trace_flush();
+    }
+    hvac_trace_flush();
+    return NULL;
+}
+
+void hvac_telemetry_init(int rank)
+{
+    char filename[PATH_MAX];
+    const char *dir = getenv("HVAC_TRACE_DIR");
+    const char *enable = getenv("HVAC_TRACE");
+    hvac_trace_header hdr;
+    struct timespec ts;
+
+    if (enable != NULL && atoi(enable) == 0)
+        return;
+
+    snprintf(filename, sizeof(filename), "%s/hvac_trace_%d.bin", dir ? dir : ".", rank);
+    trace_file = fopen(filename, "w");
+    if (trace_file == NULL)
+    {
+        L4C_ERR("Could not open trace file %s, telemetry disabled", filename);
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HVAC_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = 1;
+    hdr.rank = rank;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hdr.start_realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    hdr.start_mono_ns = hvac_trace_now();
+    fwrite(&hdr, sizeof(hdr), 1, trace_file);
+    fflush(trace_file);
+
+    trace_enabled = true;
+    if (pthread_create(&trace_tid, NULL, hvac_trace_flush_fn, NULL) != 0)
+    {
+        L4C_ERR("Failed to start telemetry flush thread");
+        trace_enabled = false;
+        fclose(trace_file);
+        trace_file = NULL;
+        return;
+    }
+    L4C_INFO("Telemetry writing to %s", filename);
+}
+
+void hvac_telemetry_shutdown()
+{
+    if (!trace_enabled)
+        return;
+    trace_enabled = false;
+    trace_shutdown = true;
+    pthread_join(trace_tid, NULL);
+    fclose(trace_file);
+    trace_file = NULL;
+}
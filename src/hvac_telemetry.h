@@ -0,0 +1,79 @@
+#ifndef __HVAC_TELEMETRY_H__
+#define __HVAC_TELEMETRY_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+using namespace std;
+/* Always-on binary telemetry
+ *
+ * Each thread that records gets its own single producer ring of fixed size
+ * records, so recording is two clock reads and a store with no locks. A
+ * background thread drains the rings into hvac_trace_<rank>.bin and
+ * hvac_trace_decode turns that into a summary offline.
+ *
+ * Environment
+ *   HVAC_TRACE      0 disables recording
+ *   HVAC_TRACE_DIR  directory for the trace file (default ".")
+ */
+
+enum hvac_trace_op {
+    HVAC_TRACE_OPEN = 1,
+    HVAC_TRACE_READ = 2,
+    HVAC_TRACE_CLOSE = 3,
+    HVAC_TRACE_COPY = 4,
+};
+
+/* Record flags */
+#define HVAC_TRACE_F_NVME  0x1   /* served from the NVMe copy */
+#define HVAC_TRACE_F_ERROR 0x2
+
+struct hvac_trace_rec {
+    uint64_t t_start;   /* CLOCK_MONOTONIC ns */
+    uint64_t t_end;
+    uint64_t path_id;
+    uint64_t bytes;
+    uint16_t op;
+    uint16_t flags;
+    uint32_t pad;
+};
+
+/* File layout: header, then blocks of (type, length, payload) */
+#define HVAC_TRACE_MAGIC "HVACTRC1"
+struct hvac_trace_header {
+    char magic[8];
+    uint32_t version;
+    int32_t rank;
+    uint64_t start_realtime_ns;
+    uint64_t start_mono_ns;
+};
+
+enum hvac_trace_block {
+    HVAC_TRACE_BLOCK_RECS = 1,   /* array of hvac_trace_rec */
+    HVAC_TRACE_BLOCK_PATH = 2,   /* uint64_t path_id followed by the path bytes */
+    HVAC_TRACE_BLOCK_DROPS = 3,  /* uint64_t records dropped since the last block */
+};
+
+struct hvac_trace_block_hdr {
+    uint32_t type;
+    uint32_t length;
+};
+
+static inline uint64_t hvac_trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void hvac_telemetry_init(int rank);
+void hvac_telemetry_shutdown();
+
+/* Hashes path and registers the name in the trace once */
+uint64_t hvac_trace_path_id(const string &path);
+
+void hvac_trace(uint16_t op, uint16_t flags, uint64_t path_id, uint64_t bytes,
+                uint64_t t_start, uint64_t t_end);
+
+#endif
@@ -0,0 +1,198 @@
+/* Offline decoder for the hvac_trace_<rank>.bin files written by the server.
+ *
+ * hvac_trace_decode [-d] trace.bin [trace.bin ...]
+ *   -d  dump every record as text instead of only the summary
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hvac_telemetry.h"
+
+using namespace std;
+
+struct op_summary {
+    vector<uint64_t> lat;
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+    uint64_t nvme = 0;
+};
+
+static unordered_map<uint64_t, string> path_names;
+static unordered_map<uint64_t, uint64_t> path_bytes;
+static map<uint16_t, op_summary> ops;
+static uint64_t dropped = 0;
+static uint64_t first_ns = UINT64_MAX, last_ns = 0;
+
+static const char *op_name(uint16_t op)
+{
+    switch (op) {
+    case HVAC_TRACE_OPEN: return "open";
+    case HVAC_TRACE_READ: return "read";
+    case HVAC_TRACE_CLOSE: return "close";
+    case HVAC_TRACE_COPY: return "copy";
+    }
+    return "unknown";
+}
+
+static const char *path_name(uint64_t id)
+{
+    auto it = path_names.find(id);
+    return it == path_names.end() ? "?" : it->second.c_str();
+}
+
+static int decode_file(const char *filename, bool dump)
+{
+    hvac_trace_header hdr;
+    hvac_trace_block_hdr blk;
+    vector<char> payload;
+    vector<hvac_trace_rec> recs;
+
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, HVAC_TRACE_MAGIC, sizeof(hdr.magic)) != 0)
+    {
+        fprintf(stderr, "%s: not an HVAC trace\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    /* A trace may be cut short while the server is running, stop at the last whole block */
+    while (fread(&blk, sizeof(blk), 1, fp) == 1)
+    {
+        payload.resize(blk.length);
+        if (fread(payload.data(), 1, blk.length, fp) != blk.length)
+            break;
+
+        if (blk.type == HVAC_TRACE_BLOCK_PATH && blk.length >= sizeof(uint64_t))
+        {
+            uint64_t id;
+            memcpy(&id, payload.data(), sizeof(id));
+            path_names[id] = string(payload.data() + sizeof(id), blk.length - sizeof(id));
+        }
+        else if (blk.type == HVAC_TRACE_BLOCK_DROPS && blk.length == sizeof(uint64_t))
+        {
+            uint64_t n;
+            memcpy(&n, payload.data(), sizeof(n));
+            dropped += n;
+        }
+        else if (blk.type == HVAC_TRACE_BLOCK_RECS)
+        {
+            size_t n = blk.length / sizeof(hvac_trace_rec);
+            size_t base = recs.size();
+            recs.resize(base + n);
+            memcpy(&recs[base], payload.data(), n * sizeof(hvac_trace_rec));
+        }
+    }
+    fclose(fp);
+
+    /* Records reference paths that may be registered in a later block */
+    for (const hvac_trace_rec &rec : recs)
+    {
+        op_summary &s = ops[rec.op];
+        s.lat.push_back(rec.t_end - rec.t_start);
+        s.bytes += rec.bytes;
+        if (rec.flags & HVAC_TRACE_F_ERROR)
+            s.errors++;
+        if (rec.flags & HVAC_TRACE_F_NVME)
+            s.nvme++;
+        if (rec.op == HVAC_TRACE_READ)
+            path_bytes[rec.path_id] += rec.bytes;
+        first_ns = min(first_ns, (uint64_t)rec.t_start);
+        last_ns = max(last_ns, (uint64_t)rec.t_end);
+
+        if (dump)
+        {
+            printf("%d %.9f %s %lu ns %lu bytes%s%s %s\n", hdr.rank,
+                   (rec.t_start - hdr.start_mono_ns) / 1e9, op_name(rec.op),
+                   (unsigned long)(rec.t_end - rec.t_start), (unsigned long)rec.bytes,
+                   (rec.flags & HVAC_TRACE_F_NVME) ? " nvme" : "",
+                   (rec.flags & HVAC_TRACE_F_ERROR) ? " error" : "",
+                   path_name(rec.path_id));
+        }
+    }
+    return 0;
+}
+
+static uint64_t percentile(const vector<uint64_t> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+static void print_summary()
+{
+    double span = (last_ns > first_ns) ? (last_ns - first_ns) / 1e9 : 0;
+
+    printf("%-6s %10s %8s %8s %14s %10s %10s %10s %10s %10s\n", "op", "count", "errors",
+           "nvme", "bytes", "MB/s", "mean_us", "p50_us", "p99_us", "max_us");
+    for (auto &it : ops)
+    {
+        op_summary &s = it.second;
+        uint64_t total = 0;
+        sort(s.lat.begin(), s.lat.end());
+        for (uint64_t l : s.lat)
+            total += l;
+        printf("%-6s %10zu %8lu %8lu %14lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               op_name(it.first), s.lat.size(), (unsigned long)s.errors, (unsigned long)s.nvme,
+               (unsigned long)s.bytes, span > 0 ? s.bytes / span / 1e6 : 0,
+               s.lat.empty() ? 0 : total / 1e3 / s.lat.size(),
+               percentile(s.lat, 0.5) / 1e3, percentile(s.lat, 0.99) / 1e3,
+               s.lat.empty() ? 0 : s.lat.back() / 1e3);
+    }
+    printf("span %.3f s, %lu records dropped\n", span, (unsigned long)dropped);
+
+    vector<pair<uint64_t, uint64_t>> top(path_bytes.begin(), path_bytes.end());
+    sort(top.begin(), top.end(),
+         [](const pair<uint64_t, uint64_t> &a, const pair<uint64_t, uint64_t> &b) {
+             return a.second > b.second;
+         });
+    if (!top.empty())
+        printf("\ntop files by bytes read\n");
+    for (size_t i = 0; i < top.size() && i < 10; i++)
+        printf("%14lu %s\n", (unsigned long)top[i].second, path_name(top[i].first));
+}
+
+int main(int argc, char **argv)
+{
+    bool dump = false;
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "d")) != -1)
+    {
+        if (opt == 'd')
+            dump = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [-d] trace.bin [trace.bin ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-d] trace.bin [trace.bin ...]\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = optind; i < argc; i++)
+        if (decode_file(argv[i], dump) != 0)
+            rc = 1;
+
+    if (!dump)
+        print_summary();
+    return rc;
+}
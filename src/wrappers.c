@@ -19,6 +19,9 @@
 #include <dlfcn.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "hvac_internal.h"
 #include "hvac_logging.h"
@@ -36,22 +39,218 @@ extern __thread bool tl_disable_redirect;
 
 
 
+/* Read-only streams on tracked files are built with fopencookie. glibc
+ * refills FILE buffers with internal reads that never reach our read()
+ * wrapper, the cookie callbacks route those refills through HVAC instead.
+ * glibc's fileno() returns -1 on cookie streams, our wrapper finds the fd
+ * in the list of live streams. The fd's HVAC position follows the stream's
+ * so lseek(fileno(fp), 0, SEEK_CUR) answers as it would on a plain stream.
+ */
+struct hvac_stream {
+	int fd;
+	off64_t offset;
+	char *buf;
+	FILE *fp;
+	struct hvac_stream *next;
+};
+
+static pthread_mutex_t hvac_stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hvac_stream *hvac_streams = NULL;
+
+static void hvac_stream_unlink(struct hvac_stream *stream)
+{
+	pthread_mutex_lock(&hvac_stream_mutex);
+	for (struct hvac_stream **it = &hvac_streams; *it != NULL; it = &(*it)->next)
+	{
+		if (*it == stream)
+		{
+			*it = stream->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hvac_stream_mutex);
+}
+
+/* -1 if fp is not one of ours */
+static int hvac_stream_fd(FILE *fp)
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&hvac_stream_mutex);
+	for (struct hvac_stream *it = hvac_streams; it != NULL; it = it->next)
+	{
+		if (it->fp == fp)
+		{
+			fd = it->fd;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&hvac_stream_mutex);
+	return fd;
+}
+
+static ssize_t hvac_stream_read(void *cookie, char *buf, size_t size)
+{
+	struct hvac_stream *stream = (struct hvac_stream *)cookie;
+	ssize_t ret;
+	int outcome = HVAC_CSTAT_REMOTE;
+	uint64_t t0 = hvac_cstat_begin();
+
+	ret = hvac_remote_pread(stream->fd, buf, size, stream->offset);
+	if (ret == -1)
+	{
+		MAP_OR_FAIL(pread);
+		ret = __real_pread(stream->fd, buf, size, stream->offset);
+		outcome = HVAC_CSTAT_FALLBACK;
+	}
+	hvac_cstat_end(HVAC_CSTAT_READ, outcome, t0);
+	if (ret > 0)
+	{
+		stream->offset += ret;
+		hvac_set_offset(stream->fd, stream->offset);
+	}
+	return ret;
+}
+
+static int hvac_stream_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct hvac_stream *stream = (struct hvac_stream *)cookie;
+	struct stat st;
+	off64_t base;
+
+	switch (whence)
+	{
+		case SEEK_SET:
+			base = 0;
+			break;
+		case SEEK_CUR:
+			base = stream->offset;
+			break;
+		case SEEK_END:
+			if (fstat(stream->fd, &st) != 0)
+				return -1;
+			base = st.st_size;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	if (base + *offset < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	stream->offset = base + *offset;
+	*offset = stream->offset;
+	hvac_set_offset(stream->fd, stream->offset);
+	return 0;
+}
+
+static int hvac_stream_close(void *cookie)
+{
+	struct hvac_stream *stream = (struct hvac_stream *)cookie;
+	int ret;
+	uint64_t t0 = hvac_cstat_begin();
+
+	MAP_OR_FAIL(close);
+	hvac_stream_unlink(stream);
+	hvac_remove_fd(stream->fd);
+	ret = __real_close(stream->fd);
+	hvac_cstat_end(HVAC_CSTAT_CLOSE, HVAC_CSTAT_REMOTE, t0);
+	free(stream->buf);
+	free(stream);
+	return ret;
+}
+
+/* Returns NULL with *handled false when the caller should use the real fopen */
+static FILE *hvac_fopen_stream(const char *path, const char *mode, bool *handled)
+{
+	cookie_io_functions_t funcs = {
+		.read = hvac_stream_read,
+		.write = NULL,
+		.seek = hvac_stream_seek,
+		.close = hvac_stream_close,
+	};
+	struct hvac_stream *stream;
+	FILE *ptr;
+	int fd;
+	uint64_t t0;
+
+	*handled = false;
+	if (mode[0] != 'r' || strchr(mode, '+') != NULL)
+	{
+		return NULL;
+	}
+
+	/* fopen is open + fdopen, do the open ourselves so we can pick the stream type */
+	t0 = hvac_cstat_begin();
+	MAP_OR_FAIL(open);
+	fd = __real_open(path, O_RDONLY | (strchr(mode, 'e') ? O_CLOEXEC : 0));
+	*handled = true;
+	if (fd == -1)
+	{
+		hvac_cstat_end(HVAC_CSTAT_OPEN, HVAC_CSTAT_UNTRACKED, t0);
+		return NULL;
+	}
+
+	if (!hvac_track_file(path, O_RDONLY, fd))
+	{
+		ptr = fdopen(fd, mode);
+		hvac_cstat_end(HVAC_CSTAT_OPEN, hvac_cstat_open_outcome(false), t0);
+		return ptr;
+	}
+
+	L4C_INFO("FOpen: Streaming tracked file %s through HVAC",path);
+	stream = (struct hvac_stream *)calloc(1, sizeof(*stream));
+	stream->fd = fd;
+	stream->buf = (char *)malloc(HVAC_STDIO_BUFSIZE);
+	ptr = fopencookie(stream, mode, funcs);
+	if (ptr == NULL)
+	{
+		free(stream->buf);
+		free(stream);
+		ptr = fdopen(fd, mode);
+		hvac_cstat_end(HVAC_CSTAT_OPEN, HVAC_CSTAT_REMOTE, t0);
+		return ptr;
+	}
+	/* glibc ignores the size when it allocates the buffer itself */
+	setvbuf(ptr, stream->buf, _IOFBF, HVAC_STDIO_BUFSIZE);
+	stream->fp = ptr;
+	pthread_mutex_lock(&hvac_stream_mutex);
+	stream->next = hvac_streams;
+	hvac_streams = stream;
+	pthread_mutex_unlock(&hvac_stream_mutex);
+	hvac_cstat_end(HVAC_CSTAT_OPEN, HVAC_CSTAT_REMOTE, t0);
+	return ptr;
+}
+
 /* fopen wrapper */
 FILE *WRAP_DECL(fopen)(const char *path, const char *mode)
 {
+	bool handled;
 
 	MAP_OR_FAIL(fopen);
 	if (g_disable_redirect || tl_disable_redirect) return __real_fopen( path, mode);
 
-	FILE *ptr = __real_fopen(path,mode);
+	FILE *ptr = hvac_fopen_stream(path, mode, &handled);
+	if (handled)
+	{
+		return ptr;
+	}
+
+	uint64_t t0 = hvac_cstat_begin();
+	bool tracked = false;
+	ptr = __real_fopen(path,mode);
 
 	if (ptr != NULL)
 	{
-		if (hvac_track_file(path, O_RDONLY, fileno(ptr)))
+		if ((tracked = hvac_track_file(path, O_RDONLY, fileno(ptr))))
 		{
 			L4C_INFO("FOpen: Tracking File %s",path);
 		}
 	}	
+	hvac_cstat_end(HVAC_CSTAT_OPEN, hvac_cstat_open_outcome(tracked), t0);
 	
 	return ptr;
 }
@@ -60,23 +259,54 @@ FILE *WRAP_DECL(fopen)(const char *path, const char *mode)
 /* fopen wrapper */
 FILE *WRAP_DECL(fopen64)(const char *path, const char *mode)
 {
+	bool handled;
 
 	MAP_OR_FAIL(fopen64);
 	if (g_disable_redirect || tl_disable_redirect) return __real_fopen64( path, mode);
 
-	FILE *ptr = __real_fopen64(path,mode);
+	FILE *ptr = hvac_fopen_stream(path, mode, &handled);
+	if (handled)
+	{
+		return ptr;
+	}
+
+	uint64_t t0 = hvac_cstat_begin();
+	bool tracked = false;
+	ptr = __real_fopen64(path,mode);
 
 	if (ptr != NULL)
 	{
-		if (hvac_track_file(path, O_RDONLY, fileno(ptr)))
+		if ((tracked = hvac_track_file(path, O_RDONLY, fileno(ptr))))
 		{
 			L4C_INFO("FOpen64: Tracking File %s",path);
 		}
 	}	
+	hvac_cstat_end(HVAC_CSTAT_OPEN, hvac_cstat_open_outcome(tracked), t0);
 	
 	return ptr;
 }
 
+/* Cookie streams have no fd as far as glibc knows, ours do */
+int WRAP_DECL(fileno)(FILE *stream)
+{
+	MAP_OR_FAIL(fileno);
+	int saved = errno;
+	int fd = __real_fileno(stream);
+	if (fd == -1 && stream != NULL && (fd = hvac_stream_fd(stream)) != -1)
+		errno = saved;
+	return fd;
+}
+
+int WRAP_DECL(fileno_unlocked)(FILE *stream)
+{
+	MAP_OR_FAIL(fileno_unlocked);
+	int saved = errno;
+	int fd = __real_fileno_unlocked(stream);
+	if (fd == -1 && stream != NULL && (fd = hvac_stream_fd(stream)) != -1)
+		errno = saved;
+	return fd;
+}
+
 int WRAP_DECL(open)(const char *pathname, int flags, ...)
 {
 	int ret = 0;
@@ -99,15 +329,18 @@ int WRAP_DECL(open)(const char *pathname, int flags, ...)
 	 * If this impedes performance we can investigate a cheap way of generating
 	 * an FD
 	 */
+	uint64_t t0 = hvac_cstat_begin();
+	bool tracked = false;
 	ret = __real_open(pathname, flags, mode);
 
 	// C++ code determines whether to track
 	if (ret != -1){
-		if (hvac_track_file(pathname, flags, ret))
+		if ((tracked = hvac_track_file(pathname, flags, ret)))
 		{
 			L4C_INFO("Open: Tracking File %s",pathname);
 		}
 	}
+	hvac_cstat_end(HVAC_CSTAT_OPEN, hvac_cstat_open_outcome(tracked), t0);
 	
 	return ret;
 }
@@ -131,6 +364,8 @@ int WRAP_DECL(open64)(const char *pathname, int flags, ...)
 	if (g_disable_redirect || tl_disable_redirect) return __real_open64(pathname, flags, mode);	
 
 
+	uint64_t t0 = hvac_cstat_begin();
+	bool tracked = false;
 	if (mode)
 	{
 		ret = __real_open64(pathname, flags, mode);
@@ -143,11 +378,12 @@ int WRAP_DECL(open64)(const char *pathname, int flags, ...)
 
 	if (ret != -1)
 	{
-		if (hvac_track_file(pathname, flags, ret))
+		if ((tracked = hvac_track_file(pathname, flags, ret)))
 		{
 			L4C_INFO("Open64: Tracking file %s",pathname);
 		}
 	}
+	hvac_cstat_end(HVAC_CSTAT_OPEN, hvac_cstat_open_outcome(tracked), t0);
 
 	
 	return ret;
@@ -164,6 +400,7 @@ int WRAP_DECL(close)(int fd)
 	MAP_OR_FAIL(close);
 	if (g_disable_redirect || tl_disable_redirect) return __real_close(fd);
 
+	uint64_t t0 = hvac_cstat_begin();
 	const char *path = hvac_get_path(fd);
 	if (path)
 	{
@@ -174,7 +411,9 @@ int WRAP_DECL(close)(int fd)
 //	hvac_remote_close(fd);
 
 	/* Close the passed in file-descriptor tracked or not */
-	if ((ret = __real_close(fd)) != 0)
+	ret = __real_close(fd);
+	hvac_cstat_end(HVAC_CSTAT_CLOSE, path ? HVAC_CSTAT_REMOTE : HVAC_CSTAT_UNTRACKED, t0);
+	if (ret != 0)
 	{
 		L4C_PERROR("Error from close");
 		return ret;
@@ -191,23 +430,35 @@ ssize_t WRAP_DECL(read)(int fd, void *buf, size_t count)
 	//remove me
     MAP_OR_FAIL(read);	
 	
-    const char *path = hvac_get_path(fd);
+	uint64_t t0 = hvac_cstat_begin();
+    const char *path = tl_disable_redirect ? NULL : hvac_get_path(fd);
 	if(path == NULL){
 		ret = __real_read(fd,buf,count);
+		hvac_cstat_end(HVAC_CSTAT_READ, HVAC_CSTAT_UNTRACKED, t0);
 		return ret;
 	}
 
 	ret = hvac_remote_read(fd,buf,count);
+	int outcome = HVAC_CSTAT_REMOTE;
 
 	if (path)
     {
         L4C_INFO("Read to file %s of size %ld returning %ld bytes",path,count,ret);
     }
 	
+	/* The file position is kept by HVAC, fall back at that position */
 	if (ret == -1)
 	{
-		ret = __real_read(fd,buf,count);	
+		MAP_OR_FAIL(pread);
+		off64_t pos = hvac_get_offset(fd);
+		ret = __real_pread(fd,buf,count,pos);
+		if (ret > 0)
+		{
+			hvac_set_offset(fd, pos + ret);
+		}
+		outcome = HVAC_CSTAT_FALLBACK;
 	}
+	hvac_cstat_end(HVAC_CSTAT_READ, outcome, t0);
 		
     return ret;
 }
@@ -215,39 +466,93 @@ ssize_t WRAP_DECL(read)(int fd, void *buf, size_t count)
 ssize_t WRAP_DECL(pread)(int fd, void *buf, size_t count, off_t offset)
 {
 	ssize_t ret = -1;
+	int outcome = HVAC_CSTAT_UNTRACKED;
 	MAP_OR_FAIL(pread);
 
-	const char *path = hvac_get_path(fd);
+	uint64_t t0 = hvac_cstat_begin();
+	/* HVAC's own PFS reads of tracked files, hedges for one */
+	const char *path = tl_disable_redirect ? NULL : hvac_get_path(fd);
 
 	if (path)
 	{                
 		L4C_INFO("pread to tracked file %s",path);
 		ret = hvac_remote_pread(fd, buf, count, offset);
-	//	ret = __real_pread(fd,buf,count,offset);
+		outcome = HVAC_CSTAT_REMOTE;
 	}
-	else
+
+	/* Untracked, or the server could not serve it */
+	if (ret == -1)
 	{
 		ret = __real_pread(fd,buf,count,offset);
+		if (path)
+			outcome = HVAC_CSTAT_FALLBACK;
 	}
+	hvac_cstat_end(HVAC_CSTAT_PREAD, outcome, t0);
 
 	return ret;
 }
 
 
 
+ssize_t WRAP_DECL(pread64)(int fd, void *buf, size_t count, off64_t offset)
+{
+	ssize_t ret = -1;
+	int outcome = HVAC_CSTAT_UNTRACKED;
+	MAP_OR_FAIL(pread64);
+
+	uint64_t t0 = hvac_cstat_begin();
+	const char *path = tl_disable_redirect ? NULL : hvac_get_path(fd);
+
+	if (path)
+	{
+		L4C_INFO("pread64 to tracked file %s",path);
+		ret = hvac_remote_pread(fd, buf, count, offset);
+		outcome = HVAC_CSTAT_REMOTE;
+	}
+
+	if (ret == -1)
+	{
+		ret = __real_pread64(fd,buf,count,offset);
+		if (path)
+			outcome = HVAC_CSTAT_FALLBACK;
+	}
+	hvac_cstat_end(HVAC_CSTAT_PREAD, outcome, t0);
+
+	return ret;
+}
+
 ssize_t WRAP_DECL(read64)(int fd, void *buf, size_t count)
 {
-	//remove me
+	ssize_t ret = -1;
+	int outcome = HVAC_CSTAT_REMOTE;
 	MAP_OR_FAIL(read64);
 
+	uint64_t t0 = hvac_cstat_begin();
+	const char *path = tl_disable_redirect ? NULL : hvac_get_path(fd);
+	if (path == NULL)
+	{
+		ret = __real_read64(fd,buf,count);
+		hvac_cstat_end(HVAC_CSTAT_READ, HVAC_CSTAT_UNTRACKED, t0);
+		return ret;
+	}
 
-	const char *path = hvac_get_path(fd);
-	if (path)
+	ret = hvac_remote_read(fd,buf,count);
+	L4C_INFO("Read64 to file %s of size %ld returning %ld bytes",path,count,ret);
+
+	if (ret == -1)
 	{
-		L4C_INFO("Read64 to file %s of size %ld",path,count);
+		MAP_OR_FAIL(pread);
+		off64_t pos = hvac_get_offset(fd);
+		ret = __real_pread(fd,buf,count,pos);
+		if (ret > 0)
+		{
+			hvac_set_offset(fd, pos + ret);
+		}
+		outcome = HVAC_CSTAT_FALLBACK;
 	}
+	hvac_cstat_end(HVAC_CSTAT_READ, outcome, t0);
 
-	return __real_read64(fd,buf,count);
+	return ret;
 }
 
 ssize_t WRAP_DECL(write)(int fd, const void *buf, size_t count)
@@ -270,50 +575,279 @@ off_t WRAP_DECL(lseek)(int fd, off_t offset, int whence)
 	MAP_OR_FAIL(lseek);
 	if (g_disable_redirect || tl_disable_redirect) return __real_lseek(fd,offset,whence);
 
+	/* Positions of tracked files are kept locally - no RPC */
+	off_t ret;
+	uint64_t t0 = hvac_cstat_begin();
 	if (hvac_file_tracked(fd)){
 		L4C_INFO("Got an LSEEK on a tracked file %d %ld\n", fd, offset);	
-		return hvac_remote_lseek(fd,offset,whence);
+		ret = hvac_remote_lseek(fd,offset,whence);
+		hvac_cstat_end(HVAC_CSTAT_SEEK, HVAC_CSTAT_REMOTE, t0);
+		return ret;
 	}
-	return __real_lseek(fd, offset, whence);
+	ret = __real_lseek(fd, offset, whence);
+	hvac_cstat_end(HVAC_CSTAT_SEEK, HVAC_CSTAT_UNTRACKED, t0);
+	return ret;
 }
 
 off64_t WRAP_DECL(lseek64)(int fd, off64_t offset, int whence)
 {
 	MAP_OR_FAIL(lseek64);
 	if (g_disable_redirect || tl_disable_redirect) return __real_lseek64(fd,offset,whence);
+	off64_t ret;
+	uint64_t t0 = hvac_cstat_begin();
 	if (hvac_file_tracked(fd)){
 		L4C_INFO("Got an LSEEK64 on a tracked file %d %ld\n", fd, offset);	
-		return hvac_remote_lseek(fd,offset,whence);
+		ret = hvac_remote_lseek(fd,offset,whence);
+		hvac_cstat_end(HVAC_CSTAT_SEEK, HVAC_CSTAT_REMOTE, t0);
+		return ret;
 	}
-	return __real_lseek64(fd, offset, whence);
+	ret = __real_lseek64(fd, offset, whence);
+	hvac_cstat_end(HVAC_CSTAT_SEEK, HVAC_CSTAT_UNTRACKED, t0);
+	return ret;
 }
 
 ssize_t WRAP_DECL(readv)(int fd, const struct iovec *iov, int iovcnt)
 {
+	ssize_t ret = -1;
+	int outcome = HVAC_CSTAT_REMOTE;
 	MAP_OR_FAIL(readv);
+
+	uint64_t t0 = hvac_cstat_begin();
+	const char *path = tl_disable_redirect ? NULL : hvac_get_path(fd);
+	if (path == NULL)
+	{
+		ret = __real_readv(fd, iov, iovcnt);
+		hvac_cstat_end(HVAC_CSTAT_READ, HVAC_CSTAT_UNTRACKED, t0);
+		return ret;
+	}
+
+	ret = hvac_remote_readv(fd, iov, iovcnt, -1);
+	L4C_INFO("Readv to tracked file %s segments %d returning %ld bytes",path,iovcnt,ret);
+
+	if (ret == -1)
+	{
+		MAP_OR_FAIL(preadv);
+		off64_t pos = hvac_get_offset(fd);
+		ret = __real_preadv(fd, iov, iovcnt, pos);
+		if (ret > 0)
+		{
+			hvac_set_offset(fd, pos + ret);
+		}
+		outcome = HVAC_CSTAT_FALLBACK;
+	}
+	hvac_cstat_end(HVAC_CSTAT_READ, outcome, t0);
+
+	return ret;
+}
+
+ssize_t WRAP_DECL(preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t ret = -1;
+	int outcome = HVAC_CSTAT_REMOTE;
+	MAP_OR_FAIL(preadv);
+
+	uint64_t t0 = hvac_cstat_begin();
+	/* HVAC's own PFS reads of tracked files, hedges for one */
+	const char *path = tl_disable_redirect ? NULL : hvac_get_path(fd);
+	if (path == NULL)
+	{
+		ret = __real_preadv(fd, iov, iovcnt, offset);
+		hvac_cstat_end(HVAC_CSTAT_PREAD, HVAC_CSTAT_UNTRACKED, t0);
+		return ret;
+	}
+
+	L4C_INFO("Preadv to tracked file %s segments %d",path,iovcnt);
+	ret = hvac_remote_readv(fd, iov, iovcnt, offset);
+
+	if (ret == -1)
+	{
+		ret = __real_preadv(fd, iov, iovcnt, offset);
+		outcome = HVAC_CSTAT_FALLBACK;
+	}
+	hvac_cstat_end(HVAC_CSTAT_PREAD, outcome, t0);
+
+	return ret;
+}
+
+ssize_t WRAP_DECL(preadv64)(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
+{
+	ssize_t ret = -1;
+	int outcome = HVAC_CSTAT_REMOTE;
+	MAP_OR_FAIL(preadv64);
+
+	uint64_t t0 = hvac_cstat_begin();
+	const char *path = tl_disable_redirect ? NULL : hvac_get_path(fd);
+	if (path == NULL)
+	{
+		ret = __real_preadv64(fd, iov, iovcnt, offset);
+		hvac_cstat_end(HVAC_CSTAT_PREAD, HVAC_CSTAT_UNTRACKED, t0);
+		return ret;
+	}
+
+	L4C_INFO("Preadv64 to tracked file %s segments %d",path,iovcnt);
+	ret = hvac_remote_readv(fd, iov, iovcnt, offset);
+
+	if (ret == -1)
+	{
+		ret = __real_preadv64(fd, iov, iovcnt, offset);
+		outcome = HVAC_CSTAT_FALLBACK;
+	}
+	hvac_cstat_end(HVAC_CSTAT_PREAD, outcome, t0);
+
+	return ret;
+}
+
+/* The RWF_* flags are per-call hints (NOWAIT, HIPRI...). The cache either has
+ * the data or goes to the PFS copy, so they are ignored on the HVAC path.
+ */
+ssize_t WRAP_DECL(preadv2)(int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)
+{
+	ssize_t ret = -1;
+	int op = (offset == -1) ? HVAC_CSTAT_READ : HVAC_CSTAT_PREAD;
+	int outcome = HVAC_CSTAT_REMOTE;
+	MAP_OR_FAIL(preadv2);
+
+	uint64_t t0 = hvac_cstat_begin();
+	const char *path = tl_disable_redirect ? NULL : hvac_get_path(fd);
+	if (path == NULL)
+	{
+		ret = __real_preadv2(fd, iov, iovcnt, offset, flags);
+		hvac_cstat_end(op, HVAC_CSTAT_UNTRACKED, t0);
+		return ret;
+	}
+
+	L4C_INFO("Preadv2 to tracked file %s segments %d",path,iovcnt);
+	ret = hvac_remote_readv(fd, iov, iovcnt, offset);
+
+	if (ret == -1)
+	{
+		off64_t pos = (offset == -1) ? hvac_get_offset(fd) : offset;
+		ret = __real_preadv2(fd, iov, iovcnt, pos, flags);
+		if (offset == -1 && ret > 0)
+		{
+			hvac_set_offset(fd, pos + ret);
+		}
+		outcome = HVAC_CSTAT_FALLBACK;
+	}
+	hvac_cstat_end(op, outcome, t0);
+
+	return ret;
+}
+
+/* Tracked files are mapped as anonymous private memory and filled from HVAC
+ * in HVAC_MMAP_CHUNK sized reads, then given the protection the caller asked
+ * for. Pages past EOF are left zero filled.  Writable shared mappings must
+ * reach the real file so they always go to the file system, as do mappings
+ * over the HVAC_MMAP_MAX_MB limit since the whole range is read up front.
+ */
+static size_t hvac_mmap_max_bytes()
+{
+	static ssize_t max_bytes = -1;
+
+	/* Racing first calls compute the same value */
+	if (max_bytes < 0)
+	{
+		const char *env = getenv("HVAC_MMAP_MAX_MB");
+		size_t mb = env ? strtoull(env, NULL, 10) : HVAC_MMAP_MAX_MB;
+		max_bytes = (ssize_t)(mb * 1024 * 1024);
+	}
+	return (size_t)max_bytes;
+}
+
+static void *hvac_mmap_tracked(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	void *map;
+	size_t filled = 0;
+	ssize_t bytes;
+
+	MAP_OR_FAIL(mmap);
+	if ((flags & MAP_SHARED) && (prot & PROT_WRITE))
+	{
+		return MAP_FAILED;
+	}
+	if (length > hvac_mmap_max_bytes())
+	{
+		L4C_INFO("MMAP of %zu bytes is over the HVAC limit, mapping the file", length);
+		return MAP_FAILED;
+	}
+
+	map = __real_mmap(addr, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | (flags & (MAP_FIXED | MAP_FIXED_NOREPLACE)), -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return MAP_FAILED;
+	}
+
+	while (filled < length)
+	{
+		size_t chunk = length - filled;
+		if (chunk > HVAC_MMAP_CHUNK)
+			chunk = HVAC_MMAP_CHUNK;
+
+		bytes = hvac_remote_pread(fd, (char *)map + filled, chunk, offset + filled);
+		if (bytes == -1)
+		{
+			munmap(map, length);
+			return MAP_FAILED;
+		}
+		filled += bytes;
+		/* Short read means we hit EOF */
+		if ((size_t)bytes < chunk)
+			break;
+	}
+
+	if (prot != (PROT_READ | PROT_WRITE) && mprotect(map, length, prot) != 0)
+	{
+		munmap(map, length);
+		return MAP_FAILED;
+	}
+
+	return map;
+}
+
+void *WRAP_DECL(mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	void *ret = MAP_FAILED;
+	MAP_OR_FAIL(mmap);
+	if (g_disable_redirect || tl_disable_redirect || fd < 0 || (flags & MAP_ANONYMOUS))
+		return __real_mmap(addr, length, prot, flags, fd, offset);
+
 	const char *path = hvac_get_path(fd);
 	if (path)
 	{
-		L4C_INFO("Readv to tracked file %s",path);
+		L4C_INFO("MMAP to tracked file %s Length %ld Offset %ld",path, length, offset);
+		ret = hvac_mmap_tracked(addr, length, prot, flags, fd, offset);
 	}
 
-	return __real_readv(fd, iov, iovcnt);
+	if (ret == MAP_FAILED)
+	{
+		ret = __real_mmap(addr, length, prot, flags, fd, offset);
+	}
 
+	return ret;
 }
-/*
-   void* WRAP_DECL(mmap)(void *addr, ssize_t length, int prot, int flags, int fd, off_t offset)
-   {
-   MAP_OR_FAIL(mmap);
-   if (path)
-   {
-   L4C_INFO("MMAP to tracked file %s Length %ld Offset %ld",path, length, offset);
-   }
 
-   return __real_mmap(addr,length, prot, flags, fd, offset);
+void *WRAP_DECL(mmap64)(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+	void *ret = MAP_FAILED;
+	MAP_OR_FAIL(mmap64);
+	if (g_disable_redirect || tl_disable_redirect || fd < 0 || (flags & MAP_ANONYMOUS))
+		return __real_mmap64(addr, length, prot, flags, fd, offset);
 
-   }
-   */
+	const char *path = hvac_get_path(fd);
+	if (path)
+	{
+		L4C_INFO("MMAP64 to tracked file %s Length %ld Offset %ld",path, length, offset);
+		ret = hvac_mmap_tracked(addr, length, prot, flags, fd, offset);
+	}
+
+	if (ret == MAP_FAILED)
+	{
+		ret = __real_mmap64(addr, length, prot, flags, fd, offset);
+	}
 
+	return ret;
+}
 
 #if 0
 
@@ -0,0 +1,613 @@
+/* hvac_bench - data loader style workload against local HVAC servers
+ *
+ * Generates a synthetic dataset, optionally starts hvac_server instances on
+ * this node, then replays shuffled multi-epoch whole-file reads from
+ * processes x threads workers. The workload runs once without and once with
+ * LD_PRELOAD=libhvac_client.so so the two can be compared directly.
+ *
+ *   hvac_bench -L ./src/libhvac_client.so -B ./src/hvac_server -n 2
+ *
+ * Options
+ *   -d dir      dataset directory (./hvac_bench_data)
+ *   -f files    number of files (1000)
+ *   -s bytes    mean file size, k/m/g suffixes allowed (128k)
+ *   -D dist     fixed, uniform (0.5x-1.5x) or lognormal (sigma 0.5) sizes (fixed)
+ *   -g          regenerate the dataset even if a manifest exists
+ *   -e epochs   epochs per run (3)
+ *   -p procs    worker processes (1)
+ *   -t threads  threads per process (4)
+ *   -r bytes    read size, 0 reads each file with a single read (0)
+ *   -m mode     read, pread or fread (read)
+ *   -S seed     shuffle seed (1)
+ *   -L lib      libhvac_client.so, without it only the baseline runs
+ *   -B server   hvac_server binary to start (hvac_server)
+ *   -n servers  servers to start, 0 attaches to $SLURM_JOBID/$HVAC_SERVER_COUNT (1)
+ *   -T info     Mercury transport for started servers (na+sm)
+ *   -b dir      BBPATH for started servers (<dataset>/bb)
+ *   -o format   text or csv (text)
+ *
+ * Samples live in <dataset>/data, which is what HVAC_DATA_DIR points at.
+ */
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <atomic>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "hvac_histogram.h"
+
+using namespace std;
+
+struct bench_opts {
+    string dir = "./hvac_bench_data";
+    int files = 1000;
+    uint64_t size = 128 * 1024;
+    string dist = "fixed";
+    bool regen = false;
+    int epochs = 3;
+    int procs = 1;
+    int threads = 4;
+    uint64_t read_size = 0;
+    string mode = "read";
+    uint64_t seed = 1;
+    string lib;
+    string server = "hvac_server";
+    int servers = 1;
+    string transport = "na+sm";
+    string bbpath;
+    string format = "text";
+};
+
+/* One record per worker process and epoch, sent over a pipe to the parent */
+struct bench_epoch_result {
+    int32_t epoch;
+    int32_t errors;
+    uint64_t samples;
+    uint64_t bytes;
+    uint64_t wall_ns;
+    struct hvac_histogram lat;
+};
+
+static bench_opts opts;
+static vector<string> bench_files;
+static uint64_t bench_max_size = 0;
+
+static uint64_t bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t bench_parse_size(const char *str)
+{
+    char *end;
+    uint64_t v = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; /* fall through */
+    case 'm': case 'M': v <<= 10; /* fall through */
+    case 'k': case 'K': v <<= 10;
+    }
+    return v;
+}
+
+static string bench_manifest()
+{
+    return opts.dir + "/manifest";
+}
+
+static string bench_data_dir()
+{
+    return opts.dir + "/data";
+}
+
+static void bench_generate()
+{
+    mt19937_64 rng(opts.seed);
+    lognormal_distribution<double> lognormal(log((double)opts.size) - 0.125, 0.5);
+    uniform_int_distribution<uint64_t> uniform(opts.size / 2, opts.size + opts.size / 2);
+    vector<char> buf(1 << 20);
+
+    mkdir(opts.dir.c_str(), 0755);
+    mkdir(bench_data_dir().c_str(), 0755);
+    for (size_t i = 0; i < buf.size(); i++)
+        buf[i] = (char)rng();
+
+    FILE *manifest = fopen(bench_manifest().c_str(), "w");
+    if (manifest == NULL)
+    {
+        perror("manifest");
+        exit(1);
+    }
+
+    for (int i = 0; i < opts.files; i++)
+    {
+        uint64_t size = opts.size;
+        if (opts.dist == "uniform")
+            size = uniform(rng);
+        else if (opts.dist == "lognormal")
+            size = (uint64_t)lognormal(rng);
+
+        char name[PATH_MAX];
+        snprintf(name, sizeof(name), "%s/sample_%06d.bin", bench_data_dir().c_str(), i);
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+        {
+            perror(name);
+            exit(1);
+        }
+        for (uint64_t done = 0; done < size;)
+        {
+            size_t chunk = min((uint64_t)buf.size(), size - done);
+            ssize_t ret = write(fd, buf.data(), chunk);
+            if (ret <= 0)
+            {
+                perror(name);
+                exit(1);
+            }
+            done += ret;
+        }
+        close(fd);
+        fprintf(manifest, "%s %lu\n", name, (unsigned long)size);
+    }
+    fclose(manifest);
+}
+
+static void bench_load_manifest()
+{
+    char name[PATH_MAX];
+    unsigned long size;
+
+    FILE *manifest = fopen(bench_manifest().c_str(), "r");
+    if (manifest == NULL)
+    {
+        perror("manifest");
+        exit(1);
+    }
+    bench_files.clear();
+    while (fscanf(manifest, "%s %lu\n", name, &size) == 2)
+    {
+        bench_files.push_back(name);
+        bench_max_size = max(bench_max_size, (uint64_t)size);
+    }
+    fclose(manifest);
+}
+
+/* Worker side */
+
+struct bench_thread {
+    pthread_t tid;
+    const vector<int> *order;
+    std::atomic<size_t> *next;
+    uint64_t samples;
+    uint64_t bytes;
+    int errors;
+    struct hvac_histogram lat;
+};
+
+static ssize_t bench_read_sample(const char *path, char *buf, size_t bufsize)
+{
+    ssize_t total = 0, ret;
+
+    if (opts.mode == "fread")
+    {
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL)
+            return -1;
+        while ((ret = fread(buf, 1, bufsize, fp)) > 0)
+            total += ret;
+        fclose(fp);
+        return total;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    for (;;)
+    {
+        if (opts.mode == "pread")
+            ret = pread(fd, buf, bufsize, total);
+        else
+            ret = read(fd, buf, bufsize);
+        if (ret <= 0)
+            break;
+        total += ret;
+    }
+    close(fd);
+    return ret < 0 ? -1 : total;
+}
+
+static void *bench_thread_fn(void *args)
+{
+    bench_thread *t = (bench_thread *)args;
+    size_t bufsize = opts.read_size;
+
+    /* Whole file reads size the buffer to the largest sample */
+    if (bufsize == 0)
+        bufsize = max(bench_max_size, (uint64_t)4096);
+    char *buf = (char *)malloc(bufsize);
+
+    for (;;)
+    {
+        size_t idx = t->next->fetch_add(1);
+        if (idx >= t->order->size())
+            break;
+        const char *path = bench_files[(*t->order)[idx]].c_str();
+        uint64_t start = bench_now();
+        ssize_t ret = bench_read_sample(path, buf, bufsize);
+        hvac_hist_add(&t->lat, bench_now() - start);
+        if (ret < 0)
+        {
+            t->errors++;
+            continue;
+        }
+        t->samples++;
+        t->bytes += ret;
+    }
+    free(buf);
+    return NULL;
+}
+
+static int bench_worker(int rank, int out_fd)
+{
+    bench_load_manifest();
+
+    for (int epoch = 0; epoch < opts.epochs; epoch++)
+    {
+        /* Every process shuffles the same way and takes its stride */
+        vector<int> all(bench_files.size()), mine;
+        for (size_t i = 0; i < all.size(); i++)
+            all[i] = i;
+        mt19937_64 rng(opts.seed + epoch);
+        shuffle(all.begin(), all.end(), rng);
+        for (size_t i = rank; i < all.size(); i += opts.procs)
+            mine.push_back(all[i]);
+
+        std::atomic<size_t> next(0);
+        vector<bench_thread> threads(opts.threads);
+        uint64_t start = bench_now();
+        for (bench_thread &t : threads)
+        {
+            memset(&t.lat, 0, sizeof(t.lat));
+            t.order = &mine;
+            t.next = &next;
+            t.samples = t.bytes = 0;
+            t.errors = 0;
+            pthread_create(&t.tid, NULL, bench_thread_fn, &t);
+        }
+
+        bench_epoch_result *res = (bench_epoch_result *)calloc(1, sizeof(*res));
+        for (bench_thread &t : threads)
+        {
+            pthread_join(t.tid, NULL);
+            res->samples += t.samples;
+            res->bytes += t.bytes;
+            res->errors += t.errors;
+            hvac_hist_merge(&res->lat, &t.lat);
+        }
+        res->epoch = epoch;
+        res->wall_ns = bench_now() - start;
+
+        /* Results are small enough for one atomic pipe write per record */
+        const char *p = (const char *)res;
+        size_t left = sizeof(*res);
+        while (left > 0)
+        {
+            ssize_t ret = write(out_fd, p, left);
+            if (ret <= 0)
+                break;
+            p += ret;
+            left -= ret;
+        }
+        free(res);
+    }
+    return 0;
+}
+
+/* Parent side */
+
+static pid_t bench_spawn(const vector<string> &args, const map<string, string> &env)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    for (auto &e : env)
+    {
+        if (e.second.empty())
+            unsetenv(e.first.c_str());
+        else
+            setenv(e.first.c_str(), e.second.c_str(), 1);
+    }
+    vector<char *> argv;
+    for (const string &a : args)
+        argv.push_back((char *)a.c_str());
+    argv.push_back(NULL);
+    execvp(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(127);
+}
+
+static string bench_jobid;
+static vector<pid_t> bench_servers;
+
+static void bench_stop_servers()
+{
+    for (pid_t pid : bench_servers)
+        kill(pid, SIGTERM);
+    for (pid_t pid : bench_servers)
+        waitpid(pid, NULL, 0);
+    bench_servers.clear();
+    if (!bench_jobid.empty())
+    {
+        unlink((string("./.ports.cfg.") + bench_jobid).c_str());
+        unlink((string("./.ports.tbl.") + bench_jobid).c_str());
+        shm_unlink((string("/hvac_addr.") + bench_jobid).c_str());
+    }
+}
+
+static void bench_start_servers()
+{
+    string ports = string("./.ports.cfg.") + bench_jobid;
+    unlink(ports.c_str());
+    unlink((string("./.ports.tbl.") + bench_jobid).c_str());
+    if (opts.bbpath.empty())
+        opts.bbpath = opts.dir + "/bb";
+    mkdir(opts.bbpath.c_str(), 0755);
+
+    for (int i = 0; i < opts.servers; i++)
+    {
+        map<string, string> env = {
+            { "PMI_RANK", to_string(i) },
+            { "SLURM_JOBID", bench_jobid },
+            { "HVAC_TRANSPORT", opts.transport },
+            { "BBPATH", opts.bbpath },
+            { "LD_PRELOAD", "" },
+        };
+        bench_servers.push_back(bench_spawn({ opts.server, to_string(opts.servers) }, env));
+    }
+
+    /* Servers append one "rank addr sm_addr host" line once they listen */
+    for (int waited = 0; waited < 300; waited++)
+    {
+        int lines = 0;
+        for (pid_t pid : bench_servers)
+        {
+            if (waitpid(pid, NULL, WNOHANG) == pid)
+            {
+                fprintf(stderr, "%s exited during startup\n", opts.server.c_str());
+                bench_servers.erase(find(bench_servers.begin(), bench_servers.end(), pid));
+                bench_stop_servers();
+                exit(1);
+            }
+        }
+        char line[PATH_MAX];
+        FILE *fp = fopen(ports.c_str(), "r");
+        if (fp)
+        {
+            while (fgets(line, sizeof(line), fp))
+                lines++;
+            fclose(fp);
+        }
+        /* Addresses are posted after the RPCs are registered */
+        if (lines >= opts.servers)
+            return;
+        usleep(100000);
+    }
+    fprintf(stderr, "Servers did not post their addresses to %s\n", ports.c_str());
+    bench_stop_servers();
+    exit(1);
+}
+
+static map<int, bench_epoch_result *> bench_run(const char *label, bool preload)
+{
+    map<int, bench_epoch_result *> epochs;
+    map<int, uint64_t> max_wall;
+    vector<pid_t> workers;
+    int fds[2];
+
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    for (int rank = 0; rank < opts.procs; rank++)
+    {
+        map<string, string> env;
+        env["LD_PRELOAD"] = preload ? opts.lib : "";
+        if (preload)
+        {
+            char real[PATH_MAX];
+            env["HVAC_DATA_DIR"] = realpath(bench_data_dir().c_str(), real) ? real : bench_data_dir();
+            env["SLURM_JOBID"] = bench_jobid;
+            env["HVAC_SERVER_COUNT"] = to_string(opts.servers > 0 ? opts.servers : atoi(getenv("HVAC_SERVER_COUNT")));
+            env["HVAC_TRANSPORT"] = opts.transport;
+            env["PMI_RANK"] = to_string(rank);
+        }
+        vector<string> args = { "/proc/self/exe", "--worker", to_string(rank), to_string(fds[1]) };
+        for (const string &a : { string("-d"), opts.dir, string("-e"), to_string(opts.epochs),
+                                 string("-p"), to_string(opts.procs), string("-t"), to_string(opts.threads),
+                                 string("-r"), to_string(opts.read_size), string("-m"), opts.mode,
+                                 string("-S"), to_string(opts.seed) })
+            args.push_back(a);
+        workers.push_back(bench_spawn(args, env));
+    }
+    close(fds[1]);
+
+    bench_epoch_result res;
+    for (;;)
+    {
+        size_t got = 0;
+        while (got < sizeof(res))
+        {
+            ssize_t ret = read(fds[0], (char *)&res + got, sizeof(res) - got);
+            if (ret <= 0)
+                break;
+            got += ret;
+        }
+        if (got < sizeof(res))
+            break;
+
+        bench_epoch_result *&total = epochs[res.epoch];
+        if (total == NULL)
+        {
+            total = (bench_epoch_result *)calloc(1, sizeof(*total));
+            total->epoch = res.epoch;
+        }
+        total->samples += res.samples;
+        total->bytes += res.bytes;
+        total->errors += res.errors;
+        hvac_hist_merge(&total->lat, &res.lat);
+        /* Processes run the epoch concurrently, the slowest one sets the pace */
+        total->wall_ns = max(total->wall_ns, res.wall_ns);
+    }
+    close(fds[0]);
+
+    for (pid_t pid : workers)
+    {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "%s worker %d exited abnormally\n", label, (int)pid);
+    }
+    return epochs;
+}
+
+static void bench_report(const char *label, map<int, bench_epoch_result *> &epochs)
+{
+    for (auto &it : epochs)
+    {
+        bench_epoch_result *r = it.second;
+        double secs = r->wall_ns / 1e9;
+        double sps = secs > 0 ? r->samples / secs : 0;
+        double mbs = secs > 0 ? r->bytes / secs / 1e6 : 0;
+        if (opts.format == "csv")
+        {
+            printf("%s,%d,%lu,%lu,%d,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n", label, r->epoch,
+                   (unsigned long)r->samples, (unsigned long)r->bytes, r->errors, secs, sps, mbs,
+                   hvac_hist_quantile(&r->lat, 0.5) / 1e3, hvac_hist_quantile(&r->lat, 0.99) / 1e3,
+                   hvac_hist_quantile(&r->lat, 0.999) / 1e3, r->lat.max / 1e3);
+        }
+        else
+        {
+            printf("%-9s %5d %9lu %6d %8.2f %11.1f %9.1f %10.1f %10.1f %10.1f %10.1f\n", label,
+                   r->epoch, (unsigned long)r->samples, r->errors, secs, sps, mbs,
+                   hvac_hist_quantile(&r->lat, 0.5) / 1e3, hvac_hist_quantile(&r->lat, 0.99) / 1e3,
+                   hvac_hist_quantile(&r->lat, 0.999) / 1e3, r->lat.max / 1e3);
+        }
+        free(r);
+    }
+    fflush(stdout);
+}
+
+static void bench_usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d dir] [-f files] [-s size] [-D fixed|uniform|lognormal] [-g]\n"
+                    "       [-e epochs] [-p procs] [-t threads] [-r readsize] [-m read|pread|fread]\n"
+                    "       [-S seed] [-L libhvac_client.so] [-B hvac_server] [-n servers]\n"
+                    "       [-T transport] [-b bbpath] [-o text|csv]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int worker_rank = -1, worker_fd = -1;
+    int opt;
+
+    /* Workers are this binary re-executed: --worker rank fd <options> */
+    if (argc > 3 && strcmp(argv[1], "--worker") == 0)
+    {
+        worker_rank = atoi(argv[2]);
+        worker_fd = atoi(argv[3]);
+        argv += 3;
+        argc -= 3;
+    }
+
+    while ((opt = getopt(argc, argv, "d:f:s:D:ge:p:t:r:m:S:L:B:n:T:b:o:")) != -1)
+    {
+        switch (opt) {
+        case 'd': opts.dir = optarg; break;
+        case 'f': opts.files = atoi(optarg); break;
+        case 's': opts.size = bench_parse_size(optarg); break;
+        case 'D': opts.dist = optarg; break;
+        case 'g': opts.regen = true; break;
+        case 'e': opts.epochs = atoi(optarg); break;
+        case 'p': opts.procs = max(1, atoi(optarg)); break;
+        case 't': opts.threads = max(1, atoi(optarg)); break;
+        case 'r': opts.read_size = bench_parse_size(optarg); break;
+        case 'm': opts.mode = optarg; break;
+        case 'S': opts.seed = strtoull(optarg, NULL, 10); break;
+        case 'L': opts.lib = optarg; break;
+        case 'B': opts.server = optarg; break;
+        case 'n': opts.servers = atoi(optarg); break;
+        case 'T': opts.transport = optarg; break;
+        case 'b': opts.bbpath = optarg; break;
+        case 'o': opts.format = optarg; break;
+        default: bench_usage(argv[0]);
+        }
+    }
+    if (opts.mode != "read" && opts.mode != "pread" && opts.mode != "fread")
+        bench_usage(argv[0]);
+
+    if (worker_rank >= 0)
+        return bench_worker(worker_rank, worker_fd);
+
+    struct stat st;
+    if (opts.regen || stat(bench_manifest().c_str(), &st) != 0)
+    {
+        fprintf(stderr, "Generating %d files in %s\n", opts.files, opts.dir.c_str());
+        bench_generate();
+    }
+    bench_load_manifest();
+
+    if (opts.format == "csv")
+        printf("run,epoch,samples,bytes,errors,secs,samples_per_s,MB_per_s,p50_us,p99_us,p999_us,max_us\n");
+    else
+        printf("%-9s %5s %9s %6s %8s %11s %9s %10s %10s %10s %10s\n", "run", "epoch", "samples",
+               "errors", "secs", "samples/s", "MB/s", "p50_us", "p99_us", "p999_us", "max_us");
+
+    map<int, bench_epoch_result *> baseline = bench_run("baseline", false);
+    bench_report("baseline", baseline);
+
+    if (opts.lib.empty())
+        return 0;
+
+    if (opts.servers > 0)
+    {
+        bench_jobid = "hvac_bench." + to_string(getpid());
+        bench_start_servers();
+    }
+    else if (getenv("SLURM_JOBID") && getenv("HVAC_SERVER_COUNT"))
+    {
+        bench_jobid = getenv("SLURM_JOBID");
+    }
+    else
+    {
+        fprintf(stderr, "-n 0 attaches to running servers, set SLURM_JOBID and HVAC_SERVER_COUNT\n");
+        return 1;
+    }
+
+    map<int, bench_epoch_result *> hvac = bench_run("hvac", true);
+    bench_report("hvac", hvac);
+
+    if (opts.servers > 0)
+        bench_stop_servers();
+    return 0;
+}